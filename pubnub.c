@@ -5,6 +5,10 @@
 
 #include "contiki-net.h"
 #include "lib/assert.h"
+#include "lib/random.h"
+#if PUBNUB_PERSIST || (PUBNUB_SPOOL_SEGMENT > 0)
+#include "cfs/cfs.h"
+#endif
 
 #include <stdbool.h>
 #include <string.h>
@@ -42,6 +46,9 @@ PROCESS(pubnub_process, "PubNub process");
 process_event_t pubnub_publish_event;
 process_event_t pubnub_subscribe_event;
 process_event_t pubnub_leave_event;
+process_event_t pubnub_channel_group_event;
+process_event_t pubnub_time_event;
+process_event_t pubnub_history_event;
 
 #define HTTP_PORT 80
 
@@ -56,6 +63,14 @@ enum pubnub_trans {
     PBTT_PUBLISH,
     /** Leave (channel(s)) transaction */
     PBTT_LEAVE,
+    /** Change channels of a channel group transaction */
+    PBTT_CHANNEL_GROUP,
+    /** Time transaction */
+    PBTT_TIME,
+    /** History (of a channel) transaction */
+    PBTT_HISTORY,
+    /** Publish of message(s) from the spool */
+    PBTT_SPOOL,
 };
 
 /** States of a context */
@@ -66,7 +81,9 @@ enum pubnub_state {
     PS_TRANSACTION,
     PS_WAIT_CLOSE,
     PS_WAIT_CANCEL,
-    PS_WAIT_CANCEL_CLOSE
+    PS_WAIT_CANCEL_CLOSE,
+    PS_WAIT_RETRY,
+    PS_BUILD
 };
 
 /** The Pubnub context */
@@ -81,177 +98,2139 @@ struct pubnub {
     enum pubnub_trans trans;
     struct psock psock;
 
+    /** Outbound publish queue, highest priority first */
+    struct pubnub_pubreq *pubq;
+    /** The queued publish request(s) being sent, if any */
+    struct pubnub_pubreq *pubreq;
+
+    /** Maximum total length of messages to coalesce in one publish,
+        0: don't coalesce */
+    unsigned coalesce_max;
+    /** How long to wait for more messages to coalesce */
+    clock_time_t coalesce_window;
+    /** Timer of waiting for messages to coalesce or for a token */
+    struct ctimer holdoff_timer;
+    /** Timer of waiting to retry a failed transaction */
+    struct ctimer retry_timer;
+    /** Indicates that the queue is waiting for messages to coalesce
+        or for a token of the rate limiter */
+    bool holdoff;
+
+    /** Clock ticks per token of the publish rate limiter, 0: no limit */
+    clock_time_t rate_period;
+    /** Time the tokens were last added */
+    clock_time_t rate_last;
+    /** Maximum and current number of tokens */
+    unsigned char burst, tokens;
+    /** Number of publishes rejected and delayed by the rate limiter */
+    unsigned rate_rejected, rate_delayed;
+
+    /** Channels of the ongoing fan-out publish, NULL if the ongoing
+        transaction is not one */
+    char const *const *multi_chan;
+    /** Number of pipelined HTTP requests of the transaction, and the
+        index of the one being sent or read */
+    unsigned char pipe_n, pipe_i;
+    /** Bitmask of pipelined requests that succeeded. For a fan-out
+        publish, kept over retries, which send only the rest. */
+    unsigned pipe_ok;
+
+    /** Channel and message (or channel group) of the ongoing
+        transaction, kept to be able to retry it */
+    char const *trans_chan;
+    char const *trans_msg;
+    /** Options of the ongoing publish transaction */
+    struct pubnub_publish_options trans_opts;
+    /** Whether published messages are stamped with sequence numbers,
+        the sequence number of the next one, and of the one of the
+        ongoing publish transaction */
+    bool seq_stamp;
+    unsigned long seq_next, trans_seq;
+    /** Whether the message being built (see pubnub_publish_begin())
+        is wrapped in a sequence number stamp */
+    bool build_stamped;
+    /** Options of the ongoing history transaction */
+    struct pubnub_history_options trans_hist;
+    /** When the request(s) of the ongoing transaction started to be
+        sent, and, for the last time transaction, when the server
+        time is estimated to have been taken (local clock) */
+    clock_time_t sent_at, time_at;
+    /** Whether the ongoing channel group transaction adds channels
+        (or removes them) */
+    bool group_add;
+    /** Retry policy: maximum number of attempts, percentage of the
+        delay to randomize, base delay (of the first retry) and the
+        maximum delay */
+    unsigned char retry_max, retry_jitter;
+    clock_time_t retry_base, retry_cap;
+    /** Number of failed attempts of the ongoing transaction, and the
+        number of attempts of the last finished one */
+    unsigned char retries, last_attempts;
+
+    /** Catch-up policy: maximum number of failed subscribes in a row
+        and the maximum age of the first of them, to keep the time
+        token after */
+    unsigned char catchup_max;
+    clock_time_t catchup_age;
+    /** Number of failed subscribes in a row, and when the first of
+        them failed */
+    unsigned char catchup_errors;
+    clock_time_t catchup_since;
+    /** Catch-up statistics */
+    unsigned catchups, catchup_resets;
+
+#if PUBNUB_PERSIST
+    /** Whether the state of the context was saved, and when */
+    bool persist_saved;
+    clock_time_t persist_at;
+#endif
+
+#if PUBNUB_SPOOL_SEGMENT > 0
+    /** Sizes of the segment files of the spool, 0 if there is no
+        file in a slot */
+    unsigned short spool_end[PUBNUB_SPOOL_SEGMENTS];
+    /** Slots of the segments to read (publish) from and write to */
+    unsigned char spool_rslot, spool_wslot;
+    /** Offset of the next record to read in the read segment */
+    unsigned short spool_roff;
+    /** Sequence number of the write segment */
+    unsigned short spool_seq;
+    /** Length of the record(s) being published from the spool */
+    unsigned short spool_n;
+    /** Indicates that publishing from the spool failed, so it waits
+        for a sign that the network is back */
+    bool spool_stalled;
+    /** Spool statistics */
+    unsigned long spool_queued, spool_drained, spool_dropped;
+#endif
+
+    /** Callback of the continuous subscribe (NULL if not subscribing
+        continuously) and its user data */
+    pubnub_subscribe_cb sub_cb;
+    void *sub_data;
+
+#if PUBNUB_CHANNEL_SET_MAXLEN > 0
+    /** The channel set of the context (comma-separated), subscribed
+        to when subscribing to NULL channel */
+    char chan_set[PUBNUB_CHANNEL_SET_MAXLEN];
+    /** Channels removed from the set, to leave (comma-separated) */
+    char leave_set[PUBNUB_CHANNEL_SET_MAXLEN];
+#endif
+
+#if PUBNUB_DEMUX_SIZE > 0
+    /** The channel handler table, hashed by channel name, with
+        linear probing. Index of a channel is its ID. */
+    struct pubnub_demux {
+        char const *channel;
+        pubnub_subscribe_cb cb;
+        void *user_data;
+    } demux[PUBNUB_DEMUX_SIZE];
+    /** Number of channels in the handler table */
+    unsigned char demux_n;
+    /** Handler of messages from channels that are not in the table
+        and its user data */
+    pubnub_subscribe_cb demux_default;
+    void *demux_default_data;
+#endif
 };
 
 /** The PubNub contexts */
 static struct pubnub m_aCtx[PUBNUB_CTX_MAX];
 
 
-static bool valid_ctx_ptr(pubnub_t const *pb)
+static bool valid_ctx_ptr(pubnub_t const *pb)
+{
+    return ((pb >= m_aCtx) && (pb < m_aCtx + PUBNUB_CTX_MAX));
+}
+
+
+/** Returns whether all the messages in context @p pb were read */
+static bool rx_empty(pubnub_t const *pb)
+{
+#if PUBNUB_REPLY_BUFFERS > 1
+    if (pb->core.reply_pending) {
+        return false;
+    }
+#endif
+    return !pbcc_msgs_left(&pb->core);
+}
+
+
+/** Returns whether the ongoing transaction of context @p pb is a
+    publish */
+static bool trans_publishes(pubnub_t const *pb)
+{
+    return (PBTT_PUBLISH == pb->trans) || (PBTT_SPOOL == pb->trans);
+}
+
+
+/** Handles start of a TCP (HTTP) connection. It first handles DNS
+    resolving for the context @p pb.  If DNS is already resolved, it
+    proceeds to establishing TCP connection. Otherwise, will issue a
+    DNS request and go to state of awaiting response.
+
+    Call this function on start of a transaction or on receiving
+    response from DNS server.
+
+    @param pb The context for which to handle starting of connection
+*/
+static void handle_start_connect(pubnub_t *pb)
+{
+    uip_ipaddr_t *ipaddrptr;
+    
+    assert(valid_ctx_ptr(pb));
+    assert((pb->state == PS_IDLE) || (pb->state == PS_WAIT_DNS));
+    
+    pubnub_dns_lookup(PUBNUB_ORIGIN, ipaddrptr);
+    if (NULL == ipaddrptr) {
+        DEBUG_PRINTF("Pubnub: DNS Querying for %s\n", PUBNUB_ORIGIN);
+        pubnub_dns_query(PUBNUB_ORIGIN);
+        pb->state = PS_WAIT_DNS;
+        return;
+    }
+    
+    PROCESS_CONTEXT_BEGIN(&pubnub_process);
+    tcp_connect(ipaddrptr, uip_htons(HTTP_PORT), pb);
+    PROCESS_CONTEXT_END(&pubnub_process);
+    pb->state = PS_CONNECT;
+}
+
+
+#if PUBNUB_PERSIST
+/** Returns the name of the file the state of context @p pb is saved
+    in */
+static char const *persist_name(pubnub_t const *pb)
+{
+    static char name[12];
+    snprintf(name, sizeof name, "pubnub%u", (unsigned)(pb - m_aCtx));
+    return name;
+}
+
+
+/** Restores the state of context @p pb from its file, if it was
+    saved for the same subscribe key. The file has the subscribe key,
+    time token and channel set, each NUL-terminated.
+*/
+static void persist_load(pubnub_t *pb)
+{
+    /* Nothing is going on, so the HTTP buffer is free */
+    char *buf = pb->core.http_buf;
+    char *tt;
+    char *set;
+    int len;
+    int fd = cfs_open(persist_name(pb), CFS_READ);
+    
+    if (fd < 0) {
+        return;
+    }
+    len = cfs_read(fd, buf, sizeof pb->core.http_buf - 1);
+    cfs_close(fd);
+    if (len <= 0) {
+        return;
+    }
+    buf[len] = '\0';
+    tt = buf + strlen(buf) + 1;
+    if ((tt >= buf + len) || (strcmp(buf, pb->core.subscribe_key) != 0)) {
+        return;
+    }
+    set = tt + strlen(tt) + 1;
+    if (set > buf + len) {
+        return;
+    }
+    DEBUG_PRINTF("Pubnub: Restored time token %s\n", tt);
+    pbcc_set_timetoken(&pb->core, tt);
+#if PUBNUB_CHANNEL_SET_MAXLEN > 0
+    if (strlen(set) < sizeof pb->chan_set) {
+        strcpy(pb->chan_set, set);
+    }
+#endif
+}
+
+
+/** Saves the state of context @p pb to its file, unless it was saved
+    less than #PUBNUB_PERSIST_PERIOD ago and not @p now.
+*/
+static void persist_save(pubnub_t *pb, bool now)
+{
+    char const *set = "";
+    int fd;
+    
+    if (!now && pb->persist_saved && (clock_time() - pb->persist_at < PUBNUB_PERSIST_PERIOD)) {
+        return;
+    }
+    cfs_remove(persist_name(pb));
+    fd = cfs_open(persist_name(pb), CFS_WRITE);
+    if (fd < 0) {
+        return;
+    }
+#if PUBNUB_CHANNEL_SET_MAXLEN > 0
+    set = pb->chan_set;
+#endif
+    cfs_write(fd, pb->core.subscribe_key, strlen(pb->core.subscribe_key) + 1);
+    cfs_write(fd, pb->core.timetoken, strlen(pb->core.timetoken) + 1);
+    cfs_write(fd, set, strlen(set) + 1);
+    cfs_close(fd);
+    pb->persist_saved = true;
+    pb->persist_at = clock_time();
+}
+#else
+#define persist_save(pb, now)
+#endif
+
+
+#if PUBNUB_SPOOL_SEGMENT > 0
+#if PUBNUB_SPOOL_SEGMENTS < 2
+#error PUBNUB_SPOOL_SEGMENTS has to be at least 2
+#endif
+
+/** Size of the header of a spool segment file: its sequence number
+    (big endian). The header is followed by records, each being the
+    channel and the message, NUL-terminated. */
+#define SPOOL_HDR 2
+
+/** Returns the name of the file of the spool segment in @p slot of
+    context @p pb */
+static char const *spool_name(pubnub_t const *pb, unsigned slot)
+{
+    static char name[16];
+    snprintf(name, sizeof name, "pubnub%uq%u", (unsigned)(pb - m_aCtx), slot);
+    return name;
+}
+
+
+static bool spool_empty(pubnub_t const *pb)
+{
+    return (pb->spool_rslot == pb->spool_wslot) && (pb->spool_roff >= pb->spool_end[pb->spool_wslot]);
+}
+
+
+/** Removes the read segment of the spool of context @p pb (drained
+    or dropped) and moves on to the next one, if any.
+*/
+static void spool_drop_segment(pubnub_t *pb)
+{
+    cfs_remove(spool_name(pb, pb->spool_rslot));
+    pb->spool_end[pb->spool_rslot] = 0;
+    if (pb->spool_rslot != pb->spool_wslot) {
+        pb->spool_rslot = (pb->spool_rslot + 1) % PUBNUB_SPOOL_SEGMENTS;
+    }
+    pb->spool_roff = SPOOL_HDR;
+}
+
+
+/** Removes the segments of the spool of context @p pb that were read
+    to the end. The last one is removed too, so that what was
+    published is not published again after a reboot.
+*/
+static void spool_trim(pubnub_t *pb)
+{
+    while ((pb->spool_roff >= pb->spool_end[pb->spool_rslot])
+           && ((pb->spool_end[pb->spool_rslot] != 0) || (pb->spool_rslot != pb->spool_wslot))) {
+        spool_drop_segment(pb);
+    }
+}
+
+
+/** Starts a new write segment of the spool of context @p pb, in the
+    slot after the current one. If the spool is full, that is the
+    slot of the oldest segment, which is dropped.
+    @return true: OK, false: couldn't write the file
+*/
+static bool spool_rotate(pubnub_t *pb)
+{
+    unsigned char slot = (pb->spool_wslot + 1) % PUBNUB_SPOOL_SEGMENTS;
+    unsigned char hdr[SPOOL_HDR];
+    bool empty = spool_empty(pb);
+    bool ok;
+    int fd;
+
+    if (pb->spool_end[slot] != 0) {
+        assert(slot == pb->spool_rslot);
+        DEBUG_PRINTF("Pubnub: Spool full, dropping its oldest segment\n");
+        pb->spool_dropped += pb->spool_end[slot] - pb->spool_roff;
+        spool_drop_segment(pb);
+        /* If it was being published, there's nothing to take off */
+        pb->spool_n = 0;
+    }
+    hdr[0] = (pb->spool_seq + 1) >> 8;
+    hdr[1] = (pb->spool_seq + 1) & 0xFF;
+    cfs_remove(spool_name(pb, slot));
+    fd = cfs_open(spool_name(pb, slot), CFS_WRITE);
+    if (fd < 0) {
+        return false;
+    }
+    ok = (cfs_write(fd, hdr, SPOOL_HDR) == SPOOL_HDR);
+    cfs_close(fd);
+    if (!ok) {
+        cfs_remove(spool_name(pb, slot));
+        return false;
+    }
+    ++pb->spool_seq;
+    pb->spool_wslot = slot;
+    pb->spool_end[slot] = SPOOL_HDR;
+    if (empty) {
+        pb->spool_rslot = slot;
+        pb->spool_roff = SPOOL_HDR;
+    }
+    return true;
+}
+
+
+/** Rebuilds the state of the spool of context @p pb from its segment
+    files: reading starts from the start of the oldest segment,
+    writing goes on at the end of the newest one.
+*/
+static void spool_load(pubnub_t *pb)
+{
+    unsigned char hdr[SPOOL_HDR];
+    unsigned short oldest = 0;
+    bool found = false;
+    unsigned slot;
+
+    pb->spool_rslot = pb->spool_wslot = 0;
+    pb->spool_roff = SPOOL_HDR;
+    pb->spool_seq = pb->spool_n = 0;
+    pb->spool_stalled = false;
+    pb->spool_queued = pb->spool_drained = pb->spool_dropped = 0;
+    for (slot = 0; slot < PUBNUB_SPOOL_SEGMENTS; ++slot) {
+        cfs_offset_t end = 0;
+        unsigned short seq;
+        int fd = cfs_open(spool_name(pb, slot), CFS_READ);
+
+        pb->spool_end[slot] = 0;
+        if (fd < 0) {
+            continue;
+        }
+        if (cfs_read(fd, hdr, SPOOL_HDR) == SPOOL_HDR) {
+            end = cfs_seek(fd, 0, CFS_SEEK_END);
+        }
+        cfs_close(fd);
+        if ((end <= SPOOL_HDR) || (end > PUBNUB_SPOOL_SEGMENT)) {
+            cfs_remove(spool_name(pb, slot));
+            continue;
+        }
+        pb->spool_end[slot] = end;
+        seq = (hdr[0] << 8) | hdr[1];
+        if (!found || ((short)(seq - oldest) < 0)) {
+            oldest = seq;
+            pb->spool_rslot = slot;
+        }
+        if (!found || ((short)(seq - pb->spool_seq) > 0)) {
+            pb->spool_seq = seq;
+            pb->spool_wslot = slot;
+        }
+        found = true;
+    }
+}
+
+
+/** Reads the record at offset @p ofs of the read segment of the spool
+    of context @p pb, from file @p fd, into @p buf of @p size bytes.
+    @return Length of the record, 0 if there is no whole record
+*/
+static unsigned spool_read(pubnub_t *pb, int fd, unsigned ofs, char *buf, unsigned size)
+{
+    char *chan_end;
+    char *end;
+    int len;
+
+    if (size > pb->spool_end[pb->spool_rslot] - ofs) {
+        size = pb->spool_end[pb->spool_rslot] - ofs;
+    }
+    if (cfs_seek(fd, ofs, CFS_SEEK_SET) != (cfs_offset_t)ofs) {
+        return 0;
+    }
+    len = cfs_read(fd, buf, size);
+    if (len <= 0) {
+        return 0;
+    }
+    chan_end = memchr(buf, '\0', len);
+    if (NULL == chan_end) {
+        return 0;
+    }
+    end = memchr(chan_end + 1, '\0', len - (chan_end + 1 - buf));
+    return (NULL == end) ? 0 : (end + 1 - buf);
+}
+
+
+/** Prepares the publish of the next record of the spool of context
+    @p pb. If coalescing is on, the records for the same channel that
+    follow it in its segment are packed with it, like queued
+    publishes. Records that can't be published are dropped.
+    @return #PNR_STARTED on success, #PNR_OK if the spool is empty,
+    #PNR_IO_ERROR if it can't be read
+*/
+static enum pubnub_res spool_prep(pubnub_t *pb)
+{
+    /* Only needed until the request is prepared, so one will do */
+    static char buf[PUBNUB_BUF_MAXLEN];
+
+    for (spool_trim(pb); !spool_empty(pb); spool_trim(pb)) {
+        unsigned end = pb->spool_end[pb->spool_rslot];
+        int fd = cfs_open(spool_name(pb, pb->spool_rslot), CFS_READ);
+        enum pubnub_res rslt;
+        unsigned len;
+        unsigned total;
+
+        if (fd < 0) {
+            return PNR_IO_ERROR;
+        }
+        len = spool_read(pb, fd, pb->spool_roff, buf, sizeof buf);
+        if (0 == len) {
+            /* A write was cut short, skip what's left of it */
+            DEBUG_PRINTF("Pubnub: Spool segment %u broken at %u\n", pb->spool_rslot, pb->spool_roff);
+            cfs_close(fd);
+            pb->spool_dropped += end - pb->spool_roff;
+            pb->spool_roff = end;
+            continue;
+        }
+        total = strlen(buf + strlen(buf) + 1);
+        if (0 == pb->coalesce_max) {
+            rslt = pbcc_publish_prep(&pb->core, buf, buf + strlen(buf) + 1);
+        }
+        else {
+            rslt = pbcc_publish_prep_array(&pb->core, buf);
+            if (PNR_STARTED == rslt) {
+                rslt = pbcc_publish_append(&pb->core, buf + strlen(buf) + 1);
+            }
+        }
+        pb->spool_n = len;
+        while ((PNR_STARTED == rslt) && (pb->coalesce_max != 0) && (pb->spool_roff + pb->spool_n < end)) {
+            char *next = buf + len;
+            unsigned n;
+            char const *msg;
+
+            if (len >= sizeof buf) {
+                break;
+            }
+            /* If not 0, both the channel and message NULs were read */
+            n = spool_read(pb, fd, pb->spool_roff + pb->spool_n, next, sizeof buf - len);
+            if ((0 == n) || (strcmp(next, buf) != 0)) {
+                break;
+            }
+            msg = next + strlen(next) + 1;
+            total += strlen(msg);
+            if ((total > pb->coalesce_max) || (pbcc_publish_append(&pb->core, msg) != PNR_STARTED)) {
+                break;
+            }
+            pb->spool_n += n;
+        }
+        cfs_close(fd);
+        if (PNR_STARTED == rslt) {
+            return rslt;
+        }
+        DEBUG_PRINTF("Pubnub: Spooled publish dropped: %d\n", rslt);
+        pb->spool_dropped += len;
+        pb->spool_roff += len;
+    }
+    return PNR_OK;
+}
+
+
+/** Takes the published record(s) off the spool of context @p pb,
+    according to the @p result of the publish, or, for other
+    transactions, notes if the network works again.
+*/
+static void spool_outcome(pubnub_t *pb, enum pubnub_res result)
+{
+    if (pb->trans != PBTT_SPOOL) {
+        if (PNR_OK == result) {
+            pb->spool_stalled = false;
+        }
+        return;
+    }
+    if (PNR_OK == result) {
+        pb->spool_drained += pb->spool_n;
+    }
+    else if ((PNR_PUBLISH_FAILED == result) || (PNR_FORMAT_ERROR == result)
+             || ((PNR_HTTP_ERROR == result) && (pb->core.http_code / 100 == 4) && (pb->core.http_code != 403))) {
+        /* The server won't take it, trying again wouldn't help */
+        DEBUG_PRINTF("Pubnub: Spooled publish rejected: %d\n", result);
+        pb->spool_dropped += pb->spool_n;
+    }
+    else {
+        pb->spool_stalled = true;
+        return;
+    }
+    pb->spool_roff += pb->spool_n;
+    pb->spool_n = 0;
+    spool_trim(pb);
+}
+
+#define spool_pending(pb) (!spool_empty(pb) && !(pb)->spool_stalled)
+#else
+#define spool_outcome(pb, result)
+#define spool_pending(pb) false
+#endif
+
+
+void pubnub_init(pubnub_t *p, const char *publish_key, const char *subscribe_key)
+{
+    assert(valid_ctx_ptr(p));
+
+    pbcc_init(&p->core, publish_key, subscribe_key);
+    p->state = PS_IDLE;
+    p->trans = PBTT_NONE;
+    p->pubq = p->pubreq = NULL;
+    p->coalesce_max = 0;
+    p->holdoff = false;
+    p->rate_period = 0;
+    p->retry_max = 1;
+    p->retries = p->last_attempts = 0;
+    p->catchup_max = p->catchup_errors = 0;
+    p->catchup_age = 0;
+    p->catchups = p->catchup_resets = 0;
+    p->pipe_n = 1;
+    p->multi_chan = NULL;
+    p->pipe_ok = 0;
+    p->seq_stamp = false;
+    p->seq_next = 0;
+    p->sub_cb = NULL;
+#if PUBNUB_CHANNEL_SET_MAXLEN > 0
+    p->chan_set[0] = p->leave_set[0] = '\0';
+#endif
+#if PUBNUB_DEMUX_SIZE > 0
+    memset(p->demux, 0, sizeof p->demux);
+    p->demux_n = 0;
+    p->demux_default = NULL;
+#endif
+#if PUBNUB_PERSIST
+    p->persist_saved = false;
+    persist_load(p);
+#endif
+#if PUBNUB_SPOOL_SEGMENT > 0
+    spool_load(p);
+#endif
+}
+
+
+void pubnub_done(pubnub_t *pb)
+{
+    assert(valid_ctx_ptr(pb));
+    pubnub_cancel(pb);
+    if (pb->holdoff) {
+        ctimer_stop(&pb->holdoff_timer);
+        pb->holdoff = false;
+    }
+    while (pb->pubq != NULL) {
+        struct pubnub_pubreq *req = pb->pubq;
+        pb->pubq = req->next;
+        req->result = PNR_CANCELLED;
+        process_post(req->initiator, pubnub_publish_event, req);
+    }
+}
+
+
+static process_event_t trans2event(enum pubnub_trans trans)
+{
+    switch (trans) {
+    case PBTT_SUBSCRIBE:
+        return pubnub_subscribe_event;
+    case PBTT_PUBLISH:
+        return pubnub_publish_event;
+    case PBTT_LEAVE:
+        return pubnub_leave_event;
+    case PBTT_CHANNEL_GROUP:
+        return pubnub_channel_group_event;
+    case PBTT_TIME:
+        return pubnub_time_event;
+    case PBTT_HISTORY:
+        return pubnub_history_event;
+    case PBTT_NONE:
+    default:
+        assert(0);
+        return PROCESS_EVENT_NONE;
+    }
+}
+
+
+static void retry_timeout(void *ptr);
+
+
+/** Returns the delay before the next retry of the ongoing transaction
+    of context @p pb, doubling it for every failed attempt.
+*/
+static clock_time_t retry_delay(pubnub_t *pb)
+{
+    clock_time_t delay = pb->retry_base;
+    unsigned char i;
+
+    for (i = 1; (i < pb->retries) && (delay < pb->retry_cap); ++i) {
+        delay *= 2;
+    }
+    if (delay > pb->retry_cap) {
+        delay = pb->retry_cap;
+    }
+    if (pb->retry_jitter > 0) {
+        /* Randomize, to avoid many clients retrying in lockstep */
+        clock_time_t span = delay / 100 * pb->retry_jitter + delay % 100 * pb->retry_jitter / 100;
+        delay -= random_rand() % (span + 1);
+    }
+    
+    return delay;
+}
+
+
+/** Applies the catch-up policy of context @p pb to the outcome of a
+    subscribe, @p result: after an error, keeps the time token if the
+    policy allows, otherwise resets it.
+*/
+static void catchup_outcome(pubnub_t *pb, enum pubnub_res result)
+{
+    if (PNR_OK == result) {
+        pb->catchup_errors = 0;
+        return;
+    }
+    if (0 == pb->catchup_errors) {
+        pb->catchup_since = clock_time();
+    }
+    if (pb->catchup_errors < 255) {
+        ++pb->catchup_errors;
+    }
+    if ((result != PNR_FORMAT_ERROR)
+        && (pb->catchup_errors <= pb->catchup_max)
+        && ((0 == pb->catchup_age) || (clock_time() - pb->catchup_since < pb->catchup_age))) {
+        ++pb->catchups;
+        return;
+    }
+    /* In case of PubNub protocol error, abort an ongoing subscribe
+     * and start over. This means some messages were lost, but allows
+     * us to recover from bad situations, e.g. too many messages
+     * queued or unexpected problem caused by a particular
+     * message. Same for outages too long to catch up on. */
+    pb->core.timetoken[0] = '0';
+    pb->core.timetoken[1] = '\0';
+    pb->catchup_errors = 0;
+    ++pb->catchup_resets;
+}
+
+
+/** Lets the publish queue and the spool of the (now idle) context
+    @p pb proceed, if they have anything to publish.
+*/
+static void queue_kick(pubnub_t *pb)
+{
+    if ((pb->pubq != NULL) || spool_pending(pb)) {
+        process_poll(&pubnub_process);
+    }
+}
+
+
+/** Finishes the ongoing transaction of context @p pb with the @p
+    result, reporting it to the initiator.
+*/
+static void trans_final(pubnub_t *pb, enum pubnub_res result)
+{
+    pb->last_attempts = pb->retries + 1;
+    pb->retries = 0;
+    pb->core.last_result = result;
+    
+    DEBUG_PRINTF("Pubnub: Transaction outcome: %d, HTTP code: %d\n",
+                 result, pb->core.http_code
+        );
+    if (PBTT_SUBSCRIBE == pb->trans) {
+        catchup_outcome(pb, result);
+    }
+    else if (PBTT_LEAVE == pb->trans) {
+        /* Don't resume the subscribe we left after a reboot */
+        persist_save(pb, true);
+    }
+    spool_outcome(pb, result);
+    
+    pb->state = PS_IDLE;
+    pb->pipe_n = 1;
+    pb->multi_chan = NULL;
+    pb->sub_cb = NULL;
+    if (pb->pubreq != NULL) {
+        /* Queued requests (coalesced into one publish) get an event
+           each, with the request as data */
+        struct pubnub_pubreq *req;
+        for (req = pb->pubreq; req != NULL; req = req->next) {
+            req->result = result;
+            process_post(req->initiator, pubnub_publish_event, req);
+        }
+        pb->pubreq = NULL;
+    }
+    else if (pb->trans != PBTT_SPOOL) {
+        process_post(pb->initiator, trans2event(pb->trans), pb);
+    }
+    queue_kick(pb);
+}
+
+
+#if PUBNUB_DEMUX_SIZE > 0
+static unsigned demux_hash(char const *channel)
+{
+    unsigned h = 5381;
+    while (*channel != '\0') {
+        h = h * 33 + (unsigned char)*channel++;
+    }
+    return h % PUBNUB_DEMUX_SIZE;
+}
+
+
+/** Returns the ID of the @p channel in the handler table of context
+    @p pb, or -1 if it is not in it.
+*/
+static int demux_find(pubnub_t const *pb, char const *channel)
+{
+    unsigned i = demux_hash(channel);
+    unsigned n;
+
+    for (n = 0; (n < PUBNUB_DEMUX_SIZE) && (pb->demux[i].channel != NULL); ++n) {
+        if (0 == strcmp(pb->demux[i].channel, channel)) {
+            return i;
+        }
+        i = (i + 1) % PUBNUB_DEMUX_SIZE;
+    }
+    return -1;
+}
+
+
+/** Puts @p d in the first free slot of the handler table of context
+    @p pb, from its hash on. There has to be a free slot.
+*/
+static void demux_insert(pubnub_t *pb, struct pubnub_demux const *d)
+{
+    unsigned i = demux_hash(d->channel);
+    while (pb->demux[i].channel != NULL) {
+        i = (i + 1) % PUBNUB_DEMUX_SIZE;
+    }
+    pb->demux[i] = *d;
+}
+#endif
+
+
+#if PUBNUB_CHANNEL_SET_MAXLEN > 0
+/** Returns the start of @p channel in the comma-separated @p list,
+    or NULL if it's not in it.
+*/
+static char *list_find(char *list, char const *channel)
+{
+    size_t len = strlen(channel);
+    char *s = list;
+
+    while (*s != '\0') {
+        char *end = strchr(s, ',');
+        size_t n = (NULL == end) ? strlen(s) : (size_t)(end - s);
+        if ((n == len) && (0 == memcmp(s, channel, len))) {
+            return s;
+        }
+        if (NULL == end) {
+            break;
+        }
+        s = end + 1;
+    }
+    return NULL;
+}
+
+
+/** Adds @p channel to the comma-separated @p list (of @p size
+    bytes), unless it is already in it.
+    @return true: OK, false: doesn't fit
+*/
+static bool list_add(char *list, size_t size, char const *channel)
+{
+    size_t len = strlen(list);
+
+    if (list_find(list, channel) != NULL) {
+        return true;
+    }
+    if (len + (len > 0) + strlen(channel) >= size) {
+        return false;
+    }
+    if (len > 0) {
+        list[len++] = ',';
+    }
+    strcpy(list + len, channel);
+    return true;
+}
+
+
+/** Removes @p channel from the comma-separated @p list.
+    @return true: removed, false: it wasn't in the list
+*/
+static bool list_remove(char *list, char const *channel)
+{
+    char *s = list_find(list, channel);
+    size_t len = strlen(channel);
+
+    if (NULL == s) {
+        return false;
+    }
+    if (',' == s[len]) {
+        memmove(s, s + len + 1, strlen(s + len + 1) + 1);
+    }
+    else if (s == list) {
+        list[0] = '\0';
+    }
+    else {
+        s[-1] = '\0';
+    }
+    return true;
+}
+#endif
+
+
+/** Returns the channels to subscribe to of context @p pb, when
+    subscribing to NULL channel: the channel set, or, if there is
+    none, no channels (just the channel groups).
+*/
+static char const *subscribe_channels(pubnub_t const *pb)
+{
+#if PUBNUB_CHANNEL_SET_MAXLEN > 0
+    if (pb->chan_set[0] != '\0') {
+        return pb->chan_set;
+    }
+#else
+    (void)pb;
+#endif
+    return ",";
+}
+
+
+/** Prepares the subscribe of context @p pb to its channel, or to its
+    channel set and/or channel group if that is NULL. In the later
+    case, if there are channels to leave, the leave is prepared, to be
+    sent first on the same connection, and the subscribe is prepared
+    again after it is sent.
+*/
+static enum pubnub_res subscribe_prep(pubnub_t *pb)
+{
+    char const *channels = pb->trans_chan;
+    enum pubnub_res rslt;
+
+    pb->pipe_n = 1;
+    if (NULL == channels) {
+        channels = subscribe_channels(pb);
+        if ((',' == channels[0]) && (NULL == pb->core.channel_group)) {
+            return PNR_INVALID_CHANNEL;
+        }
+    }
+    rslt = pbcc_subscribe_prep(&pb->core, channels);
+#if PUBNUB_CHANNEL_SET_MAXLEN > 0
+    if ((PNR_STARTED == rslt) && (NULL == pb->trans_chan) && (pb->leave_set[0] != '\0')) {
+        /* Leave is "best effort", it is not retried */
+        pbcc_partial_leave_prep(&pb->core, pb->leave_set);
+        pb->leave_set[0] = '\0';
+        pb->pipe_n = 2;
+    }
+#endif
+    return rslt;
+}
+
+
+/** Returns the channel(s) context @p pb subscribed to */
+static char const *subscribed_channel(pubnub_t const *pb)
+{
+#if PUBNUB_CHANNEL_SET_MAXLEN > 0
+    if (NULL == pb->trans_chan) {
+        return pb->chan_set;
+    }
+#endif
+    return pb->trans_chan;
+}
+
+
+/** Delivers the messages of the finished subscribe of context @p pb
+    to the handlers of their channels, or the continuous subscribe
+    callback. Stops at the first message that none of them handles,
+    leaving it and the rest to be read with pubnub_get().
+*/
+static void subscribe_deliver(pubnub_t *pb)
+{
+    char const *msg;
+#if PUBNUB_DEMUX_SIZE > 0
+    char const *prev = NULL;
+    int id = -1;
+
+    while (((pb->sub_cb != NULL) || (pb->demux_n > 0) || (pb->demux_default != NULL))
+           && ((msg = pbcc_get_msg(&pb->core)) != NULL)) {
+        char const *got = pbcc_get_channel(&pb->core);
+        char const *channel = (NULL == got) ? subscribed_channel(pb) : got;
+        if (channel != prev) {
+            /* Unpacked messages repeat the channel, look up only once */
+            id = (pb->demux_n > 0) ? demux_find(pb, channel) : -1;
+            prev = channel;
+        }
+        if (id >= 0) {
+            pb->demux[id].cb(pb, channel, msg, pb->demux[id].user_data);
+        }
+        else if (pb->demux_default != NULL) {
+            pb->demux_default(pb, channel, msg, pb->demux_default_data);
+        }
+        else if (pb->sub_cb != NULL) {
+            pb->sub_cb(pb, channel, msg, pb->sub_data);
+        }
+        else {
+            pbcc_unget_msg(&pb->core, msg, got);
+            break;
+        }
+    }
+#else
+    while ((pb->sub_cb != NULL) && ((msg = pbcc_get_msg(&pb->core)) != NULL)) {
+        char const *channel = pbcc_get_channel(&pb->core);
+        pb->sub_cb(pb, (NULL == channel) ? subscribed_channel(pb) : channel, msg, pb->sub_data);
+    }
+#endif
+}
+
+
+/** Delivers the messages of the finished subscribe of context @p pb
+    and, if it is a continuous subscribe, subscribes again, unless the
+    callback cancelled it.
+*/
+static void subscribe_done(pubnub_t *pb)
+{
+    enum pubnub_res rslt;
+
+    /* So that pubnub_cancel() from a callback only ends the mode */
+    pb->state = PS_IDLE;
+    pb->catchup_errors = 0;
+    persist_save(pb, false);
+    subscribe_deliver(pb);
+#if PUBNUB_INBOX_SIZE > 0
+    /* What the handlers didn't take goes to the inbox */
+    pbcc_inbox_fill(&pb->core);
+#endif
+    if (NULL == pb->sub_cb) {
+        trans_final(pb, PNR_OK);
+        return;
+    }
+    
+    pb->last_attempts = pb->retries + 1;
+    pb->retries = 0;
+    pb->core.last_result = PNR_OK;
+    rslt = subscribe_prep(pb);
+    if (rslt != PNR_STARTED) {
+        trans_final(pb, rslt);
+        return;
+    }
+    DEBUG_PRINTF("Pubnub: Continuous subscribe, subscribing again\n");
+    handle_start_connect(pb);
+}
+
+
+/** Handles the outcome of the ongoing transaction of context @p
+    pb. Communication failures are retried, as long as the retry
+    policy allows. Messages of a successful subscribe are delivered to
+    handlers, if any, and a continuous subscribe is started again.
+    Otherwise, the transaction is finished.
+*/
+static void trans_outcome(pubnub_t *pb, enum pubnub_res result)
+{
+    /* A message built in place is gone with the request, as the
+       response is read over it, so it can't be retried */
+    bool built = (PBTT_PUBLISH == pb->trans) && (NULL == pb->pubreq) && (NULL == pb->trans_msg);
+
+    if ((PNR_OK == result) && (PBTT_SUBSCRIBE == pb->trans)) {
+        subscribe_done(pb);
+        return;
+    }
+    if (((PNR_IO_ERROR == result) || (PNR_TIMEOUT == result) || (PNR_ABORTED == result))
+        && (pb->retries + 1 < pb->retry_max) && !built) {
+        DEBUG_PRINTF("Pubnub: Transaction failed: %d, will retry\n", result);
+        ++pb->retries;
+        pb->core.last_result = result;
+        pb->state = PS_WAIT_RETRY;
+        /* Don't let the events of the old connection mess with the retry */
+        tcp_markconn(uip_conn, NULL);
+        PROCESS_CONTEXT_BEGIN(&pubnub_process);
+        ctimer_set(&pb->retry_timer, retry_delay(pb), retry_timeout, pb);
+        PROCESS_CONTEXT_END(&pubnub_process);
+        return;
+    }
+    trans_final(pb, result);
+}
+
+
+/** Adds tokens to the bucket of the publish rate limiter of context
+    @p pb, for the time passed, and returns whether there are at least
+    @p n of them.
+*/
+static bool rate_allows(pubnub_t *pb, unsigned n)
+{
+    clock_time_t now;
+    clock_time_t add;
+
+    if (0 == pb->rate_period) {
+        return true;
+    }
+    now = clock_time();
+    add = (now - pb->rate_last) / pb->rate_period;
+    if (add >= (clock_time_t)(pb->burst - pb->tokens)) {
+        pb->tokens = pb->burst;
+        pb->rate_last = now;
+    }
+    else {
+        pb->tokens += add;
+        pb->rate_last += add * pb->rate_period;
+    }
+    return pb->tokens >= n;
+}
+
+
+static void rate_take(pubnub_t *pb, unsigned n)
+{
+    if (pb->rate_period != 0) {
+        pb->tokens -= n;
+    }
+}
+
+
+/** Returns whether the deadline of publish request @p req passed */
+static bool pubreq_expired(struct pubnub_pubreq *req)
+{
+    return (req->deadline.interval != 0) && timer_expired(&req->deadline);
+}
+
+
+/** Moves the requests for the same channel as @p req from the queue
+    to the array of the publish of @p req (prepared by
+    pbcc_publish_prep_array()), for as long as they fit, keeping
+    their order.
+*/
+static void pubq_coalesce(pubnub_t *pb, struct pubnub_pubreq *req)
+{
+    struct pubnub_pubreq **pp = &pb->pubq;
+    unsigned total = strlen(req->message);
+
+    while (*pp != NULL) {
+        struct pubnub_pubreq *other = *pp;
+        if ((0 != strcmp(other->channel, req->channel)) || pubreq_expired(other)) {
+            pp = &other->next;
+            continue;
+        }
+        total += strlen(other->message);
+        if ((total > pb->coalesce_max) || (pbcc_publish_append(&pb->core, other->message) != PNR_STARTED)) {
+            break;
+        }
+        *pp = other->next;
+        other->next = NULL;
+        req->next = other;
+        req = other;
+    }
+}
+
+
+/** Starts the publish of a queued request @p req on context @p pb,
+    coalescing other queued requests with it, if so configured.
+    @return #PNR_STARTED on success, an error otherwise
+*/
+static enum pubnub_res pubreq_start(pubnub_t *pb, struct pubnub_pubreq *req)
+{
+    enum pubnub_res rslt;
+
+    req->next = NULL;
+    if (0 == pb->coalesce_max) {
+        rslt = pbcc_publish_prep(&pb->core, req->channel, req->message);
+    }
+    else {
+        rslt = pbcc_publish_prep_array(&pb->core, req->channel);
+        if (PNR_STARTED == rslt) {
+            rslt = pbcc_publish_append(&pb->core, req->message);
+        }
+        if (PNR_STARTED == rslt) {
+            pubq_coalesce(pb, req);
+        }
+    }
+    if (PNR_STARTED == rslt) {
+        rate_take(pb, 1);
+        pb->initiator = req->initiator;
+        pb->trans = PBTT_PUBLISH;
+        pb->pubreq = req;
+        handle_start_connect(pb);
+    }
+    return rslt;
+}
+
+
+static void holdoff_timeout(void *ptr);
+
+
+/** Holds off the outbound queue and spool of context @p pb for @p
+    interval clock ticks. The timer is set for the Pubnub process, as
+    this may be called from the user's process.
+*/
+static void holdoff_start(pubnub_t *pb, clock_time_t interval)
+{
+    pb->holdoff = true;
+    PROCESS_CONTEXT_BEGIN(&pubnub_process);
+    ctimer_set(&pb->holdoff_timer, interval, holdoff_timeout, pb);
+    PROCESS_CONTEXT_END(&pubnub_process);
+}
+
+
+/** Starts the publish at the head of the outbound queue of context
+    @p pb, if it is idle and there are no unread messages.  Requests
+    whose deadline has passed, or that can't be started, are dropped
+    (and their outcome reported) until one is started.
+*/
+static void pubq_advance(pubnub_t *pb)
+{
+    while ((pb->state == PS_IDLE) && (pb->pubq != NULL) && !pb->holdoff && rx_empty(pb)) {
+        struct pubnub_pubreq *req = pb->pubq;
+        enum pubnub_res rslt = PNR_EXPIRED;
+
+        if (!pubreq_expired(req)) {
+            if (!rate_allows(pb, 1)) {
+                /* Wait for the next token */
+                ++pb->rate_delayed;
+                holdoff_start(pb, pb->rate_period - (clock_time() - pb->rate_last));
+                break;
+            }
+            pb->pubq = req->next;
+            rslt = pubreq_start(pb, req);
+        }
+        else {
+            pb->pubq = req->next;
+        }
+        if (rslt != PNR_STARTED) {
+            DEBUG_PRINTF("Pubnub: Queued publish dropped: %d\n", rslt);
+            req->result = rslt;
+            process_post(req->initiator, pubnub_publish_event, req);
+        }
+    }
+}
+
+
+#if PUBNUB_SPOOL_SEGMENT > 0
+/** Starts the publish of the next record(s) of the spool of context
+    @p pb, if it is idle, there are no unread messages, nothing is
+    queued and the last publish from the spool didn't fail.
+*/
+static void spool_advance(pubnub_t *pb)
+{
+    if ((pb->state != PS_IDLE) || (pb->pubq != NULL) || pb->holdoff || pb->spool_stalled
+        || !rx_empty(pb) || spool_empty(pb)) {
+        return;
+    }
+    if (!rate_allows(pb, 1)) {
+        ++pb->rate_delayed;
+        holdoff_start(pb, pb->rate_period - (clock_time() - pb->rate_last));
+        return;
+    }
+    if (spool_prep(pb) == PNR_STARTED) {
+        rate_take(pb, 1);
+        pb->initiator = &pubnub_process;
+        pb->trans = PBTT_SPOOL;
+        handle_start_connect(pb);
+    }
+}
+#else
+#define spool_advance(pb)
+#endif
+
+
+static void holdoff_timeout(void *ptr)
+{
+    pubnub_t *pb = ptr;
+    pb->holdoff = false;
+    pubq_advance(pb);
+    spool_advance(pb);
+}
+
+
+/** Prepares the HTTP request of the ongoing transaction of context
+    @p pb again, to retry it.
+*/
+static enum pubnub_res trans_reprep(pubnub_t *pb)
+{
+    struct pubnub_pubreq *req = pb->pubreq;
+    enum pubnub_res rslt;
+
+    switch (pb->trans) {
+    case PBTT_SUBSCRIBE:
+        return subscribe_prep(pb);
+    case PBTT_LEAVE:
+        return pbcc_leave_prep(&pb->core, pb->trans_chan);
+    case PBTT_CHANNEL_GROUP:
+        return pbcc_channel_registry_prep(&pb->core, pb->trans_msg, pb->group_add ? "add" : "remove", pb->trans_chan);
+    case PBTT_TIME:
+        return pbcc_time_prep(&pb->core);
+    case PBTT_HISTORY:
+        return pbcc_history_prep(&pb->core, pb->trans_chan, pb->trans_hist.count, pb->trans_hist.start, pb->trans_hist.end, pb->trans_hist.reverse);
+#if PUBNUB_SPOOL_SEGMENT > 0
+    case PBTT_SPOOL:
+        return spool_prep(pb);
+#endif
+    case PBTT_PUBLISH:
+        if ((NULL == req) && pb->seq_stamp && (NULL == pb->multi_chan)) {
+            rslt = pbcc_publish_prep_seq(&pb->core, pb->trans_chan, pb->trans_msg, pb->trans_seq);
+            if (PNR_STARTED == rslt) {
+                rslt = pbcc_publish_options(&pb->core, &pb->trans_opts);
+            }
+            return rslt;
+        }
+        if (NULL == req) {
+            rslt = pbcc_publish_prep(&pb->core, pb->trans_chan, pb->trans_msg);
+            if (PNR_STARTED == rslt) {
+                rslt = pbcc_publish_options(&pb->core, &pb->trans_opts);
+            }
+            return rslt;
+        }
+        if (0 == pb->coalesce_max) {
+            return pbcc_publish_prep(&pb->core, req->channel, req->message);
+        }
+        rslt = pbcc_publish_prep_array(&pb->core, req->channel);
+        for (; (req != NULL) && (PNR_STARTED == rslt); req = req->next) {
+            rslt = pbcc_publish_append(&pb->core, req->message);
+        }
+        return rslt;
+    case PBTT_NONE:
+    default:
+        assert(0);
+        return PNR_IO_ERROR;
+    }
+}
+
+
+static void retry_timeout(void *ptr)
+{
+    pubnub_t *pb = ptr;
+
+    assert(pb->state == PS_WAIT_RETRY);
+    pb->state = PS_IDLE;
+    if (trans_reprep(pb) != PNR_STARTED) {
+        trans_final(pb, pb->core.last_result);
+        return;
+    }
+    DEBUG_PRINTF("Pubnub: Retrying transaction, attempt %d\n", pb->retries + 1);
+    handle_start_connect(pb);
+}
+
+
+/** Returns the total length of queued messages for the @p channel */
+static unsigned pubq_length(pubnub_t const *pb, char const *channel)
+{
+    struct pubnub_pubreq const *req;
+    unsigned total = 0;
+    for (req = pb->pubq; req != NULL; req = req->next) {
+        if (0 == strcmp(req->channel, channel)) {
+            total += strlen(req->message);
+        }
+    }
+    return total;
+}
+
+
+void pubnub_cancel(pubnub_t *pb)
+{
+    assert(valid_ctx_ptr(pb));
+    
+    pb->sub_cb = NULL;
+    switch (pb->state) {
+    case PS_WAIT_CANCEL:
+    case PS_WAIT_CANCEL_CLOSE:
+    case PS_IDLE:
+        break;
+    case PS_WAIT_RETRY:
+        ctimer_stop(&pb->retry_timer);
+        trans_outcome(pb, PNR_CANCELLED);
+        break;
+    case PS_BUILD:
+        /* Nothing was started, so there is no outcome to report */
+        pb->core.http_buf_len = 0;
+        pb->state = PS_IDLE;
+        queue_kick(pb);
+        break;
+    case PS_WAIT_DNS:
+        pb->core.msg_ofs = pb->core.msg_end = 0;
+        pb->core.unpack_ofs = pb->core.unpack_end = 0;
+        trans_outcome(pb, PNR_CANCELLED);
+        break;
+    default:
+        pb->state = PS_WAIT_CANCEL;
+        break;                        
+    }
+}
+
+
+/** Starts the publish of the @p message, with the options @p opts,
+    on the @p channel, on context @p pb.
+*/
+static enum pubnub_res publish_start(pubnub_t *pb, const char *channel, const char *message, struct pubnub_publish_options const *opts)
+{
+    enum pubnub_res rslt;
+
+    if (pb->state != PS_IDLE) {
+        return PNR_IN_PROGRESS;
+    }
+    if (!rate_allows(pb, 1)) {
+        ++pb->rate_rejected;
+        return PNR_RATE_LIMITED;
+    }
+
+    if (pb->seq_stamp) {
+        rslt = pbcc_publish_prep_seq(&pb->core, channel, message, pb->seq_next);
+    }
+    else {
+        rslt = pbcc_publish_prep(&pb->core, channel, message);
+    }
+    if (PNR_STARTED == rslt) {
+        rslt = pbcc_publish_options(&pb->core, opts);
+    }
+    if (PNR_STARTED == rslt) {
+        pb->trans_seq = pb->seq_next++;
+        rate_take(pb, 1);
+        pb->initiator = PROCESS_CURRENT();
+        pb->trans = PBTT_PUBLISH;
+        pb->trans_chan = channel;
+        pb->trans_msg = message;
+        pb->trans_opts = *opts;
+        handle_start_connect(pb);
+    }
+    
+    return rslt;
+}
+
+
+struct pubnub_publish_options pubnub_publish_defopts(void)
+{
+    struct pubnub_publish_options rslt = { true, true, 0, NULL, false };
+    return rslt;
+}
+
+
+enum pubnub_res pubnub_publish(pubnub_t *pb, const char *channel, const char *message)
+{
+    struct pubnub_publish_options opts = pubnub_publish_defopts();
+
+    assert(valid_ctx_ptr(pb));
+    
+    return publish_start(pb, channel, message, &opts);
+}
+
+
+enum pubnub_res pubnub_publish_meta(pubnub_t *pb, const char *channel, const char *message, const char *meta)
+{
+    struct pubnub_publish_options opts = pubnub_publish_defopts();
+
+    assert(valid_ctx_ptr(pb));
+    
+    opts.meta = meta;
+    return publish_start(pb, channel, message, &opts);
+}
+
+
+enum pubnub_res pubnub_publish_ex(pubnub_t *pb, const char *channel, const char *message, struct pubnub_publish_options const *opts)
+{
+    assert(valid_ctx_ptr(pb));
+    assert(opts != NULL);
+    
+    return publish_start(pb, channel, message, opts);
+}
+
+
+enum pubnub_res pubnub_publish_multi(pubnub_t *pb, char const *const *channels, unsigned n, const char *message)
+{
+    enum pubnub_res rslt;
+    unsigned i;
+
+    assert(valid_ctx_ptr(pb));
+    assert((n > 0) && (n <= PUBNUB_MULTI_MAX));
+    
+    if (pb->state != PS_IDLE) {
+        return PNR_IN_PROGRESS;
+    }
+    if (!rate_allows(pb, n)) {
+        ++pb->rate_rejected;
+        return PNR_RATE_LIMITED;
+    }
+
+    /* Encode the message once, and check that it fits for all channels */
+    rslt = pbcc_publish_prep(&pb->core, channels[0], message);
+    for (i = n; (i-- > 0) && (PNR_STARTED == rslt); ) {
+        rslt = pbcc_publish_set_channel(&pb->core, channels[i]);
+    }
+    if (PNR_STARTED == rslt) {
+        rate_take(pb, n);
+        pb->initiator = PROCESS_CURRENT();
+        pb->trans = PBTT_PUBLISH;
+        pb->trans_chan = channels[0];
+        pb->trans_msg = message;
+        pb->trans_opts = pubnub_publish_defopts();
+        pb->multi_chan = channels;
+        pb->pipe_n = n;
+        pb->pipe_ok = 0;
+        handle_start_connect(pb);
+    }
+    
+    return rslt;
+}
+
+
+enum pubnub_res pubnub_publish_begin(pubnub_t *pb, const char *channel)
+{
+    enum pubnub_res rslt;
+
+    assert(valid_ctx_ptr(pb));
+    
+    if (pb->state != PS_IDLE) {
+        return PNR_IN_PROGRESS;
+    }
+    if (!rate_allows(pb, 1)) {
+        ++pb->rate_rejected;
+        return PNR_RATE_LIMITED;
+    }
+
+    rslt = pbcc_publish_prep(&pb->core, channel, "");
+    if (rslt != PNR_STARTED) {
+        return rslt;
+    }
+    pbcc_msg_start(&pb->core);
+    pb->build_stamped = pb->seq_stamp;
+    if (pb->seq_stamp) {
+        /* Same as pbcc_publish_prep_seq(), the message is the "m" */
+        pbcc_msg_begin(&pb->core, false);
+        pbcc_msg_key(&pb->core, "q");
+        pbcc_msg_fixed(&pb->core, pb->seq_next, 0);
+        pbcc_msg_key(&pb->core, "u");
+        pbcc_msg_string(&pb->core, (NULL == pb->core.uuid) ? "" : pb->core.uuid);
+        pbcc_msg_key(&pb->core, "m");
+    }
+    pb->trans_chan = channel;
+    pb->state = PS_BUILD;
+    
+    return PNR_OK;
+}
+
+
+void pubnub_msg_begin_object(pubnub_t *pb)
+{
+    assert(valid_ctx_ptr(pb));
+    assert(PS_BUILD == pb->state);
+    pbcc_msg_begin(&pb->core, false);
+}
+
+
+void pubnub_msg_begin_array(pubnub_t *pb)
+{
+    assert(valid_ctx_ptr(pb));
+    assert(PS_BUILD == pb->state);
+    pbcc_msg_begin(&pb->core, true);
+}
+
+
+void pubnub_msg_end(pubnub_t *pb)
+{
+    assert(valid_ctx_ptr(pb));
+    assert(PS_BUILD == pb->state);
+    if (!pb->build_stamped || (pb->core.msg_depth > 1)) {
+        pbcc_msg_end(&pb->core);
+    }
+    else {
+        /* Don't let it close the stamp */
+        pb->core.msg_rslt = PNR_FORMAT_ERROR;
+    }
+}
+
+
+void pubnub_msg_key(pubnub_t *pb, char const *key)
+{
+    assert(valid_ctx_ptr(pb));
+    assert(PS_BUILD == pb->state);
+    pbcc_msg_key(&pb->core, key);
+}
+
+
+void pubnub_msg_int(pubnub_t *pb, long n)
+{
+    assert(valid_ctx_ptr(pb));
+    assert(PS_BUILD == pb->state);
+    pbcc_msg_fixed(&pb->core, n, 0);
+}
+
+
+void pubnub_msg_fixed(pubnub_t *pb, long n, unsigned char decimals)
+{
+    assert(valid_ctx_ptr(pb));
+    assert(PS_BUILD == pb->state);
+    assert(decimals <= 9);
+    pbcc_msg_fixed(&pb->core, n, decimals);
+}
+
+
+void pubnub_msg_string(pubnub_t *pb, char const *s)
+{
+    assert(valid_ctx_ptr(pb));
+    assert(PS_BUILD == pb->state);
+    pbcc_msg_string(&pb->core, s);
+}
+
+
+void pubnub_msg_binary(pubnub_t *pb, void const *data, size_t len, enum pubnub_binary_enc enc)
+{
+    assert(valid_ctx_ptr(pb));
+    assert(PS_BUILD == pb->state);
+    pbcc_msg_binary(&pb->core, data, len, enc);
+}
+
+
+void pubnub_msg_raw(pubnub_t *pb, char const *json)
+{
+    assert(valid_ctx_ptr(pb));
+    assert(PS_BUILD == pb->state);
+    pbcc_msg_raw(&pb->core, json);
+}
+
+
+enum pubnub_res pubnub_publish_end(pubnub_t *pb, struct pubnub_publish_options const *opts)
+{
+    enum pubnub_res rslt;
+
+    assert(valid_ctx_ptr(pb));
+    assert(opts != NULL);
+    
+    if (pb->state != PS_BUILD) {
+        return PNR_IN_PROGRESS;
+    }
+    pb->state = PS_IDLE;
+
+    if (pb->build_stamped && (1 == pb->core.msg_depth) && !pb->core.msg_key && (PNR_STARTED == pb->core.msg_rslt)) {
+        /* The message is complete, close the stamp */
+        pbcc_msg_end(&pb->core);
+    }
+    rslt = pbcc_msg_done(&pb->core);
+    if (PNR_STARTED == rslt) {
+        rslt = pbcc_publish_options(&pb->core, opts);
+    }
+    if (PNR_STARTED == rslt) {
+        pb->trans_seq = pb->seq_next++;
+        rate_take(pb, 1);
+        pb->initiator = PROCESS_CURRENT();
+        pb->trans = PBTT_PUBLISH;
+        pb->trans_msg = NULL;
+        pb->trans_opts = *opts;
+        handle_start_connect(pb);
+    }
+    else {
+        queue_kick(pb);
+    }
+    
+    return rslt;
+}
+
+
+enum pubnub_res pubnub_publish_binary(pubnub_t *pb, const char *channel, void const *data, size_t len, enum pubnub_binary_enc enc)
+{
+    struct pubnub_publish_options opts = pubnub_publish_defopts();
+    enum pubnub_res rslt = pubnub_publish_begin(pb, channel);
+
+    if (rslt != PNR_OK) {
+        return rslt;
+    }
+    pbcc_msg_binary(&pb->core, data, len, enc);
+    return pubnub_publish_end(pb, &opts);
+}
+
+
+char const *pubnub_last_publish_timetoken(pubnub_t const *pb)
+{
+    assert(valid_ctx_ptr(pb));
+    return pb->core.publish_timetoken;
+}
+
+
+char const *pubnub_last_publish_result(pubnub_t const *pb)
+{
+    assert(valid_ctx_ptr(pb));
+    return pb->core.publish_desc;
+}
+
+
+void pubnub_set_seq_stamp(pubnub_t *pb, bool stamp)
+{
+    assert(valid_ctx_ptr(pb));
+    pb->seq_stamp = stamp;
+}
+
+
+unsigned pubnub_last_publish_multi(pubnub_t const *pb)
+{
+    assert(valid_ctx_ptr(pb));
+    return pb->pipe_ok;
+}
+
+
+enum pubnub_res pubnub_publish_queued(pubnub_t *pb, struct pubnub_pubreq *req, const char *channel, const char *message, unsigned char priority, clock_time_t lifetime)
+{
+    struct pubnub_pubreq **pp;
+
+    assert(valid_ctx_ptr(pb));
+    assert(req != NULL);
+
+    req->channel = channel;
+    req->message = message;
+    req->priority = priority;
+    req->deadline.interval = 0;
+    if (lifetime != 0) {
+        timer_set(&req->deadline, lifetime);
+    }
+    req->initiator = PROCESS_CURRENT();
+    req->result = PNR_STARTED;
+
+    for (pp = &pb->pubq; (*pp != NULL) && ((*pp)->priority >= priority); pp = &(*pp)->next) {
+        continue;
+    }
+    req->next = *pp;
+    *pp = req;
+
+    if (pb->coalesce_max != 0) {
+        /* Wait a little for more messages, unless there's enough */
+        if ((pb->state == PS_IDLE) && !pb->holdoff) {
+            holdoff_start(pb, pb->coalesce_window);
+        }
+        if (pb->holdoff && (pubq_length(pb, pb->pubq->channel) >= pb->coalesce_max)) {
+            ctimer_stop(&pb->holdoff_timer);
+            holdoff_timeout(pb);
+        }
+        return PNR_STARTED;
+    }
+    if ((pb->state == PS_IDLE) && (pb->pubq == req) && !pb->holdoff && rx_empty(pb)) {
+        if (!rate_allows(pb, 1)) {
+            pubq_advance(pb);
+            return PNR_STARTED;
+        }
+        pb->pubq = req->next;
+        req->result = pubreq_start(pb, req);
+        return req->result;
+    }
+
+    return PNR_STARTED;
+}
+
+
+void pubnub_set_coalesce(pubnub_t *pb, clock_time_t window, unsigned max_len)
+{
+    assert(valid_ctx_ptr(pb));
+    pb->coalesce_window = window;
+    pb->coalesce_max = max_len;
+}
+
+
+void pubnub_set_rate_limit(pubnub_t *pb, clock_time_t period, unsigned char burst)
+{
+    assert(valid_ctx_ptr(pb));
+    pb->rate_period = period;
+    pb->burst = pb->tokens = burst;
+    pb->rate_last = clock_time();
+    pb->rate_rejected = pb->rate_delayed = 0;
+}
+
+
+void pubnub_get_rate_stats(pubnub_t *pb, struct pubnub_rate_stats *stats)
+{
+    assert(valid_ctx_ptr(pb));
+    rate_allows(pb, 0);
+    stats->tokens = pb->tokens;
+    stats->rejected = pb->rate_rejected;
+    stats->delayed = pb->rate_delayed;
+}
+
+
+#if PUBNUB_SPOOL_SEGMENT > 0
+enum pubnub_res pubnub_spool(pubnub_t *pb, const char *channel, const char *message)
+{
+    /* The record is written at once, so a failed write can't leave
+       half of it in the middle of the segment */
+    static char record[PUBNUB_BUF_MAXLEN];
+    size_t chan_len = strlen(channel) + 1;
+    size_t len = chan_len + strlen(message) + 1;
+    int fd;
+
+    assert(valid_ctx_ptr(pb));
+    
+    if ((len > sizeof record) || (len > PUBNUB_SPOOL_SEGMENT - SPOOL_HDR)) {
+        return PNR_TX_BUFF_TOO_SMALL;
+    }
+    memcpy(record, channel, chan_len);
+    memcpy(record + chan_len, message, len - chan_len);
+    if ((0 == pb->spool_end[pb->spool_wslot]) || (pb->spool_end[pb->spool_wslot] + len > PUBNUB_SPOOL_SEGMENT)) {
+        if (!spool_rotate(pb)) {
+            return PNR_IO_ERROR;
+        }
+    }
+    fd = cfs_open(spool_name(pb, pb->spool_wslot), CFS_WRITE | CFS_APPEND);
+    if (fd < 0) {
+        return PNR_IO_ERROR;
+    }
+    if (cfs_write(fd, record, len) != (int)len) {
+        /* Don't write after the broken record, it will be skipped
+           when read, so mark the segment full */
+        cfs_close(fd);
+        pb->spool_end[pb->spool_wslot] = PUBNUB_SPOOL_SEGMENT;
+        return PNR_IO_ERROR;
+    }
+    cfs_close(fd);
+    pb->spool_end[pb->spool_wslot] += len;
+    pb->spool_queued += len;
+    pb->spool_stalled = false;
+    process_poll(&pubnub_process);
+    
+    return PNR_OK;
+}
+
+
+void pubnub_get_spool_stats(pubnub_t *pb, struct pubnub_spool_stats *stats)
+{
+    unsigned slot;
+
+    assert(valid_ctx_ptr(pb));
+    stats->queued = pb->spool_queued;
+    stats->drained = pb->spool_drained;
+    stats->dropped = pb->spool_dropped;
+    stats->pending = 0;
+    if (spool_empty(pb)) {
+        return;
+    }
+    stats->pending = pb->spool_end[pb->spool_rslot] - pb->spool_roff;
+    for (slot = pb->spool_rslot; slot != pb->spool_wslot; ) {
+        slot = (slot + 1) % PUBNUB_SPOOL_SEGMENTS;
+        if (pb->spool_end[slot] != 0) {
+            stats->pending += pb->spool_end[slot] - SPOOL_HDR;
+        }
+    }
+}
+#endif
+
+
+#if PUBNUB_CHANNEL_SET_MAXLEN > 0
+enum pubnub_res pubnub_add_channel(pubnub_t *pb, char const *channel)
+{
+    assert(valid_ctx_ptr(pb));
+    assert(strchr(channel, ',') == NULL);
+    
+    if (!list_add(pb->chan_set, sizeof pb->chan_set, channel)) {
+        return PNR_TX_BUFF_TOO_SMALL;
+    }
+    list_remove(pb->leave_set, channel);
+    
+    return PNR_OK;
+}
+
+
+bool pubnub_remove_channel(pubnub_t *pb, char const *channel)
+{
+    assert(valid_ctx_ptr(pb));
+    
+    if (!list_remove(pb->chan_set, channel)) {
+        return false;
+    }
+    /* If it doesn't fit, the server will drop us from it eventually */
+    list_add(pb->leave_set, sizeof pb->leave_set, channel);
+    
+    return true;
+}
+#endif
+
+
+#if PUBNUB_DEMUX_SIZE > 0
+bool pubnub_set_handler(pubnub_t *pb, char const *channel, pubnub_subscribe_cb cb, void *user_data)
+{
+    int id;
+
+    assert(valid_ctx_ptr(pb));
+    
+    if (NULL == channel) {
+        pb->demux_default = cb;
+        pb->demux_default_data = user_data;
+        return true;
+    }
+    id = demux_find(pb, channel);
+    if (NULL == cb) {
+        if (id >= 0) {
+            /* Re-insert the rest of the cluster, to keep it reachable */
+            unsigned i = (id + 1) % PUBNUB_DEMUX_SIZE;
+            pb->demux[id].channel = NULL;
+            --pb->demux_n;
+            while (pb->demux[i].channel != NULL) {
+                struct pubnub_demux d = pb->demux[i];
+                pb->demux[i].channel = NULL;
+                demux_insert(pb, &d);
+                i = (i + 1) % PUBNUB_DEMUX_SIZE;
+            }
+        }
+        return true;
+    }
+    if (id < 0) {
+        struct pubnub_demux d;
+        if (pb->demux_n >= PUBNUB_DEMUX_SIZE) {
+            return false;
+        }
+        d.channel = channel;
+        d.cb = cb;
+        d.user_data = user_data;
+        demux_insert(pb, &d);
+        ++pb->demux_n;
+    }
+    else {
+        pb->demux[id].cb = cb;
+        pb->demux[id].user_data = user_data;
+    }
+    
+    return true;
+}
+#endif
+
+
+#if PUBNUB_INBOX_SIZE > 0
+bool pubnub_inbox_peek(pubnub_t *pb, struct pubnub_inbox_msg *msg)
+{
+    assert(valid_ctx_ptr(pb));
+    return pbcc_inbox_peek(&pb->core, msg);
+}
+
+
+bool pubnub_inbox_pop(pubnub_t *pb)
+{
+    assert(valid_ctx_ptr(pb));
+    return pbcc_inbox_pop(&pb->core);
+}
+
+
+void pubnub_set_inbox_policy(pubnub_t *pb, enum pubnub_inbox_policy policy)
+{
+    assert(valid_ctx_ptr(pb));
+    pb->core.inbox_drop_oldest = (PNIP_DROP_OLDEST == policy);
+    pb->core.inbox_received = pb->core.inbox_dropped = 0;
+}
+
+
+void pubnub_get_inbox_stats(pubnub_t *pb, struct pubnub_inbox_stats *stats)
+{
+    assert(valid_ctx_ptr(pb));
+    stats->count = pb->core.inbox_count;
+    stats->received = pb->core.inbox_received;
+    stats->dropped = pb->core.inbox_dropped;
+}
+#endif
+
+
+void pubnub_set_retry(pubnub_t *pb, unsigned char max_attempts, clock_time_t base, clock_time_t cap, unsigned char jitter)
 {
-    return ((pb >= m_aCtx) && (pb < m_aCtx + PUBNUB_CTX_MAX));
+    assert(valid_ctx_ptr(pb));
+    pb->retry_max = max_attempts;
+    pb->retry_base = base;
+    pb->retry_cap = cap;
+    pb->retry_jitter = (jitter > 100) ? 100 : jitter;
 }
 
 
-/** Handles start of a TCP (HTTP) connection. It first handles DNS
-    resolving for the context @p pb.  If DNS is already resolved, it
-    proceeds to establishing TCP connection. Otherwise, will issue a
-    DNS request and go to state of awaiting response.
+void pubnub_set_unpack(pubnub_t *pb, bool unpack)
+{
+    assert(valid_ctx_ptr(pb));
+    pb->core.unpack = unpack;
+}
 
-    Call this function on start of a transaction or on receiving
-    response from DNS server.
 
-    @param pb The context for which to handle starting of connection
-*/
-static void handle_start_connect(pubnub_t *pb)
+char const *pubnub_get(pubnub_t *pb)
 {
-    uip_ipaddr_t *ipaddrptr;
-    
+    char const *msg;
+
     assert(valid_ctx_ptr(pb));
-    assert((pb->state == PS_IDLE) || (pb->state == PS_WAIT_DNS));
-    
-    pubnub_dns_lookup(PUBNUB_ORIGIN, ipaddrptr);
-    if (NULL == ipaddrptr) {
-        DEBUG_PRINTF("Pubnub: DNS Querying for %s\n", PUBNUB_ORIGIN);
-        pubnub_dns_query(PUBNUB_ORIGIN);
-        pb->state = PS_WAIT_DNS;
-        return;
+
+    msg = pbcc_get_msg(&pb->core);
+    if ((NULL == msg) && (pb->pubq != NULL)) {
+        process_poll(&pubnub_process);
     }
     
-    PROCESS_CONTEXT_BEGIN(&pubnub_process);
-    tcp_connect(ipaddrptr, uip_htons(HTTP_PORT), pb);
-    PROCESS_CONTEXT_END(&pubnub_process);
-    pb->state = PS_CONNECT;
+    return msg;
 }
 
 
-void pubnub_init(pubnub_t *p, const char *publish_key, const char *subscribe_key)
+#if PUBNUB_DEDUP_SIZE > 0
+unsigned pubnub_dedup_count(pubnub_t const *pb)
 {
-    assert(valid_ctx_ptr(p));
+    assert(valid_ctx_ptr(pb));
+    return pb->core.dedup_count;
+}
+#endif
 
-    pbcc_init(&p->core, publish_key, subscribe_key);
-    p->state = PS_IDLE;
-    p->trans = PBTT_NONE;
+
+#if PUBNUB_SEQ_SOURCES > 0
+void pubnub_set_seq_tracking(pubnub_t *pb, bool track, pubnub_seq_cb cb, void *user_data)
+{
+    assert(valid_ctx_ptr(pb));
+    pb->core.seq_track = track;
+    pb->core.seq_cb = cb;
+    pb->core.seq_pb = pb;
+    pb->core.seq_data = user_data;
+    pb->core.seq_n = 0;
+    memset(&pb->core.seq_stats, 0, sizeof pb->core.seq_stats);
 }
 
 
-void pubnub_done(pubnub_t *pb)
+void pubnub_get_seq_stats(pubnub_t *pb, struct pubnub_seq_stats *stats)
 {
     assert(valid_ctx_ptr(pb));
-    pubnub_cancel(pb);
+    *stats = pb->core.seq_stats;
 }
+#endif
 
 
-static process_event_t trans2event(enum pubnub_trans trans)
+char const *pubnub_get_channel(pubnub_t *pb)
 {
-    switch (trans) {
-    case PBTT_SUBSCRIBE:
-        return pubnub_subscribe_event;
-    case PBTT_PUBLISH:
-        return pubnub_publish_event;
-    case PBTT_LEAVE:
-        return pubnub_leave_event;
-    case PBTT_NONE:
-    default:
-        assert(0);
-        return PROCESS_EVENT_NONE;
-    }
+    assert(valid_ctx_ptr(pb));
+
+    return pbcc_get_channel(&pb->core);
 }
 
 
-static void trans_outcome(pubnub_t *pb, enum pubnub_res result)
+/** Starts a subscribe transaction on context @p p, continuous if @p
+    cb is not NULL.
+*/
+static enum pubnub_res subscribe_start(pubnub_t *p, const char *channel, pubnub_subscribe_cb cb, void *user_data)
 {
-    pb->core.last_result = result;
+    enum pubnub_res rslt;
+
+    if (p->state != PS_IDLE) {
+        return PNR_IN_PROGRESS;
+    }
     
-    DEBUG_PRINTF("Pubnub: Transaction outcome: %d, HTTP code: %d\n",
-                 result, pb->core.http_code
-        );
-    if ((result == PNR_FORMAT_ERROR) || (PUBNUB_MISSMSG_OK && (result != PNR_OK))) {
-        /* In case of PubNub protocol error, abort an ongoing
-         * subscribe and start over. This means some messages were
-         * lost, but allows us to recover from bad situations,
-         * e.g. too many messages queued or unexpected problem caused
-         * by a particular message. */
-        pb->core.timetoken[0] = '0';
-        pb->core.timetoken[1] = '\0';
+    p->trans_chan = channel;
+    rslt = subscribe_prep(p);
+    if (PNR_STARTED == rslt) {
+        p->initiator = PROCESS_CURRENT();
+        p->trans = PBTT_SUBSCRIBE;
+        p->sub_cb = cb;
+        p->sub_data = user_data;
+        handle_start_connect(p);
     }
     
-    pb->state = PS_IDLE;
-    process_post(pb->initiator, trans2event(pb->trans), pb);
+    return rslt;
 }
 
 
-void pubnub_cancel(pubnub_t *pb)
+char const *pubnub_get_subscription(pubnub_t *pb)
 {
     assert(valid_ctx_ptr(pb));
+
+    return pbcc_get_subscription(&pb->core);
+}
+
+
+enum pubnub_res pubnub_subscribe(pubnub_t *p, const char *channel)
+{
+    assert(valid_ctx_ptr(p));
     
-    switch (pb->state) {
-    case PS_WAIT_CANCEL:
-    case PS_WAIT_CANCEL_CLOSE:
-    case PS_IDLE:
-        break;
-    case PS_WAIT_DNS:
-        pb->core.msg_ofs = pb->core.msg_end = 0;
-        trans_outcome(pb, PNR_CANCELLED);
-        break;
-    default:
-        pb->state = PS_WAIT_CANCEL;
-        break;                        
-    }
+    return subscribe_start(p, channel, NULL, NULL);
 }
 
 
-enum pubnub_res pubnub_publish(pubnub_t *pb, const char *channel, const char *message)
+enum pubnub_res pubnub_subscribe_continuous(pubnub_t *p, const char *channel, pubnub_subscribe_cb cb, void *user_data)
+{
+    assert(valid_ctx_ptr(p));
+    assert(cb != NULL);
+    
+    return subscribe_start(p, channel, cb, user_data);
+}
+
+
+enum pubnub_res pubnub_leave(pubnub_t *p, const char *channel)
 {
     enum pubnub_res rslt;
 
-    assert(valid_ctx_ptr(pb));
+    assert(valid_ctx_ptr(p));
     
-    if (pb->state != PS_IDLE) {
+    if (p->state != PS_IDLE) {
         return PNR_IN_PROGRESS;
     }
+    
+    rslt = pbcc_leave_prep(&p->core, channel);
+    if (PNR_STARTED == rslt) {
+        p->initiator = PROCESS_CURRENT();
+        p->trans = PBTT_LEAVE;
+        p->trans_chan = channel;
+        handle_start_connect(p);
+    }
+    
+    return rslt;
+}
+
+
+enum pubnub_res pubnub_time(pubnub_t *p)
+{
+    enum pubnub_res rslt;
 
-    rslt = pbcc_publish_prep(&pb->core, channel, message);
+    assert(valid_ctx_ptr(p));
+    
+    if (p->state != PS_IDLE) {
+        return PNR_IN_PROGRESS;
+    }
+    
+    rslt = pbcc_time_prep(&p->core);
     if (PNR_STARTED == rslt) {
-        pb->initiator = PROCESS_CURRENT();
-        pb->trans = PBTT_PUBLISH;
-        handle_start_connect(pb);
+        p->initiator = PROCESS_CURRENT();
+        p->trans = PBTT_TIME;
+        handle_start_connect(p);
     }
     
     return rslt;
 }
 
 
-char const *pubnub_get(pubnub_t *pb)
+char const *pubnub_get_time(pubnub_t const *p, clock_time_t *at)
 {
-    assert(valid_ctx_ptr(pb));
+    assert(valid_ctx_ptr(p));
+    
+    if ('\0' == p->core.server_time[0]) {
+        return NULL;
+    }
+    if (at != NULL) {
+        *at = p->time_at;
+    }
+    return p->core.server_time;
+}
 
-    return pbcc_get_msg(&pb->core);
+
+enum pubnub_res pubnub_set_timetoken(pubnub_t *p, char const *tt)
+{
+    assert(valid_ctx_ptr(p));
+    
+    if (p->state != PS_IDLE) {
+        return PNR_IN_PROGRESS;
+    }
+    if (pbcc_set_timetoken(&p->core, tt) != 0) {
+        return PNR_FORMAT_ERROR;
+    }
+    
+    return PNR_OK;
 }
 
 
-char const *pubnub_get_channel(pubnub_t *pb)
+char const *pubnub_last_time_token(pubnub_t const *p)
 {
-    assert(valid_ctx_ptr(pb));
+    assert(valid_ctx_ptr(p));
+    
+    return p->core.timetoken;
+}
 
-    return pbcc_get_channel(&pb->core);
+
+struct pubnub_history_options pubnub_history_defopts(void)
+{
+    struct pubnub_history_options rslt = { 100, NULL, NULL, false };
+    return rslt;
 }
 
 
-enum pubnub_res pubnub_subscribe(pubnub_t *p, const char *channel)
+enum pubnub_res pubnub_history(pubnub_t *p, const char *channel, struct pubnub_history_options const *opts)
 {
     enum pubnub_res rslt;
 
     assert(valid_ctx_ptr(p));
+    assert(opts != NULL);
     
     if (p->state != PS_IDLE) {
         return PNR_IN_PROGRESS;
     }
     
-    rslt = pbcc_subscribe_prep(&p->core, channel);
+    rslt = pbcc_history_prep(&p->core, channel, opts->count, opts->start, opts->end, opts->reverse);
     if (PNR_STARTED == rslt) {
         p->initiator = PROCESS_CURRENT();
-        p->trans = PBTT_SUBSCRIBE;
+        p->trans = PBTT_HISTORY;
+        p->trans_chan = channel;
+        p->trans_hist = *opts;
         handle_start_connect(p);
     }
     
@@ -259,20 +2238,38 @@ enum pubnub_res pubnub_subscribe(pubnub_t *p, const char *channel)
 }
 
 
-enum pubnub_res pubnub_leave(pubnub_t *p, const char *channel)
+void pubnub_history_range(pubnub_t const *p, char const **start, char const **end)
 {
-    enum pubnub_res rslt;
-
     assert(valid_ctx_ptr(p));
     
+    if (start != NULL) {
+        *start = ('\0' == p->core.history_start[0]) ? NULL : p->core.history_start;
+    }
+    if (end != NULL) {
+        *end = ('\0' == p->core.history_end[0]) ? NULL : p->core.history_end;
+    }
+}
+
+
+/** Starts a transaction of changing the channels of the channel @p
+    group on context @p p, adding the @p channels if @p add, otherwise
+    removing them.
+*/
+static enum pubnub_res channel_group_start(pubnub_t *p, const char *channels, const char *group, bool add)
+{
+    enum pubnub_res rslt;
+
     if (p->state != PS_IDLE) {
         return PNR_IN_PROGRESS;
     }
     
-    rslt = pbcc_leave_prep(&p->core, channel);
+    rslt = pbcc_channel_registry_prep(&p->core, group, add ? "add" : "remove", channels);
     if (PNR_STARTED == rslt) {
         p->initiator = PROCESS_CURRENT();
-        p->trans = PBTT_LEAVE;
+        p->trans = PBTT_CHANNEL_GROUP;
+        p->trans_chan = channels;
+        p->trans_msg = group;
+        p->group_add = add;
         handle_start_connect(p);
     }
     
@@ -280,6 +2277,22 @@ enum pubnub_res pubnub_leave(pubnub_t *p, const char *channel)
 }
 
 
+enum pubnub_res pubnub_add_channels_to_group(pubnub_t *p, const char *channels, const char *group)
+{
+    assert(valid_ctx_ptr(p));
+    
+    return channel_group_start(p, channels, group, true);
+}
+
+
+enum pubnub_res pubnub_remove_channels_from_group(pubnub_t *p, const char *channels, const char *group)
+{
+    assert(valid_ctx_ptr(p));
+    
+    return channel_group_start(p, channels, group, false);
+}
+
+
 static void handle_dns_found(char const* name)
 {
     pubnub_t *pb;
@@ -302,92 +2315,146 @@ static void handle_dns_found(char const* name)
         PSOCK_SEND((psock), s_, sizeof s_ - 1); }
 
 
+/** Returns the index of the first pipelined request of the ongoing
+    transaction of context @p pb, from @p i on, that is to be sent in
+    this attempt. Retries of a fan-out publish skip the channels it
+    succeeded on.
+*/
+static unsigned char pipe_next(pubnub_t const *pb, unsigned char i)
+{
+    if (pb->multi_chan != NULL) {
+        while ((i < pb->pipe_n) && (pb->pipe_ok & (1 << i))) {
+            ++i;
+        }
+    }
+    return i;
+}
+
+
 PT_THREAD(handle_transaction(pubnub_t *pb))
 {
     PSOCK_BEGIN(&pb->psock);
     
     pb->core.http_code = 0;
+    if (NULL == pb->multi_chan) {
+        pb->pipe_ok = 0;
+    }
+    pb->sent_at = clock_time();
     
-    /* Send HTTP request */
-    DEBUG_PRINTF("Pubnub: Sending HTTP request...\n");
-    PSOCK_SEND_LITERAL_STR(&pb->psock, "GET ");
-    PSOCK_SEND_STR(&pb->psock, pb->core.http_buf);
-    PSOCK_SEND_LITERAL_STR(&pb->psock, " HTTP/1.1\r\nHost: ");
-    PSOCK_SEND_STR(&pb->psock, PUBNUB_ORIGIN);
-    PSOCK_SEND_LITERAL_STR(&pb->psock, "\r\nUser-Agent: PubNub-ConTiki/0.1\r\nConnection: Keep-Alive\r\n\r\n");
-    
-    /* Read HTTP response status line */
-    DEBUG_PRINTF("Pubnub: Reading HTTP response status line...\n");
-    PSOCK_READTO(&pb->psock, '\n');
-    if (strncmp(pb->core.http_buf, "HTTP/1.", 7) != 0) {
-        trans_outcome(pb, PNR_IO_ERROR);
+    /* Send HTTP request(s). Pipelined requests of a fan-out publish
+       differ only in the channel, so we just replace it, keeping the
+       encoded message.
+    */
+    for (pb->pipe_i = pipe_next(pb, 0); pb->pipe_i < pb->pipe_n; pb->pipe_i = pipe_next(pb, pb->pipe_i + 1)) {
+        if (pb->multi_chan != NULL) {
+            pbcc_publish_set_channel(&pb->core, pb->multi_chan[pb->pipe_i]);
+        }
+#if PUBNUB_CHANNEL_SET_MAXLEN > 0
+        else if ((pb->pipe_i > 0) && (PBTT_SUBSCRIBE == pb->trans)) {
+            /* Leave was sent first, now the subscribe itself */
+            pbcc_subscribe_prep(&pb->core, subscribe_channels(pb));
+        }
+#endif
+        DEBUG_PRINTF("Pubnub: Sending HTTP request...\n");
+        PSOCK_SEND_LITERAL_STR(&pb->psock, "GET ");
+        PSOCK_SEND_STR(&pb->psock, pb->core.http_buf);
+        PSOCK_SEND_LITERAL_STR(&pb->psock, " HTTP/1.1\r\nHost: ");
+        PSOCK_SEND_STR(&pb->psock, PUBNUB_ORIGIN);
+        PSOCK_SEND_LITERAL_STR(&pb->psock, "\r\nUser-Agent: PubNub-ConTiki/0.1\r\nConnection: Keep-Alive\r\n\r\n");
+    }
+    
+    if ((PBTT_PUBLISH == pb->trans) && (NULL == pb->pubreq) && pb->trans_opts.fire_and_forget) {
+        /* The server has ACKed the request, so we close the
+           connection without reading the response. */
+        DEBUG_PRINTF("Pubnub: Fire and forget, done\n");
+        tcp_markconn(uip_conn, NULL);
+        pb->pipe_ok = 1;
+        trans_outcome(pb, PNR_OK);
         PSOCK_CLOSE_EXIT(&pb->psock);
     }
-    pb->core.http_code = atoi(pb->core.http_buf + 9);
     
-    /* Read response header to find out either the length of the body
-       or that body is chunked.
-    */
-    DEBUG_PRINTF("Pubnub: Reading HTTP response header...\n");
-    pb->core.http_content_len = 0;
-    pb->core.http_chunked = false;
-    while (PSOCK_DATALEN(&pb->psock) > 2) {
+    for (pb->pipe_i = pipe_next(pb, 0); pb->pipe_i < pb->pipe_n; pb->pipe_i = pipe_next(pb, pb->pipe_i + 1)) {
+        /* Read HTTP response status line */
+        DEBUG_PRINTF("Pubnub: Reading HTTP response status line...\n");
         PSOCK_READTO(&pb->psock, '\n');
-        char h_chunked[] = "Transfer-Encoding: chunked";
-        char h_length[] = "Content-Length: ";
-        if (strncmp(pb->core.http_buf, h_chunked, sizeof h_chunked - 1) == 0) {
-            pb->core.http_chunked = true;
-        }
-        else if (strncmp(pb->core.http_buf, h_length, sizeof h_length - 1) == 0) {
-            pb->core.http_content_len = atoi(pb->core.http_buf + sizeof h_length - 1);
-            if (pb->core.http_content_len > PUBNUB_REPLY_MAXLEN) {
-                trans_outcome(pb, PNR_IO_ERROR);
-                PSOCK_CLOSE_EXIT(&pb->psock);
-            }
+        if (strncmp(pb->core.http_buf, "HTTP/1.", 7) != 0) {
+            trans_outcome(pb, PNR_IO_ERROR);
+            PSOCK_CLOSE_EXIT(&pb->psock);
         }
-    }
+        pb->core.http_code = atoi(pb->core.http_buf + 9);
     
-    /* Read the body - either at once, or chunk by chunk */
-    DEBUG_PRINTF("Pubnub: Reading HTTP response body...");
-    pb->core.http_buf_len = 0;
-    if (pb->core.http_chunked) {
-        DEBUG_PRINTF("...chunked\n");
-        for (;;) {
+        /* Read response header to find out either the length of the body
+           or that body is chunked.
+        */
+        DEBUG_PRINTF("Pubnub: Reading HTTP response header...\n");
+        pb->core.http_content_len = 0;
+        pb->core.http_chunked = false;
+        while (PSOCK_DATALEN(&pb->psock) > 2) {
             PSOCK_READTO(&pb->psock, '\n');
-            pb->core.http_content_len = strtoul(pb->core.http_buf, NULL, 16);
-            if (pb->core.http_content_len == 0) {
-                break;
+            char h_chunked[] = "Transfer-Encoding: chunked";
+            char h_length[] = "Content-Length: ";
+            if (strncmp(pb->core.http_buf, h_chunked, sizeof h_chunked - 1) == 0) {
+                pb->core.http_chunked = true;
             }
-            if (pb->core.http_content_len > sizeof pb->core.http_buf) {
-                trans_outcome(pb, PNR_IO_ERROR);
-                PSOCK_CLOSE_EXIT(&pb->psock);
+            else if (strncmp(pb->core.http_buf, h_length, sizeof h_length - 1) == 0) {
+                pb->core.http_content_len = atoi(pb->core.http_buf + sizeof h_length - 1);
+                if (pb->core.http_content_len > PUBNUB_REPLY_MAXLEN) {
+                    trans_outcome(pb, PNR_IO_ERROR);
+                    PSOCK_CLOSE_EXIT(&pb->psock);
+                }
             }
-            if (pb->core.http_buf_len + pb->core.http_content_len > PUBNUB_REPLY_MAXLEN) {
-                trans_outcome(pb, PNR_IO_ERROR);
-                PSOCK_CLOSE_EXIT(&pb->psock);
+        }
+    
+        /* Read the body - either at once, or chunk by chunk */
+        DEBUG_PRINTF("Pubnub: Reading HTTP response body...");
+        pb->core.http_buf_len = 0;
+        if (pb->core.http_chunked) {
+            DEBUG_PRINTF("...chunked\n");
+            for (;;) {
+                PSOCK_READTO(&pb->psock, '\n');
+                pb->core.http_content_len = strtoul(pb->core.http_buf, NULL, 16);
+                if (pb->core.http_content_len == 0) {
+                    break;
+                }
+                if (pb->core.http_content_len > sizeof pb->core.http_buf) {
+                    trans_outcome(pb, PNR_IO_ERROR);
+                    PSOCK_CLOSE_EXIT(&pb->psock);
+                }
+                if (pb->core.http_buf_len + pb->core.http_content_len > PUBNUB_REPLY_MAXLEN) {
+                    trans_outcome(pb, PNR_IO_ERROR);
+                    PSOCK_CLOSE_EXIT(&pb->psock);
+                }
+                PSOCK_READBUF_LEN(&pb->psock, pb->core.http_content_len + 2);
+                memcpy(
+                    pb->core.http_reply + pb->core.http_buf_len, 
+                    pb->core.http_buf, 
+                    pb->core.http_content_len
+                    );
+                pb->core.http_buf_len += pb->core.http_content_len;
+            }
+            if (pipe_next(pb, pb->pipe_i + 1) < pb->pipe_n) {
+                /* Skip the (empty) trailer, next response follows */
+                PSOCK_READTO(&pb->psock, '\n');
             }
-            PSOCK_READBUF_LEN(&pb->psock, pb->core.http_content_len + 2);
-            memcpy(
-                pb->core.http_reply + pb->core.http_buf_len, 
-                pb->core.http_buf, 
-                pb->core.http_content_len
-                );
-            pb->core.http_buf_len += pb->core.http_content_len;
         }
-    }
-    else {
-        DEBUG_PRINTF("...regular\n");
-        while (pb->core.http_buf_len < pb->core.http_content_len) {
-            PSOCK_READBUF_LEN(&pb->psock, pb->core.http_content_len - pb->core.http_buf_len);
-            memcpy(
-                pb->core.http_reply + pb->core.http_buf_len, 
-                pb->core.http_buf, 
-                PSOCK_DATALEN(&pb->psock)
-                );
-            pb->core.http_buf_len += PSOCK_DATALEN(&pb->psock);
+        else {
+            DEBUG_PRINTF("...regular\n");
+            while (pb->core.http_buf_len < pb->core.http_content_len) {
+                PSOCK_READBUF_LEN(&pb->psock, pb->core.http_content_len - pb->core.http_buf_len);
+                memcpy(
+                    pb->core.http_reply + pb->core.http_buf_len, 
+                    pb->core.http_buf, 
+                    PSOCK_DATALEN(&pb->psock)
+                    );
+                pb->core.http_buf_len += PSOCK_DATALEN(&pb->psock);
+            }
+        }
+        pb->core.http_reply[pb->core.http_buf_len] = '\0';
+        if ((pb->core.http_code / 100 == 2)
+            && (!trans_publishes(pb) || (PNR_OK == pbcc_parse_publish_response(&pb->core)))) {
+            pb->pipe_ok |= 1 << pb->pipe_i;
         }
     }
-    pb->core.http_reply[pb->core.http_buf_len] = '\0';
     
     DEBUG_PRINTF("Pubnub: done reading HTTP response\n");
     if (PBTT_SUBSCRIBE == pb->trans) {
@@ -396,6 +2463,21 @@ PT_THREAD(handle_transaction(pubnub_t *pb))
             PSOCK_CLOSE_EXIT(&pb->psock);
         }
     }
+    else if ((PBTT_HISTORY == pb->trans) && (pb->pipe_ok != 0)) {
+        if (pbcc_parse_history_response(&pb->core) != 0) {
+            trans_outcome(pb, PNR_FORMAT_ERROR);
+            PSOCK_CLOSE_EXIT(&pb->psock);
+        }
+    }
+    else if ((PBTT_TIME == pb->trans) && (pb->pipe_ok != 0)) {
+        if (pbcc_parse_time_response(&pb->core) != 0) {
+            trans_outcome(pb, PNR_FORMAT_ERROR);
+            PSOCK_CLOSE_EXIT(&pb->psock);
+        }
+        /* Server took its time somewhere in the round trip, assume
+           half way */
+        pb->time_at = pb->sent_at + (clock_time() - pb->sent_at) / 2;
+    }
     
     PSOCK_CLOSE(&pb->psock);
     pb->state = PS_WAIT_CLOSE;
@@ -406,7 +2488,7 @@ PT_THREAD(handle_transaction(pubnub_t *pb))
 
 static void handle_tcpip(pubnub_t *pb)
 {
-    if ((PS_IDLE == pb->state) || (PS_WAIT_DNS == pb->state)) {
+    if ((PS_IDLE == pb->state) || (PS_WAIT_DNS == pb->state) || (PS_WAIT_RETRY == pb->state)) {
         return;
     }
     if (uip_aborted()) {
@@ -439,8 +2521,16 @@ static void handle_tcpip(pubnub_t *pb)
         break;
     case PS_WAIT_CLOSE:
         if (uip_closed()) {
+            /* Outcome of a leave sent before a subscribe doesn't matter */
+            unsigned need = (PBTT_SUBSCRIBE == pb->trans) ? (1U << (pb->pipe_n - 1)) : (unsigned)((1UL << pb->pipe_n) - 1);
+            enum pubnub_res rslt = ((pb->pipe_ok & need) == need) ? PNR_OK : PNR_HTTP_ERROR;
+            if ((PNR_HTTP_ERROR == rslt) && trans_publishes(pb) && (pb->core.http_code / 100 == 2)) {
+                /* HTTP was OK, so the server said it wasn't published,
+                   or we couldn't understand what it said */
+                rslt = ('\0' == pb->core.publish_timetoken[0]) ? PNR_FORMAT_ERROR : PNR_PUBLISH_FAILED;
+            }
             tcp_markconn(uip_conn, NULL);
-            trans_outcome(pb, (pb->core.http_code / 100 == 2) ? PNR_OK : PNR_HTTP_ERROR);
+            trans_outcome(pb, rslt);
         }
         break;
     case PS_WAIT_CANCEL:
@@ -451,6 +2541,7 @@ static void handle_tcpip(pubnub_t *pb)
         if (uip_closed()) {
             tcp_markconn(uip_conn, NULL);
             pb->core.msg_ofs = pb->core.msg_end = 0;
+            pb->core.unpack_ofs = pb->core.unpack_end = 0;
             trans_outcome(pb, PNR_CANCELLED);
         }
         break;
@@ -469,6 +2560,9 @@ PROCESS_THREAD(pubnub_process, ev, data)
     pubnub_publish_event = process_alloc_event();
     pubnub_subscribe_event = process_alloc_event();
     pubnub_leave_event = process_alloc_event();
+    pubnub_channel_group_event = process_alloc_event();
+    pubnub_time_event = process_alloc_event();
+    pubnub_history_event = process_alloc_event();
     
     pubnub_dns_init();
     
@@ -485,6 +2579,13 @@ PROCESS_THREAD(pubnub_process, ev, data)
                 handle_dns_found(data);
             }                
         }
+        else if (ev == PROCESS_EVENT_POLL) {
+            pubnub_t *pb;
+            for (pb = m_aCtx; pb != m_aCtx + PUBNUB_CTX_MAX; ++pb) {
+                pubq_advance(pb);
+                spool_advance(pb);
+            }
+        }
     }
     
     PROCESS_END();
@@ -512,6 +2613,20 @@ void pubnub_set_auth(pubnub_t *pb, const char *auth)
 }
 
 
+void pubnub_set_channel_group(pubnub_t *pb, const char *group)
+{
+    assert(valid_ctx_ptr(pb));
+    pbcc_set_channel_group(&pb->core, group);
+}
+
+
+void pubnub_set_filter_expr(pubnub_t *pb, const char *expr)
+{
+    assert(valid_ctx_ptr(pb));
+    pbcc_set_filter_expr(&pb->core, expr);
+}
+
+
 enum pubnub_res pubnub_last_result(pubnub_t const *pb)
 {
     assert(valid_ctx_ptr(pb));
@@ -524,3 +2639,28 @@ int pubnub_last_http_code(pubnub_t const *pb)
     assert(valid_ctx_ptr(pb));
     return pb->core.http_code;
 }
+
+
+void pubnub_set_catchup(pubnub_t *pb, unsigned char max_errors, clock_time_t max_age)
+{
+    assert(valid_ctx_ptr(pb));
+    pb->catchup_max = max_errors;
+    pb->catchup_age = max_age;
+    pb->catchup_errors = 0;
+    pb->catchups = pb->catchup_resets = 0;
+}
+
+
+void pubnub_get_catchup_stats(pubnub_t *pb, struct pubnub_catchup_stats *stats)
+{
+    assert(valid_ctx_ptr(pb));
+    stats->catchups = pb->catchups;
+    stats->resets = pb->catchup_resets;
+}
+
+
+unsigned pubnub_last_attempts(pubnub_t const *pb)
+{
+    assert(valid_ctx_ptr(pb));
+    return pb->last_attempts;
+}
@@ -75,13 +75,101 @@
  * messages got queued on the Pubnub server. */
 #define PUBNUB_REPLY_MAXLEN 512
 
-/** If defined, the PubNub implementation will not try to catch-up on
- * messages it could miss while subscribe failed with an IO error or
- * such.  Use this if missing some messages is not a problem.  
- *
- * @note messages may sometimes still be lost due to potential @ref
- * PUBNUB_REPLY_MAXLEN overrun issue */
-#define PUBNUB_MISSMSG_OK 1
+#if !defined PUBNUB_REPLY_BUFFERS
+/** Number of HTTP reply buffers of a context, 1 or 2. With 2, the
+ * reply of a subscribe is received in one buffer while you read the
+ * messages from the other, so you may subscribe again before reading
+ * all the messages of the last subscribe. While both buffers hold
+ * unread messages, any transaction fails to start with
+ * #PNR_RX_BUFF_NOT_EMPTY, as it would have nowhere to receive its
+ * reply. The other buffer adds @ref PUBNUB_REPLY_MAXLEN bytes to the
+ * size of the context.  */
+#define PUBNUB_REPLY_BUFFERS 1
+#endif
+
+#if !defined PUBNUB_INBOX_SIZE
+/** Size (in bytes) of the message inbox of a context, 0 for no
+ * inbox. If there is an inbox, messages received by subscribe are put
+ * in it, to be read with pubnub_inbox_peek() and pubnub_inbox_pop()
+ * at your own pace, instead of pubnub_get(), which gets none. Messages
+ * taken by a callback (of pubnub_subscribe_continuous() or
+ * pubnub_set_handler()) are not put in the inbox. Each message takes
+ * the length of its channel, itself and the time token, plus 3 bytes.
+ * Must be less than 65536. */
+#define PUBNUB_INBOX_SIZE 0
+#endif
+
+#if !defined PUBNUB_DEDUP_SIZE
+/** Number of received messages a context remembers, as 32-bit
+ * hashes of their channel and contents, to drop duplicates, 0 for
+ * none. A message whose hash is among those of the last this many
+ * messages is dropped before it gets to pubnub_get() (or the inbox,
+ * or a callback), see pubnub_dedup_count(). This catches messages
+ * received again on a retry or catch-up, or published twice by a
+ * retried publish. But, it also drops a message that is the same as
+ * a recent one on the same channel, so if such messages are not
+ * duplicates, make them differ, e.g. by a sequence number. Each
+ * takes 4 bytes of the context. Must be less than 256. */
+#define PUBNUB_DEDUP_SIZE 0
+#endif
+
+#if !defined PUBNUB_SEQ_SOURCES
+/** Number of publishers whose sequence numbers a context tracks, 0
+ * for none. See pubnub_set_seq_tracking(). When more publishers are
+ * heard from, the one heard from least recently is forgotten. Each
+ * takes 8 bytes of the context. Must be less than 256. */
+#define PUBNUB_SEQ_SOURCES 0
+#endif
+
+#if !defined PUBNUB_CHANNEL_SET_MAXLEN
+/** Maximum length of the channel set of a context (comma-separated
+ * channel names), 0 for no channel set. See pubnub_add_channel().
+ * The context takes twice this much memory for it. */
+#define PUBNUB_CHANNEL_SET_MAXLEN 0
+#endif
+
+#if !defined PUBNUB_DEMUX_SIZE
+/** Size of the channel handler table of a context, 0 for none. See
+ * pubnub_set_handler(). To keep lookups short, make it about a third
+ * bigger than the number of channels you set handlers for. Must be
+ * less than 256. */
+#define PUBNUB_DEMUX_SIZE 0
+#endif
+
+#if !defined PUBNUB_PERSIST
+/** If `1`, the subscribe time token and the channel set of each
+ * context are saved to a file (using Contiki CFS, like Coffee on
+ * flash) and restored by pubnub_init(), so that subscribing goes on
+ * where it stopped, even across reboots. */
+#define PUBNUB_PERSIST 0
+#endif
+
+#if !defined PUBNUB_PERSIST_PERIOD
+/** Minimum time (in clock ticks) between two saves of the state of
+ * a context, see #PUBNUB_PERSIST. As the time token changes on
+ * every subscribe, this limits the wear of the flash. But, the
+ * longer it is, the more (already received) messages you may get
+ * again after a reboot. */
+#define PUBNUB_PERSIST_PERIOD (60 * CLOCK_SECOND)
+#endif
+
+#if !defined PUBNUB_SPOOL_SEGMENT
+/** Size (in bytes) of a segment of the publish spool of a context, 0
+ * for no spool. See pubnub_spool(). The spool is kept in (up to)
+ * #PUBNUB_SPOOL_SEGMENTS files (using Contiki CFS), so it takes at
+ * most that many times this much flash per context. A spooled
+ * message takes the length of its channel and itself, plus 2
+ * bytes. Must be less than 65536. */
+#define PUBNUB_SPOOL_SEGMENT 0
+#endif
+
+#if !defined PUBNUB_SPOOL_SEGMENTS
+/** Number of segments (files) of the publish spool of a context, at
+ * least 2. Segments are written round robin and each is erased only
+ * once it is drained (or dropped), which spreads the wear of the
+ * flash. */
+#define PUBNUB_SPOOL_SEGMENTS 4
+#endif
 
 /** This is the URL of the Pubnub server. Change only for testing
     purposes.
@@ -99,6 +187,10 @@
 
 /* -- You should not change anything below this line -- */
 
+/** Maximum number of channels of a fan-out publish, see
+    pubnub_publish_multi() */
+#define PUBNUB_MULTI_MAX 16
+
 struct pubnub;
 
 /** A pubnub context. An opaque data structure that holds all the
@@ -136,7 +228,55 @@ enum pubnub_res {
     PNR_RX_BUFF_NOT_EMPTY,
     /** The buffer is to small. Increase #PUBNUB_BUF_MAXLEN.
     */
-    PNR_TX_BUFF_TOO_SMALL
+    PNR_TX_BUFF_TOO_SMALL,
+    /** A queued publish was dropped, because its deadline passed
+        before it could be sent.
+    */
+    PNR_EXPIRED,
+    /** Publish rejected by the rate limiter, as there are no tokens
+        left. See pubnub_set_rate_limit().
+    */
+    PNR_RATE_LIMITED,
+    /** Subscribe to the channel set of the context, but it is
+        empty and no channel group is set. See pubnub_add_channel()
+        and pubnub_set_channel_group().
+    */
+    PNR_INVALID_CHANNEL,
+    /** Publish failed, even though the HTTP request succeeded, the
+        server reported an error in the response. See
+        pubnub_last_publish_result().
+    */
+    PNR_PUBLISH_FAILED
+};
+
+
+/** A publish request, to be put in the outbound queue of a context
+    with pubnub_publish_queued(). It is allocated by the user (it
+    may, of course, be static), and the library only links it into
+    the queue, so it has to stay valid (along with the channel and
+    message strings it points to) until its outcome is reported.
+
+    Treat all members as read-only, except that you may read @p
+    result after the outcome event for this request.
+ */
+struct pubnub_pubreq {
+    /** Next request in the queue (used by the library) */
+    struct pubnub_pubreq *next;
+    /** Channel (or comma-delimited list of channels) to publish to */
+    char const *channel;
+    /** The message to publish, in JSON format */
+    char const *message;
+    /** Requests with higher priority are sent first. Among requests
+        with the same priority, the order of queueing is kept. */
+    unsigned char priority;
+    /** If it expires before the request is sent, the request is
+        dropped. Not used if its interval is 0. */
+    struct timer deadline;
+    /** Process that queued the request */
+    struct process *initiator;
+    /** #PNR_STARTED while the request is queued or being sent,
+        outcome of the publish after that */
+    enum pubnub_res result;
 };
 
 
@@ -155,6 +295,10 @@ pubnub_t *pubnub_get_ctx(unsigned index);
     subscribe_key. You can customize other parameters of the context by
     the configuration function calls below.  
 
+    With #PUBNUB_PERSIST, the time token and the channel set saved
+    for the context are restored, if they were saved for the same
+    @p subscribe_key.
+
     @note The @p publish_key and @p subscribe key are expected to be
     valid (ASCIIZ string) pointers throughout the use of context @p p,
     that is, until either you call pubnub_done(), or the otherwise
@@ -199,8 +343,33 @@ void pubnub_set_uuid(pubnub_t *p, const char *uuid);
     the uuid string is not copied to the Pubnub context @p p.  */
 void pubnub_set_auth(pubnub_t *p, const char *auth);
 
+/** Set the channel group(s) of PubNub client context @p p. Every
+    subscribe on @p p will also subscribe to the channels of this
+    channel group (or comma-delimited list of channel groups). Pass
+    NULL to unset.
+
+    @note The @p group is expected to be a valid (ASCIIZ string)
+    pointer throughout the use of context @p p, as with
+    pubnub_set_auth(), it is not copied to the Pubnub context @p p.
+    @see pubnub_add_channels_to_group */
+void pubnub_set_channel_group(pubnub_t *p, const char *group);
+
+/** Set the filter expression of PubNub client context @p p. Every
+    subscribe on @p p will send it (URL-encoded) to the server, which
+    will then send us only the messages that match it, like
+    @c "region == 'eu' && temp > 20". Messages are matched by their
+    meta data, see pubnub_publish_meta(). Pass NULL to unset.
+
+    @note The @p expr is expected to be a valid (ASCIIZ string)
+    pointer throughout the use of context @p p, as with
+    pubnub_set_auth(), it is not copied to the Pubnub context @p p.
+    Also, it takes up space in the HTTP buffer, so, if it is too
+    long, subscribe will fail with #PNR_TX_BUFF_TOO_SMALL. */
+void pubnub_set_filter_expr(pubnub_t *p, const char *expr);
+
 /** Cancel an ongoing API transaction. The outcome of the transaction
-    in progress will be #PNR_CANCELLED. */
+    in progress will be #PNR_CANCELLED. Also ends a continuous
+    subscribe (see pubnub_subscribe_continuous()). */
 void pubnub_cancel(pubnub_t *p);
 
 /** Publish the @p message (in JSON format) on @p p channel, using the
@@ -221,9 +390,424 @@ void pubnub_cancel(pubnub_t *p);
  */
 enum pubnub_res pubnub_publish(pubnub_t *p, const char *channel, const char *message);
 
+/** Publish the @p message with the @p meta data, otherwise the same
+    as pubnub_publish(). The meta data is a JSON object that
+    subscribers' filter expressions (see pubnub_set_filter_expr())
+    are matched against, like @c {"region":"eu","temp":22}.
+
+    @param p The pubnub context. Can't be NULL
+    @param channel The string with the channel to publish to.
+    @param message The message to publish, expected to be in JSON format
+    @param meta The meta data, a JSON object. NULL for none.
+
+    @return #PNR_STARTED on success, an error otherwise
+ */
+enum pubnub_res pubnub_publish_meta(pubnub_t *p, const char *channel, const char *message, const char *meta);
+
+/** Options of a publish, see pubnub_publish_ex(). Get the defaults
+    with pubnub_publish_defopts() and change the ones you need, so
+    that your code works if more options are added.
+*/
+struct pubnub_publish_options {
+    /** If false, the message is not stored in the history of the
+        channel (on the server). Default: true. */
+    bool store;
+    /** If false, the message is not replicated to other PubNub data
+        centers, only its subscribers that are connected to the same
+        data center get it. Default: true. */
+    bool replicate;
+    /** For how long (in hours) is the message stored in the
+        history, 0 for the default of the publish key. Default: 0. */
+    unsigned ttl;
+    /** Meta data of the message, a JSON object that filter
+        expressions are matched against (see pubnub_publish_meta()),
+        NULL for none. Default: NULL. */
+    char const *meta;
+    /** If true, the publish is over (with #PNR_OK) as soon as the
+        request is sent, that is, ACKed by the server (TCP). The
+        response is not read, so you don't know if it was actually
+        published, but the context is free for the next transaction
+        much sooner, which is fine for, say, frequent sensor readings
+        where an odd lost one doesn't matter. Default: false. */
+    bool fire_and_forget;
+};
+
+/** Returns the default publish options, which is what
+    pubnub_publish() uses. */
+struct pubnub_publish_options pubnub_publish_defopts(void);
+
+/** Publish the @p message with the options @p opts, otherwise the
+    same as pubnub_publish().
+
+    @note The strings in @p opts (like the meta data) are not copied,
+    they have to be valid until the transaction is over. The @p opts
+    itself is copied, so it can be on the stack.
+
+    @param p The pubnub context. Can't be NULL
+    @param channel The string with the channel to publish to.
+    @param message The message to publish, expected to be in JSON format
+    @param opts The publish options. Can't be NULL
+
+    @return #PNR_STARTED on success, an error otherwise
+ */
+enum pubnub_res pubnub_publish_ex(pubnub_t *p, const char *channel, const char *message, struct pubnub_publish_options const *opts);
+
+/** Publish the same @p message on each of the @p n @p channels, using
+    the @p p context. The message is encoded only once and the
+    requests for all the channels are sent (pipelined) on a single
+    connection, so this is much cheaper than publishing to each
+    channel in turn.
+
+    The outcome is sent via #pubnub_publish_event, only once for all
+    the channels. It is #PNR_OK if publishing to all channels
+    succeeded. Use pubnub_last_publish_multi() to find out which ones
+    did.
+
+    @note The @p channels array (and strings) has to stay valid until
+    the outcome is reported, as it is not copied.
+
+    @param p The pubnub context. Can't be NULL
+    @param channels Array of channel names
+    @param n Number of channels in @p channels
+    @param message The message to publish, expected to be in JSON format
+
+    @pre (n > 0) && (n <= #PUBNUB_MULTI_MAX)
+    @return #PNR_STARTED on success, an error otherwise
+ */
+enum pubnub_res pubnub_publish_multi(pubnub_t *p, char const *const *channels, unsigned n, const char *message);
+
+/** Returns the bitmask of the channels of the last fan-out publish
+    (pubnub_publish_multi()) on the @p p context that were published
+    to successfully. Bit 0 (value 1) is for the first channel, etc.
+ */
+unsigned pubnub_last_publish_multi(pubnub_t const *p);
+
+/** Returns the time token of the last publish on the @p p context, as
+    given by the server in its response, that is, the time the message
+    was published (in 10ns units since the Epoch). Comparing it to
+    the time you started the publish lets you estimate the latency,
+    and, unlike your clock, it orders the messages as the subscribers
+    will get them. Empty string if the last publish didn't get a
+    valid response, which is always the case for fire and forget
+    publishes (see pubnub_publish_ex()). For a fan-out publish, it is
+    the time token of the publish on the last channel.
+ */
+char const *pubnub_last_publish_timetoken(pubnub_t const *p);
+
+/** Returns the description of the outcome of the last publish on the
+    @p p context, as given by the server in its response: @c "Sent"
+    on success, otherwise it describes the error, which you will want
+    to check if the outcome was #PNR_PUBLISH_FAILED. Empty string if
+    there was no valid response. Valid until the next transaction on
+    the context is started.
+ */
+char const *pubnub_last_publish_result(pubnub_t const *p);
+
+/** Set stamping of published messages with sequence numbers on the
+    @p p context. If on, pubnub_publish(), pubnub_publish_meta() and
+    pubnub_publish_ex() wrap the message in a JSON object with the
+    sequence number of the message and the UUID of the context (see
+    pubnub_set_uuid()), like: `{"q":5,"u":"my-uuid","m":<message>}`.
+    Sequence numbers start from 0 on pubnub_init() and go up by one
+    for every publish started. Retries send the same number.
+
+    Subscribers that turn on sequence tracking (see
+    pubnub_set_seq_tracking()) get the original message, and detect
+    messages that were lost, duplicated or reordered on the way. Of
+    course, the UUIDs of the publishers should be unique.
+
+    @param p The pubnub context. Can't be NULL
+    @param stamp true to turn on stamping, false (default) to turn
+    it off
+ */
+void pubnub_set_seq_stamp(pubnub_t *p, bool stamp);
+
+/** Start building a message to publish on the @p channel, using the
+    @p p context. Instead of formatting the message (JSON) into a
+    buffer of your own for pubnub_publish() to encode into the HTTP
+    request, write it with the pubnub_msg_ functions, which encode it
+    straight into the request, then publish it with
+    pubnub_publish_end(). For example, to publish
+    `{"t":21.50,"id":"k1"}`:
+
+        pubnub_publish_begin(pbp, "temp");
+        pubnub_msg_begin_object(pbp);
+        pubnub_msg_key(pbp, "t");
+        pubnub_msg_fixed(pbp, 2150, 2);
+        pubnub_msg_key(pbp, "id");
+        pubnub_msg_string(pbp, "k1");
+        pubnub_msg_end(pbp);
+        pubnub_publish_end(pbp, &opts);
+
+    The pubnub_msg_ functions don't report errors (like, the message
+    doesn't fit in the buffer, or a value in an object is written
+    without a key), but keep the first one, for pubnub_publish_end()
+    to report it. Until then the context is busy, so you can't start
+    other transactions on it, but you can pubnub_cancel() building.
+
+    @note As the message is not kept anywhere but in the request, a
+    publish of a message built this way is not retried on failure
+    (see pubnub_set_retry()).
+
+    @param p The pubnub context. Can't be NULL
+    @param channel The string with the channel to publish to. Not
+    copied, has to be valid until the publish is over.
+
+    @return #PNR_OK on success, an error otherwise
+ */
+enum pubnub_res pubnub_publish_begin(pubnub_t *p, const char *channel);
+
+/** Write the start of a JSON object to the message being built on the
+    @p p context (see pubnub_publish_begin()). Write its members with
+    pubnub_msg_key() followed by the value, then pubnub_msg_end().
+ */
+void pubnub_msg_begin_object(pubnub_t *p);
+
+/** Write the start of a JSON array to the message being built on the
+    @p p context. Write its elements, then pubnub_msg_end().
+ */
+void pubnub_msg_begin_array(pubnub_t *p);
+
+/** Write the end of the innermost open JSON object or array to the
+    message being built on the @p p context.
+ */
+void pubnub_msg_end(pubnub_t *p);
+
+/** Write the @p key of the next member of the object (being written)
+    to the message being built on the @p p context. It is escaped as
+    needed.
+ */
+void pubnub_msg_key(pubnub_t *p, char const *key);
+
+/** Write the integer @p n to the message being built on the @p p
+    context.
+ */
+void pubnub_msg_int(pubnub_t *p, long n);
+
+/** Write the fixed-point number @p n with @p decimals decimal digits
+    to the message being built on the @p p context, that is, the
+    number written is @p n divided by 10 to the power of @p
+    decimals. For example, 2150 with 2 decimals is written as
+    `21.50`. There is no floating point involved.
+
+    @pre decimals <= 9
+ */
+void pubnub_msg_fixed(pubnub_t *p, long n, unsigned char decimals);
+
+/** Write the string @p s to the message being built on the @p p
+    context. It is escaped as needed.
+ */
+void pubnub_msg_string(pubnub_t *p, char const *s);
+
+/** Encodings of binary data in a JSON string */
+enum pubnub_binary_enc {
+    /** Base64 with the URL and file name safe alphabet (RFC 4648),
+        with padding: 4 characters for every 3 bytes. All the
+        characters go into the publish request as they are. */
+    PNBE_BASE64,
+    /** Base85 with the Z85 alphabet (ZeroMQ RFC 32), which doesn't
+        need JSON escaping: 5 characters for every 4 bytes. A last
+        group of fewer than 4 bytes gives one character more than
+        there are bytes, like Ascii85. About a seventh of the
+        characters are percent-encoded in the publish request, so it
+        is shorter than #PNBE_BASE64 when stored and delivered to
+        subscribers, but longer on the way to the server. */
+    PNBE_BASE85
+};
+
+/** Write the @p len bytes of binary @p data to the message being
+    built on the @p p context, as a JSON string with the encoding @p
+    enc. The data is encoded straight into the request, a few bytes at
+    a time. Subscribers can decode it in place with
+    pubnub_json_base64_decode() or pubnub_json_base85_decode().
+ */
+void pubnub_msg_binary(pubnub_t *p, void const *data, size_t len, enum pubnub_binary_enc enc);
+
+/** Publish the @p len bytes of binary @p data on the @p channel, using
+    the @p p context, as a JSON string with the encoding @p enc (see
+    pubnub_msg_binary()), with the default options. Like a message
+    built with pubnub_publish_begin(), it is not retried on failure,
+    but @p data doesn't have to be kept until the publish is over.
+
+    @return #PNR_STARTED on success, an error otherwise
+ */
+enum pubnub_res pubnub_publish_binary(pubnub_t *p, const char *channel, void const *data, size_t len, enum pubnub_binary_enc enc);
+
+/** Write @p json as is to the message being built on the @p p
+    context, for values that don't have a pubnub_msg_ function (like
+    `true` or `null`), or that you already have in JSON. It has to be
+    a single valid JSON value.
+ */
+void pubnub_msg_raw(pubnub_t *p, char const *json);
+
+/** Publish the message built on the @p p context (see
+    pubnub_publish_begin()) with the options @p opts. The outcome is
+    reported the same as for pubnub_publish().
+
+    @param p The pubnub context. Can't be NULL
+    @param opts The publish options. Can't be NULL
+
+    @return #PNR_STARTED on success, #PNR_TX_BUFF_TOO_SMALL if the
+    message (with the options) didn't fit in the buffer,
+    #PNR_FORMAT_ERROR if it is not valid JSON (for example, an
+    object was left open), #PNR_IN_PROGRESS if no message is being
+    built. In case of error, the message is discarded.
+ */
+enum pubnub_res pubnub_publish_end(pubnub_t *p, struct pubnub_publish_options const *opts);
+
+/** Put a publish request @p req in the outbound queue of the @p p
+    context. If the context is idle, the publish starts right away,
+    otherwise it waits for the ongoing transaction (and all queued
+    requests with the same or higher @p priority) to finish.
+
+    If @p lifetime (in clock ticks) is not 0 and it passes before
+    the request gets to the head of the queue, the request is dropped
+    without sending anything, with the outcome #PNR_EXPIRED.
+
+    The outcome of every request is sent via #pubnub_publish_event,
+    but, unlike for pubnub_publish(), the event carries the request
+    pointer @p req, not the context. As the queue moves on without
+    waiting for you to handle the event, read the outcome from @p
+    req->result, rather than pubnub_last_result().
+
+    @note The queue moves on only when the context is idle and there
+    are no unread messages in it (read them with pubnub_get()). It
+    doesn't keep you from starting other transactions on the context
+    (like pubnub_subscribe()) while requests are queued, they just
+    wait for those to finish. So, it is best used on a context you
+    use mostly for publishing.
+
+    @param p The pubnub context. Can't be NULL
+    @param req The request to queue. Can't be NULL
+    @param channel The string with the channel (or comma-delimited list
+    of channels) to publish to.
+    @param message The message to publish, expected to be in JSON format
+    @param priority Priority of the request, higher is more urgent
+    @param lifetime Clock ticks from now to the deadline, 0: none
+
+    @return #PNR_STARTED on success (publish started or queued), an
+    error otherwise
+ */
+enum pubnub_res pubnub_publish_queued(pubnub_t *p, struct pubnub_pubreq *req, const char *channel, const char *message, unsigned char priority, clock_time_t lifetime);
+
+/** State of the publish rate limiter of a context, as returned by
+    pubnub_get_rate_stats().
+ */
+struct pubnub_rate_stats {
+    /** Number of tokens in the bucket, that is, how many publishes
+        may start right away */
+    unsigned tokens;
+    /** Number of publishes rejected with #PNR_RATE_LIMITED */
+    unsigned rejected;
+    /** Number of times a queued publish had to wait for a token */
+    unsigned delayed;
+};
+
+/** Set the publish rate limiter of the @p p context. It is a "token
+    bucket": a token is added every @p period clock ticks, up to @p
+    burst tokens, and each publish takes a token (a fan-out publish
+    takes one for each channel). Starts with a full bucket.
+
+    Publishes that find no token are rejected with #PNR_RATE_LIMITED,
+    except queued ones (see pubnub_publish_queued()), which wait for
+    the next token.
+
+    @param p The pubnub context. Can't be NULL
+    @param period Clock ticks per token, 0 to turn the rate limiter
+    off (which is the default)
+    @param burst Maximum number of tokens in the bucket
+ */
+void pubnub_set_rate_limit(pubnub_t *p, clock_time_t period, unsigned char burst);
+
+/** Get the state of the publish rate limiter of the @p p context
+    into @p stats. The counters are reset by pubnub_set_rate_limit().
+ */
+void pubnub_get_rate_stats(pubnub_t *p, struct pubnub_rate_stats *stats);
+
+/** Set coalescing of queued publishes on the @p p context. If on,
+    messages queued with pubnub_publish_queued() for the same channel
+    are packed into a single JSON array message (in their order of
+    queueing) and published with one transaction, which saves a lot
+    of overhead if messages are small. Messages are packed for as
+    long as their total length doesn't exceed @p max_len and their
+    URL-encoded form fits in #PUBNUB_BUF_MAXLEN.
+
+    Every message is packed, even if it ends up alone in the array,
+    so that subscribers can use pubnub_set_unpack() to get them.
+
+    On an idle context, the first queued message waits for @p window
+    clock ticks for more messages to come, unless messages queued for
+    its channel reach @p max_len in total, in which case the publish
+    starts right away.
+
+    @param p The pubnub context. Can't be NULL
+    @param window Clock ticks to wait for more messages
+    @param max_len Maximum total length of messages to pack in one
+    publish, 0 to turn coalescing off (which is the default)
+ */
+void pubnub_set_coalesce(pubnub_t *p, clock_time_t window, unsigned max_len);
+
+#if PUBNUB_SPOOL_SEGMENT > 0
+/** Statistics of the publish spool of a context, as returned by
+    pubnub_get_spool_stats(). All are in bytes of spooled messages
+    (see #PUBNUB_SPOOL_SEGMENT), counted since pubnub_init().
+ */
+struct pubnub_spool_stats {
+    /** Spooled by pubnub_spool() */
+    unsigned long queued;
+    /** Published from the spool */
+    unsigned long drained;
+    /** Dropped: to make room for new messages when the spool was
+        full, or because the server rejected them */
+    unsigned long dropped;
+    /** In the spool, waiting to be published */
+    unsigned long pending;
+};
+
+/** Spool the publish of the @p message on the @p channel on the @p p
+    context. The message (and channel) is copied to the end of the
+    spool, a log kept in flash, and published from there (in order)
+    when the context is idle and the queue of pubnub_publish_queued()
+    is empty. So, unlike pubnub_publish(), this doesn't fail if the
+    network is down, and messages are not lost on a reboot, as
+    pubnub_init() picks up the spool where it was.
+
+    Spooled messages are published in the background, no
+    #pubnub_publish_event is sent for them. If coalescing is on (see
+    pubnub_set_coalesce()), consecutive messages for the same channel
+    are packed and published together. If a publish fails because of
+    communication problems (with retries, see pubnub_set_retry()), the
+    spool waits until another transaction on the context succeeds, or
+    another message is spooled. Messages the server rejects are
+    dropped.
+
+    If the spool is full, the oldest segment (see
+    #PUBNUB_SPOOL_SEGMENTS) is dropped to make room.
+
+    @note A message is taken off the spool only after its publish
+    succeeded, so a message may be published twice, if the device is
+    reset (or the response lost) after the server got it.
+
+    @param p The pubnub context. Can't be NULL
+    @param channel The channel to publish to
+    @param message The message to publish, expected to be in JSON format
+
+    @return #PNR_OK: spooled, #PNR_TX_BUFF_TOO_SMALL: message too
+    long for the spool (or the HTTP buffer), #PNR_IO_ERROR: writing
+    to the flash failed
+ */
+enum pubnub_res pubnub_spool(pubnub_t *p, const char *channel, const char *message);
+
+/** Get the statistics of the publish spool of the @p p context into
+    @p stats.
+ */
+void pubnub_get_spool_stats(pubnub_t *p, struct pubnub_spool_stats *stats);
+#endif
+
 /** The ID of the Pubnub Publish event. Event carries the context pointer
     on which the publish transaction finished. Use pubnub_last_result()
-    to read the outcome of the transaction.
+    to read the outcome of the transaction. For a request queued with
+    pubnub_publish_queued(), it carries the request pointer instead.
  */
 extern process_event_t pubnub_publish_event;
 
@@ -243,6 +827,98 @@ extern process_event_t pubnub_publish_event;
  */
 char const* pubnub_get(pubnub_t *p);
 
+/** Set unpacking of received messages on the @p p context. If on,
+    pubnub_get() doesn't return messages that are JSON arrays, but
+    each of their elements, as individual messages. Use this to
+    receive messages published by contexts with coalescing on (see
+    pubnub_set_coalesce()). Of course, all the messages on the
+    channel(s) should be published like that.
+
+    If you read the channels of unpacked messages, call
+    pubnub_get_channel() after each pubnub_get(), as it returns the
+    same channel for all elements of the same array.
+
+    @param p The Pubnub context. Can't be NULL.
+    @param unpack true to turn on unpacking, false (default) to turn
+    it off
+ */
+void pubnub_set_unpack(pubnub_t *p, bool unpack);
+
+#if PUBNUB_DEDUP_SIZE > 0
+/** Returns the number of received messages the @p p context dropped
+    as duplicates (see #PUBNUB_DEDUP_SIZE) since pubnub_init().
+ */
+unsigned pubnub_dedup_count(pubnub_t const *p);
+#endif
+
+#if PUBNUB_SEQ_SOURCES > 0
+/** Anomalies detected by sequence tracking */
+enum pubnub_seq_event {
+    /** Sequence number skipped ahead, messages in between were lost
+        (or will arrive late) */
+    PNSE_GAP,
+    /** The same sequence number as the last one */
+    PNSE_DUPLICATE,
+    /** Sequence number before the last one, a message arrived late
+        (or is an older duplicate) */
+    PNSE_REORDER
+};
+
+/** Callback of sequence tracking, see pubnub_set_seq_tracking().
+    Called when a message with an unexpected sequence number is read.
+
+    @param p The Pubnub context that received the message
+    @param publisher The UUID of the publisher of the message
+    @param ev The anomaly detected
+    @param expected The sequence number expected
+    @param got The sequence number of the message
+    @param user_data The pointer passed to pubnub_set_seq_tracking()
+ */
+typedef void (*pubnub_seq_cb)(pubnub_t *p, char const *publisher, enum pubnub_seq_event ev, unsigned long expected, unsigned long got, void *user_data);
+
+/** Statistics of sequence tracking, as returned by
+    pubnub_get_seq_stats().
+ */
+struct pubnub_seq_stats {
+    /** Number of messages with sequence numbers read */
+    unsigned long received;
+    /** Number of sequence numbers skipped. A message that arrives
+        late is counted here, too. */
+    unsigned long lost;
+    /** Number of messages with the same sequence number as the last
+        one from their publisher */
+    unsigned duplicates;
+    /** Number of messages with a sequence number before the last one
+        from their publisher */
+    unsigned reordered;
+};
+
+/** Set sequence tracking on the @p p context. If on, received
+    messages stamped with sequence numbers (see pubnub_set_seq_stamp())
+    are unwrapped, so pubnub_get() (and the inbox, and callbacks) give
+    the original message. The last sequence number of each publisher
+    (up to #PUBNUB_SEQ_SOURCES of them) is tracked, and the anomalies
+    are counted and reported to the callback @p cb, if not NULL.
+
+    The first message from a publisher, and a message with sequence
+    number 0 (the publisher restarted), start the tracking of the
+    publisher over. Messages that are not stamped are given as they
+    are. Resets the statistics.
+
+    @param p The Pubnub context. Can't be NULL.
+    @param track true to turn on sequence tracking, false (default)
+    to turn it off
+    @param cb Callback to report anomalies to, NULL for none
+    @param user_data The pointer to pass to @p cb
+ */
+void pubnub_set_seq_tracking(pubnub_t *p, bool track, pubnub_seq_cb cb, void *user_data);
+
+/** Get the statistics of sequence tracking of the @p p context into
+    @p stats.
+ */
+void pubnub_get_seq_stats(pubnub_t *p, struct pubnub_seq_stats *stats);
+#endif
+
 /** Returns a pointer to an fetched transaction's next channel.  Each
     transaction may hold a list of channels, and this functions
     provides a way to read them.  Subsequent call to this function
@@ -259,6 +935,91 @@ char const* pubnub_get(pubnub_t *p);
  */
 char const *pubnub_get_channel(pubnub_t *pb);
 
+/** Returns the subscription that matched the channel of the message
+    last read by pubnub_get() (the channel read by
+    pubnub_get_channel()). If you subscribed to a wildcard channel
+    (like @c "devices.*"), this is the wildcard pattern, while
+    pubnub_get_channel() gives the actual channel the message was
+    published on (like @c "devices.lamp"). For messages received via
+    a channel group, it is the channel group.
+
+    If the reply carried no subscriptions (which is the case when you
+    subscribe only to plain channels), returns NULL.
+
+    @param pb The Pubnub context. Can't be NULL.
+
+    @return Pointer to the subscription, NULL if there is none
+    @see pubnub_get_channel
+    @see pubnub_set_channel_group
+ */
+char const *pubnub_get_subscription(pubnub_t *pb);
+
+#if PUBNUB_INBOX_SIZE > 0
+/** A message from the inbox, see pubnub_inbox_peek() */
+struct pubnub_inbox_msg {
+    /** The channel of the message. Empty if the subscribe reply had
+        no channel list, which is the case if you subscribe to only
+        one channel */
+    char const *channel;
+    /** The message */
+    char const *message;
+    /** Time token of the subscribe reply the message came in */
+    char const *timetoken;
+};
+
+/** What to do with a received message that doesn't fit in the
+    inbox, see pubnub_set_inbox_policy() */
+enum pubnub_inbox_policy {
+    /** Drop the oldest message(s) from the inbox to make room */
+    PNIP_DROP_OLDEST,
+    /** Drop the received message */
+    PNIP_DROP_NEWEST
+};
+
+/** Counters of the inbox of a context, as returned by
+    pubnub_get_inbox_stats().
+ */
+struct pubnub_inbox_stats {
+    /** Number of messages in the inbox */
+    unsigned count;
+    /** Number of messages put in the inbox */
+    unsigned received;
+    /** Number of messages dropped because the inbox was full */
+    unsigned dropped;
+};
+
+/** Get the oldest message from the inbox of the @p p context into
+    @p msg, leaving it in the inbox. Messages from subscribe replies
+    are put in the inbox (of #PUBNUB_INBOX_SIZE bytes) as they arrive,
+    so you can subscribe again before you read them.
+
+    The strings in @p msg are valid until you pop the message with
+    pubnub_inbox_pop(), or your process yields (as a subscribe reply
+    may then drop it, see pubnub_set_inbox_policy()).
+
+    @param p The Pubnub context. Can't be NULL.
+    @param msg Where to put the message
+    @return true if there is a message, false if the inbox is empty
+ */
+bool pubnub_inbox_peek(pubnub_t *p, struct pubnub_inbox_msg *msg);
+
+/** Remove the oldest message from the inbox of the @p p context.
+
+    @param p The Pubnub context. Can't be NULL.
+    @return true if a message was removed, false if the inbox is empty
+ */
+bool pubnub_inbox_pop(pubnub_t *p);
+
+/** Set what happens with received messages when the inbox of the @p
+    p context is full. Default is #PNIP_DROP_OLDEST. Also resets the
+    counters of the inbox.
+ */
+void pubnub_set_inbox_policy(pubnub_t *p, enum pubnub_inbox_policy policy);
+
+/** Get the counters of the inbox of the @p p context into @p stats. */
+void pubnub_get_inbox_stats(pubnub_t *p, struct pubnub_inbox_stats *stats);
+#endif
+
 /** Subscribe to @p channel. This actually means "initiate a subscribe
     transaction". The outcome is sent to the process that starts the
     transaction via process event #pubnub_publish_event, which is a
@@ -275,7 +1036,11 @@ char const *pubnub_get_channel(pubnub_t *pb);
     You can't subscribe if a transaction is in progress on the context.
 
     Also, you can't subscribe if there are unread messages in the
-    context (you read messages with pubnub_get()).
+    context (you read messages with pubnub_get()). With two reply
+    buffers (see #PUBNUB_REPLY_BUFFERS), you can, as long as the reply
+    of the last subscribe is not also waiting to be read, that is, you
+    can't subscribe only if there are unread messages from two
+    subscribes.
 
     @note Some of the subscribed messages may be lost when calling
     publish() after a subscribe() on the same context or subscribe()
@@ -286,7 +1051,11 @@ char const *pubnub_get_channel(pubnub_t *pb);
 
     @param p The pubnub context. Can't be NULL
     @param channel The string with the channel name (or comma-delimited list
-    of channel names) to subscribe to.
+    of channel names) to subscribe to. Can be a wildcard channel,
+    like @c "devices.*", see pubnub_get_subscription(). NULL to
+    subscribe to the channel set of the context (see
+    pubnub_add_channel()), or, if it is empty, only to the channel
+    group of the context (see pubnub_set_channel_group()).
 
     @return #PNR_STARTED on success, an error otherwise
     
@@ -294,12 +1063,108 @@ char const *pubnub_get_channel(pubnub_t *pb);
  */
 enum pubnub_res pubnub_subscribe(pubnub_t *p, const char *channel);
 
+#if PUBNUB_CHANNEL_SET_MAXLEN > 0
+/** Add @p channel to the channel set of the @p p context. The
+    channel set is used by subscribes to NULL channel, so the change
+    takes effect with the next subscribe (which, for a continuous
+    subscribe, is the next long-poll). Unlike subscribing to a
+    changed channel list, this doesn't need a leave, so no messages
+    on the channels in the set are lost.
+
+    The channel name is copied to the set, which holds up to
+    #PUBNUB_CHANNEL_SET_MAXLEN characters. Adding a channel that is
+    already in the set does nothing.
+
+    @param p The Pubnub context. Can't be NULL.
+    @param channel The channel name (just one)
+    @return #PNR_OK on success, #PNR_TX_BUFF_TOO_SMALL if the set is
+    full
+ */
+enum pubnub_res pubnub_add_channel(pubnub_t *p, char const *channel);
+
+/** Remove @p channel from the channel set of the @p p context. The
+    next subscribe to the channel set leaves the removed channels,
+    sending the leave before it on the same connection, without
+    losing messages on the other channels. The leave is sent only
+    once, its outcome is ignored.
+
+    @param p The Pubnub context. Can't be NULL.
+    @param channel The channel name (just one)
+    @return true if the channel was removed, false if it wasn't in the
+    set
+ */
+bool pubnub_remove_channel(pubnub_t *p, char const *channel);
+#endif
+
 /** The ID of the Pubnub Subscribe event. Event carries the context
     pointer on which the subscribe transaction finished. Use
     pubnub_last_result() to read the outcome of the transaction.
  */
 extern process_event_t pubnub_subscribe_event;
 
+/** Callback of a continuous subscribe, see
+    pubnub_subscribe_continuous(). Called for each received @p
+    message, with the @p channel it was published on.
+
+    @param p The Pubnub context that received the message
+    @param channel The channel of the message
+    @param message The message, valid only during the call
+    @param user_data The pointer passed to pubnub_subscribe_continuous()
+ */
+typedef void (*pubnub_subscribe_cb)(pubnub_t *p, char const *channel, char const *message, void *user_data);
+
+/** Subscribe to @p channel continuously. Like pubnub_subscribe(),
+    but, when the subscribe transaction succeeds, the received
+    messages are passed to @p cb (from the Pubnub process) and the
+    next subscribe transaction is started right away, with the new
+    time token, so there is (almost) always a long-poll outstanding.
+
+    No event is sent while this goes on. It ends when a subscribe
+    transaction fails (with retries exhausted, see
+    pubnub_set_retry()) or when you call pubnub_cancel() (which you
+    may also do from @p cb), and then #pubnub_subscribe_event is sent
+    to the process that started it, as usual.
+
+    @note As the context is always busy, it can't be used for any
+    other transaction (like publish) until the continuous subscribe
+    ends. Don't start transactions on the context from @p cb.
+
+    @param p The pubnub context. Can't be NULL
+    @param channel The string with the channel name (or comma-delimited
+    list of channel names) to subscribe to. Has to stay valid until
+    the continuous subscribe ends.
+    @param cb The callback to pass the messages to. Can't be NULL
+    @param user_data Pointer to pass to @p cb
+
+    @return #PNR_STARTED on success, an error otherwise
+ */
+enum pubnub_res pubnub_subscribe_continuous(pubnub_t *p, const char *channel, pubnub_subscribe_cb cb, void *user_data);
+
+#if PUBNUB_DEMUX_SIZE > 0
+/** Set the handler of messages from @p channel on the @p p
+    context. When a subscribe succeeds, each message from a channel
+    that has a handler is passed to it, instead of being left to read
+    with pubnub_get(). Channels are looked up in a hash table (of
+    #PUBNUB_DEMUX_SIZE entries), so this is cheap even with many
+    channels.
+
+    If there is at least one handler, messages from channels without
+    a handler go to the default handler, set with NULL @p channel, or
+    to the callback of pubnub_subscribe_continuous(), or are dropped.
+
+    @note The @p channel string is not copied, it has to stay valid
+    for as long as it has a handler.
+
+    @param p The Pubnub context. Can't be NULL.
+    @param channel The channel name, NULL for the default handler
+    @param cb The handler, NULL to remove the handler of @p channel
+    @param user_data Pointer to pass to @p cb
+
+    @return true on success, false if the table is full
+ */
+bool pubnub_set_handler(pubnub_t *p, char const *channel, pubnub_subscribe_cb cb, void *user_data);
+#endif
+
 /** Leave the @p channel. This actually means "initiate a leave
     transaction".  You should leave a channel when you want to
     subscribe to another in the same context to avoid loosing
@@ -325,6 +1190,229 @@ enum pubnub_res pubnub_leave(pubnub_t *p, const char *channel);
  */
 extern process_event_t pubnub_leave_event;
 
+/** Add the @p channels to the channel @p group, on the PubNub
+    server. Channel group is created if it doesn't exist. When the
+    transaction is over, #pubnub_channel_group_event is posted.
+
+    You can't start this transaction if another is in progress on the
+    context.
+
+    @note The @p channels and @p group strings are not copied, they
+    have to be valid until the transaction is over.
+
+    @param p The Pubnub context. Can't be NULL.
+    @param channels The string with the channel name (or
+    comma-delimited list of channel names) to add.
+    @param group The name of the channel group
+
+    @return #PNR_STARTED on success, an error otherwise
+    @see pubnub_set_channel_group
+*/
+enum pubnub_res pubnub_add_channels_to_group(pubnub_t *p, const char *channels, const char *group);
+
+/** Remove the @p channels from the channel @p group, on the PubNub
+    server. Otherwise, the same as pubnub_add_channels_to_group().
+*/
+enum pubnub_res pubnub_remove_channels_from_group(pubnub_t *p, const char *channels, const char *group);
+
+/** The ID of the Pubnub Channel group event. Event carries the
+    context pointer on which the transaction of adding channels to or
+    removing channels from a channel group finished. Use
+    pubnub_last_result() to read the outcome of the transaction.
+ */
+extern process_event_t pubnub_channel_group_event;
+
+/** Get the current time (time token) of the PubNub server, using the
+    @p p context. When the transaction is over, #pubnub_time_event is
+    posted, then read the time with pubnub_get_time().
+
+    This is a short request, so it is a cheap way to start
+    subscribing: set the time token you got with
+    pubnub_set_timetoken() and your first subscribe will get the
+    messages published from then on, rather than just the time token
+    itself (which is what a subscribe with no time token gets).
+
+    You can't start this transaction if another is in progress on the
+    context.
+
+    @param p The Pubnub context. Can't be NULL.
+
+    @return #PNR_STARTED on success, an error otherwise
+*/
+enum pubnub_res pubnub_time(pubnub_t *p);
+
+/** Returns the server time got by the last successful pubnub_time()
+    on the @p p context, a time token (in 10ns units since the
+    Epoch), or NULL if there is none.
+
+    If @p at is not NULL, it gets the local time (clock_time()) at
+    which the server time is estimated to have been taken: half way
+    through the round trip of the request. Use it to find the offset
+    between the local clock and the server.
+
+    @param p The Pubnub context. Can't be NULL.
+    @param at Where to put the local time of the server time, can be
+    NULL.
+*/
+char const *pubnub_get_time(pubnub_t const *p, clock_time_t *at);
+
+/** Sets the time token for the next subscribe on the @p p context to
+    @p tt, typically gotten by pubnub_get_time(). The string is copied.
+
+    @param p The Pubnub context. Can't be NULL.
+    @param tt The time token (a string of decimal digits)
+
+    @return #PNR_OK on success, #PNR_IN_PROGRESS if a transaction is in
+    progress, #PNR_FORMAT_ERROR if @p tt is not a valid time token
+*/
+enum pubnub_res pubnub_set_timetoken(pubnub_t *p, char const *tt);
+
+/** Returns the time token that the next subscribe on the @p p
+    context will use, that is, the one got by the last subscribe.
+    @c "0" if there is none, as it is reset on errors, so if you want
+    to get the messages you missed (see pubnub_history()), copy it
+    after each successful subscribe.
+*/
+char const *pubnub_last_time_token(pubnub_t const *p);
+
+/** The ID of the Pubnub Time event. Event carries the context pointer
+    on which the time transaction finished. Use pubnub_last_result()
+    to read the outcome of the transaction.
+ */
+extern process_event_t pubnub_time_event;
+
+/** Options of a history fetch, see pubnub_history(). Get the
+    defaults with pubnub_history_defopts() and change the ones you
+    need.
+*/
+struct pubnub_history_options {
+    /** Maximum number of messages to get, at most 100. Pick it so
+        that the reply fits in #PUBNUB_REPLY_MAXLEN, otherwise the
+        fetch fails. Default: 100. */
+    unsigned count;
+    /** Time token to start from (exclusive), NULL for the newest
+        (or, if reversed, the oldest) message. Default: NULL. */
+    char const *start;
+    /** Time token to end at (inclusive), NULL for no end. Default:
+        NULL. */
+    char const *end;
+    /** If false, gets the newest @p count messages (before @p
+        start), otherwise the oldest (after @p start). Either way,
+        the messages are in chronological order. Default: false. */
+    bool reverse;
+};
+
+/** Returns the default history options */
+struct pubnub_history_options pubnub_history_defopts(void);
+
+/** Get the messages from the history of the @p channel, using the @p
+    p context. When the transaction is over, #pubnub_history_event is
+    posted, then read the messages with pubnub_get(), just like the
+    ones you get by subscribing. So, you can't start this transaction
+    while there are unread messages in the context, and vice versa.
+
+    To get the messages that were published while you were offline,
+    set @p start of @p opts to the last time token you saw
+    (pubnub_last_time_token()) and set @p reverse. If there were
+    more than fit in one reply (page), get the next page by setting
+    @p start to the time token of the last message got, see
+    pubnub_history_range(). Without @p reverse, you page back in time,
+    setting @p start to the time token of the first message got.
+
+    @note The @p channel and the strings in @p opts are not copied,
+    they have to be valid until the transaction is over.
+
+    @param p The Pubnub context. Can't be NULL.
+    @param channel The channel to get the history of
+    @param opts The history options. Can't be NULL
+
+    @return #PNR_STARTED on success, an error otherwise
+*/
+enum pubnub_res pubnub_history(pubnub_t *p, const char *channel, struct pubnub_history_options const *opts);
+
+/** Gets the time tokens of the first and last message got by the
+    last successful pubnub_history() on the @p p context to @p start
+    and @p end, which can be NULL if you don't need them. They are set
+    to NULL if there was no successful history fetch. Use them to get
+    the next page. You can pass them to pubnub_history() directly, as
+    they don't change until the fetch succeeds.
+*/
+void pubnub_history_range(pubnub_t const *p, char const **start, char const **end);
+
+/** The ID of the Pubnub History event. Event carries the context
+    pointer on which the history transaction finished. Use
+    pubnub_last_result() to read the outcome of the transaction.
+ */
+extern process_event_t pubnub_history_event;
+
+/** Set the retry policy of the @p p context. Transactions that fail
+    because of communication problems (#PNR_IO_ERROR, #PNR_TIMEOUT or
+    #PNR_ABORTED) are retried (by the Pubnub process) until they
+    succeed or make @p max_attempts attempts, and only the outcome of
+    the last attempt is reported.
+
+    The delay before the first retry is @p base clock ticks, and it
+    is doubled for each next retry, up to @p cap ticks. Then, up to
+    @p jitter percent of the delay is randomly taken off, so that many
+    devices that failed at the same time don't retry at the same time.
+
+    @note While retrying is on, the channel and message strings you
+    pass to a transaction have to stay valid until its outcome is
+    reported, as they are not copied.
+
+    @param p The Pubnub context. Can't be NULL.
+    @param max_attempts Maximum number of attempts of a transaction,
+    0 or 1 to turn retrying off (which is the default)
+    @param base Delay before the first retry, in clock ticks
+    @param cap Maximum delay before a retry, in clock ticks
+    @param jitter Percentage (0 - 100) of the delay to randomize
+ */
+void pubnub_set_retry(pubnub_t *p, unsigned char max_attempts, clock_time_t base, clock_time_t cap, unsigned char jitter);
+
+/** Returns the number of attempts made by the last transaction in
+    the @p p context (1 if it wasn't retried). See pubnub_set_retry().
+ */
+unsigned pubnub_last_attempts(pubnub_t const *p);
+
+/** Set the catch-up policy of the @p p context. When a subscribe
+    fails, the time token is kept, so that the next subscribe gets
+    ("catches up on") the messages published in the meantime, but
+    only if there were at most @p max_errors failed subscribes in a
+    row, and the first one of them was less than @p max_age clock
+    ticks ago. Otherwise, the time token is reset, so the next
+    subscribe starts from "now", and the messages in between are
+    lost (but see pubnub_history()). This way, brief problems don't
+    lose messages, while long outages don't bring huge backlogs that
+    overflow the reply buffer.
+
+    The time token is always reset if the subscribe response was
+    invalid (#PNR_FORMAT_ERROR).
+
+    @param p The Pubnub context. Can't be NULL.
+    @param max_errors Maximum number of failed subscribes in a row to
+    catch up after, 0 to never catch up (which is the default)
+    @param max_age Maximum age (in clock ticks) of the first failed
+    subscribe to catch up after, 0 for no limit
+ */
+void pubnub_set_catchup(pubnub_t *p, unsigned char max_errors, clock_time_t max_age);
+
+/** Catch-up statistics of a context, as returned by
+    pubnub_get_catchup_stats().
+ */
+struct pubnub_catchup_stats {
+    /** Number of failed subscribes after which the time token was
+        kept, to catch up */
+    unsigned catchups;
+    /** Number of failed subscribes after which the time token was
+        reset */
+    unsigned resets;
+};
+
+/** Get the catch-up statistics of the @p p context into @p stats.
+    The counters are reset by pubnub_set_catchup().
+ */
+void pubnub_get_catchup_stats(pubnub_t *p, struct pubnub_catchup_stats *stats);
+
 /** Returns the result of the last transaction in the @p p context. */
 enum pubnub_res pubnub_last_result(pubnub_t const *p);
 
@@ -3,9 +3,14 @@
 #include "cgreen/mocks.h"
 
 #include "pubnub.h"
+#include "pubnub_json.h"
 
 #include "contiki-net.h"
+#if PUBNUB_PERSIST || (PUBNUB_SPOOL_SEGMENT > 0)
+#include "cfs/cfs.h"
+#endif
 
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <setjmp.h>
@@ -87,6 +92,30 @@ void process_start(struct process *p, const char *arg)
     mock(p, arg);
 }
 
+
+void process_poll(struct process *p)
+{
+    mock(p);
+}
+
+
+static struct ctimer *m_ctimer;
+static struct process *m_ctimer_process;
+
+void ctimer_set(struct ctimer *c, clock_time_t t, void (*f)(void *), void *ptr)
+{
+    c->f = f;
+    c->ptr = ptr;
+    m_ctimer = c;
+    m_ctimer_process = process_current;
+    mock(c, t);
+}
+
+void ctimer_stop(struct ctimer *c)
+{
+    mock(c);
+}
+
 static bool m_expect_assert;
 static jmp_buf m_assert_exp_jmpbuf;
 static char const *m_expect_assert_file;
@@ -148,6 +177,27 @@ int uiplib_ip4addrconv(const char *addrstr, uip_ip4addr_t *ipaddr)
 }
 
 
+static clock_time_t m_clock;
+
+clock_time_t clock_time(void) { return m_clock; }
+
+void timer_set(struct timer *t, clock_time_t interval)
+{
+    t->interval = interval;
+    t->start = clock_time();
+}
+
+int timer_expired(struct timer *t)
+{
+    clock_time_t diff = (clock_time() - t->start) + 1;
+    return t->interval < diff;
+}
+
+static unsigned short m_random;
+
+unsigned short random_rand(void) { return m_random; }
+
+
 /* These functions are also not (just) mocked, but not copied
    either. They're implemented differently, as per our needs.
 */
@@ -224,6 +274,102 @@ void psock_init(struct psock *psock, uint8_t *buffer, unsigned int buffersize)
 }
 
 
+#if PUBNUB_PERSIST || (PUBNUB_SPOOL_SEGMENT > 0)
+/* A CFS with a few files, in memory, one of them open at a time */
+static struct m_cfs_file {
+    char name[16];
+    char data[256];
+    unsigned len;
+} m_cfs[8];
+static struct m_cfs_file *m_cfs_file;
+static unsigned m_cfs_pos;
+static unsigned m_cfs_writes;
+
+static void m_cfs_format(void)
+{
+    memset(m_cfs, 0, sizeof m_cfs);
+    m_cfs_writes = 0;
+}
+
+static struct m_cfs_file *m_cfs_find(const char *name)
+{
+    unsigned i;
+    for (i = 0; i < sizeof m_cfs / sizeof m_cfs[0]; ++i) {
+        if (0 == strcmp(m_cfs[i].name, name)) {
+            return m_cfs + i;
+        }
+    }
+    return NULL;
+}
+
+int cfs_open(const char *name, int flags)
+{
+    m_cfs_file = m_cfs_find(name);
+    if (flags & CFS_WRITE) {
+        if (NULL == m_cfs_file) {
+            m_cfs_file = m_cfs_find("");
+            attest(m_cfs_file, differs(NULL));
+            strcpy(m_cfs_file->name, name);
+        }
+        if (!(flags & CFS_APPEND)) {
+            m_cfs_file->len = 0;
+        }
+        ++m_cfs_writes;
+    }
+    else if (NULL == m_cfs_file) {
+        return -1;
+    }
+    m_cfs_pos = 0;
+    return 1;
+}
+
+void cfs_close(int fd)
+{
+    m_cfs_file = NULL;
+}
+
+int cfs_read(int fd, void *buf, unsigned int len)
+{
+    if (len > m_cfs_file->len - m_cfs_pos) {
+        len = m_cfs_file->len - m_cfs_pos;
+    }
+    memcpy(buf, m_cfs_file->data + m_cfs_pos, len);
+    m_cfs_pos += len;
+    return len;
+}
+
+int cfs_write(int fd, const void *buf, unsigned int len)
+{
+    attest(m_cfs_file->len + len <= sizeof m_cfs_file->data);
+    memcpy(m_cfs_file->data + m_cfs_file->len, buf, len);
+    m_cfs_file->len += len;
+    return len;
+}
+
+cfs_offset_t cfs_seek(int fd, cfs_offset_t offset, int whence)
+{
+    if (CFS_SEEK_END == whence) {
+        offset += m_cfs_file->len;
+    }
+    if ((offset < 0) || (offset > m_cfs_file->len)) {
+        return -1;
+    }
+    m_cfs_pos = offset;
+    return offset;
+}
+
+int cfs_remove(const char *name)
+{
+    struct m_cfs_file *f = m_cfs_find(name);
+    if (NULL == f) {
+        return -1;
+    }
+    f->name[0] = '\0';
+    return 0;
+}
+#endif
+
+
 /* ---------- TESTS ---------- */
 
 
@@ -237,6 +383,97 @@ Ensure(can_get_context) {
 }
 
 
+Ensure(json_get_finds_values) {
+    char const json[] = " {\"a\": {\"x\":[1], \"b\": [true, \"],\\\"\" , {\"c\" : -12.345 } ] }, \"z\":null}";
+    char const *val;
+    size_t vlen;
+
+    attest(pubnub_json_get(json, sizeof json - 1, "a.b[2].c", &val, &vlen), equals(PNJ_OK));
+    attest(vlen, equals(7));
+    attest(strncmp(val, "-12.345", vlen), equals(0));
+    attest(pubnub_json_get(json, sizeof json - 1, "a.b[1]", &val, &vlen), equals(PNJ_OK));
+    attest(strncmp(val, "\"],\\\"\"", vlen), equals(0));
+    attest(pubnub_json_get(json, sizeof json - 1, "z", &val, &vlen), equals(PNJ_OK));
+    attest(strncmp(val, "null", vlen), equals(0));
+    attest(pubnub_json_get(json, sizeof json - 1, "", &val, &vlen), equals(PNJ_OK));
+    attest(vlen, equals(sizeof json - 2));
+
+    attest(pubnub_json_get(json, sizeof json - 1, "a.y", &val, &vlen), equals(PNJ_NOT_FOUND));
+    attest(pubnub_json_get(json, sizeof json - 1, "a.b[3]", &val, &vlen), equals(PNJ_NOT_FOUND));
+    attest(pubnub_json_get(json, sizeof json - 1, "a.x[0].c", &val, &vlen), equals(PNJ_NOT_FOUND));
+    attest(pubnub_json_get(json, sizeof json - 1, "a.b[x]", &val, &vlen), equals(PNJ_FORMAT_ERROR));
+    attest(pubnub_json_get(json, sizeof json - 1, "a..b", &val, &vlen), equals(PNJ_FORMAT_ERROR));
+    attest(pubnub_json_get(json, 20, "z", &val, &vlen), equals(PNJ_FORMAT_ERROR));
+}
+
+
+Ensure(json_converts_numbers) {
+    long n;
+
+    attest(pubnub_json_to_fixed("-12.345", 7, 2, &n), equals(PNJ_OK));
+    attest(n, equals(-1235));
+    attest(pubnub_json_to_fixed("21.3749", 7, 2, &n), equals(PNJ_OK));
+    attest(n, equals(2137));
+    attest(pubnub_json_to_fixed("-4", 2, 2, &n), equals(PNJ_OK));
+    attest(n, equals(-400));
+    attest(pubnub_json_to_fixed("1e3", 3, 2, &n), equals(PNJ_TYPE_ERROR));
+    attest(pubnub_json_to_fixed("1.", 2, 2, &n), equals(PNJ_TYPE_ERROR));
+    attest(pubnub_json_to_fixed("\"1\"", 3, 2, &n), equals(PNJ_TYPE_ERROR));
+
+    attest(pubnub_json_to_long("-2048", 5, &n), equals(PNJ_OK));
+    attest(n, equals(-2048));
+    attest(pubnub_json_to_long("1.0", 3, &n), equals(PNJ_TYPE_ERROR));
+    attest(pubnub_json_to_long("99999999999999999999", 20, &n), equals(PNJ_TYPE_ERROR));
+}
+
+
+Ensure(json_unescapes_strings) {
+    char s[] = "\"A\\u00e9\\n\\ud83d\\ude00\\\"\"";
+    size_t len;
+
+    attest(pubnub_json_unescape(s, sizeof s - 1, &len), equals(PNJ_OK));
+    attest(len, equals(9));
+    attest(s, streqs("A\xc3\xa9\n\xf0\x9f\x98\x80\""));
+
+    strcpy(s, "\"\\x\"");
+    attest(pubnub_json_unescape(s, strlen(s), &len), equals(PNJ_TYPE_ERROR));
+    attest(pubnub_json_unescape(s, 1, &len), equals(PNJ_TYPE_ERROR));
+}
+
+
+static unsigned char const m_binary[] = { 0x86, 0x4F, 0xD2, 0x6F, 0xB5, 0x59, 0xF7, 0x5B, 0xFB, 0xFF, 0x00 };
+
+
+Ensure(json_decodes_binary) {
+    char b64[] = "\"hk\\/Sb7VZ91v7/wA=\"";
+    char b64url[] = "\"hk_Sb7VZ91v7_wA\"";
+    char z85[] = "\"HelloWorld}#lS\"";
+    char bad[] = "\"#####\"";
+    size_t len;
+
+    attest(pubnub_json_base64_decode(b64, sizeof b64 - 1, &len), equals(PNJ_OK));
+    attest(len, equals(sizeof m_binary));
+    attest(memcmp(b64, m_binary, len), equals(0));
+    attest(pubnub_json_base64_decode(b64url, sizeof b64url - 1, &len), equals(PNJ_OK));
+    attest(len, equals(sizeof m_binary));
+    attest(memcmp(b64url, m_binary, len), equals(0));
+    attest(pubnub_json_base85_decode(z85, sizeof z85 - 1, &len), equals(PNJ_OK));
+    attest(len, equals(sizeof m_binary));
+    attest(memcmp(z85, m_binary, len), equals(0));
+
+    attest(pubnub_json_base85_decode(bad, sizeof bad - 1, &len), equals(PNJ_TYPE_ERROR));
+    strcpy(bad, "\"H\"");
+    attest(pubnub_json_base85_decode(bad, strlen(bad), &len), equals(PNJ_TYPE_ERROR));
+    attest(pubnub_json_base64_decode(bad, strlen(bad), &len), equals(PNJ_TYPE_ERROR));
+    strcpy(bad, "\"Hel~\"");
+    attest(pubnub_json_base85_decode(bad, strlen(bad), &len), equals(PNJ_TYPE_ERROR));
+    attest(pubnub_json_base64_decode(bad, strlen(bad), &len), equals(PNJ_TYPE_ERROR));
+    strcpy(bad, "\"AA=A\"");
+    attest(pubnub_json_base64_decode(bad, strlen(bad), &len), equals(PNJ_TYPE_ERROR));
+    attest(pubnub_json_base64_decode(bad, 1, &len), equals(PNJ_TYPE_ERROR));
+}
+
+
 #define HTTP_PORT 80
 
 
@@ -320,9 +557,40 @@ void expect_cached_dns_for_pubnub_origin()
        when(data, equals(pbp))            \
     )
 
+#define expect_req_event(req_)                \
+    expect(process_post,                \
+       when(p, equals((req_)->initiator)),        \
+       when(ev, equals(pubnub_publish_event)),            \
+       when(data, equals(req_))            \
+    )
 
-inline void expect_outgoing_with_url(char const *url) {
-    expect(psock_init, when(buffersize, is_less_than(128)));
+/* Checks that the next received message is @p msg_ from @p chan_,
+   read with pubnub_get(), or from the inbox, if there is one. Tests
+   that need more of pubnub_get() (subscriptions, unread messages)
+   are left out if there is an inbox, as it gets no messages then. */
+#if PUBNUB_INBOX_SIZE > 0
+#define attest_got(msg_, chan_) do {                        \
+        struct pubnub_inbox_msg got_;                       \
+        if (pubnub_inbox_peek(pbp, &got_)) {                \
+            attest(got_.message, streqs(msg_));             \
+            attest(got_.channel, streqs(chan_));            \
+            pubnub_inbox_pop(pbp);                          \
+        }                                                   \
+        else {                                              \
+            attest(NULL, streqs(msg_));                     \
+        }                                                   \
+    } while (0)
+#define attest_got_none() attest(pubnub_inbox_pop(pbp), is_false)
+#else
+#define attest_got(msg_, chan_) do {                        \
+        attest(pubnub_get(pbp), streqs(msg_));              \
+        attest(pubnub_get_channel(pbp), streqs(chan_));     \
+    } while (0)
+#define attest_got_none() attest(pubnub_get(pbp), equals(NULL))
+#endif
+
+
+inline void expect_request_with_url(char const *url) {
     expect(psock_send, when(buf, streqs("GET ")), returns(PT_ENDED));
     expect(psock_send, when(buf, streqs(url)), returns(PT_ENDED));
     expect(psock_send, when(buf, streqs(" HTTP/1.1\r\nHost: ")), returns(PT_ENDED));
@@ -330,6 +598,11 @@ inline void expect_outgoing_with_url(char const *url) {
     expect(psock_send, when(buf, streqs("\r\nUser-Agent: PubNub-ConTiki/0.1\r\nConnection: Keep-Alive\r\n\r\n")), returns(PT_ENDED));
 }
 
+inline void expect_outgoing_with_url(char const *url) {
+    expect(psock_init, when(buffersize, is_less_than(128)));
+    expect_request_with_url(url);
+}
+
 
 Ensure(single_context_pubnub, leave_cached_dns) {
     pubnub_init(pbp, "pubkey", "subkey");
@@ -486,38 +759,1060 @@ Ensure(single_context_pubnub, publish_cached_dns) {
 }
 
 
-Ensure(single_context_pubnub, publish_while_busy_fails) {
-    pubnub_init(pbp, "pubkey", "subkey");
+Ensure(single_context_pubnub, publish_meta) {
+    pubnub_init(pbp, "publkey", "subkey");
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish_meta(pbp, "jarak", "\"zec\"", "{\"region\":\"eu\"}"), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/jarak/0/%22zec%22?meta=%7B%22region%22:%22eu%22%7D");
+    expect_event(pubnub_publish_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777403\"]");
+
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+}
+
+
+Ensure(single_context_pubnub, publish_options) {
+    struct pubnub_publish_options opts = pubnub_publish_defopts();
+    pubnub_init(pbp, "publkey", "subkey");
+
+    opts.store = false;
+    opts.replicate = false;
+    opts.ttl = 24;
+    opts.meta = "{}";
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish_ex(pbp, "jarak", "1", &opts), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/jarak/0/1?store=0&norep=true&ttl=24&meta=%7B%7D");
+    expect_event(pubnub_publish_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777403\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+
+    /* Fire and forget is over as soon as the request is sent */
+    opts = pubnub_publish_defopts();
+    opts.fire_and_forget = true;
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish_ex(pbp, "jarak", "2", &opts), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/jarak/0/2");
+    expect_event(pubnub_publish_event);
+    incoming("");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish_ex(pbp, "jarak", "3", &opts), equals(PNR_STARTED));
+}
+
+
+Ensure(single_context_pubnub, publish_response_parsed) {
+    pubnub_init(pbp, "publkey", "subkey");
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish(pbp, "jarak", "1"), equals(PNR_STARTED));
+    attest(pubnub_last_publish_timetoken(pbp), streqs(""));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/jarak/0/1");
+    expect_event(pubnub_publish_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777403\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+    attest(pubnub_last_publish_timetoken(pbp), streqs("14178940800777403"));
+    attest(pubnub_last_publish_result(pbp), streqs("Sent"));
+
+    /* Server reports an error with HTTP 200 */
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish(pbp, "jarak", "2"), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/jarak/0/2");
+    expect_event(pubnub_publish_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 37\r\n\r\n[0,\"Invalid Key\",\"14178940800777404\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_PUBLISH_FAILED));
+    attest(pubnub_last_publish_timetoken(pbp), streqs("14178940800777404"));
+    attest(pubnub_last_publish_result(pbp), streqs("Invalid Key"));
+
+    /* Not a publish response at all */
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish(pbp, "jarak", "3"), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/jarak/0/3");
+    expect_event(pubnub_publish_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 2\r\n\r\n{}");
+    attest(pubnub_last_result(pbp), equals(PNR_FORMAT_ERROR));
+    attest(pubnub_last_publish_timetoken(pbp), streqs(""));
+}
+
+
+Ensure(single_context_pubnub, publish_while_busy_fails) {
+    pubnub_init(pbp, "pubkey", "subkey");
+
+    /* Leave while leaving */
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_leave(pbp, "lamanche"), equals(PNR_STARTED));
+
+    attest(pubnub_publish(pbp, "lamanche", "123"), equals(PNR_IN_PROGRESS));
+
+    expect_event(pubnub_leave_event);
+    pubnub_cancel(pbp);
+    close_incoming();
+    close_incoming();
+    attest(pubnub_last_result(pbp), equals(PNR_CANCELLED));
+}
+
+
+Ensure(single_context_pubnub, publish_cached_dns_too_long_message) {
+    pubnub_init(pbp, "publkey", "subkey");
+
+    char msg[PUBNUB_BUF_MAXLEN + 1];
+    memset(msg, 'A', sizeof msg);
+    msg[sizeof msg - 1] = '\0';
+    attest(pubnub_publish(pbp, "w", msg), equals(PNR_TX_BUFF_TOO_SMALL));
+
+    /* URL encoded char */
+    memset(msg, '"', sizeof msg);
+    msg[sizeof msg - 1] = '\0';
+    attest(pubnub_publish(pbp, "w", msg), equals(PNR_TX_BUFF_TOO_SMALL));
+}
+
+
+Ensure(single_context_pubnub, publish_multi_pipelined) {
+    char const *channels[] = { "jarak", "ruma", "sid" };
+
+    pubnub_init(pbp, "publkey", "subkey");
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish_multi(pbp, channels, 3, "\"zec\""), equals(PNR_STARTED));
+    attest(pubnub_publish_multi(pbp, channels, 3, "\"zec\""), equals(PNR_IN_PROGRESS));
+
+    uip_flags = UIP_CONNECTED;
+    expect(psock_init, when(buffersize, is_less_than(128)));
+    expect_request_with_url("/publish/publkey/subkey/0/jarak/0/%22zec%22");
+    expect_request_with_url("/publish/publkey/subkey/0/ruma/0/%22zec%22");
+    expect_request_with_url("/publish/publkey/subkey/0/sid/0/%22zec%22");
+    incoming("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777403\"]");
+    incoming("HTTP/1.1 200\r\nTransfer-Encoding: chunked\r\n\r\n1e\r\n[1,\"Sent\",\"14178940800777404\"]\r\n0\r\n\r\n");
+    expect_event(pubnub_publish_event);
+    incoming_and_close("HTTP/1.1 400\r\nContent-Length: 2\r\n\r\n[]");
+
+    attest(readbuf_left(), equals(0));
+    attest(pubnub_last_result(pbp), equals(PNR_HTTP_ERROR));
+    attest(pubnub_last_publish_multi(pbp), equals(3));
+
+    /* Won't start if the message doesn't fit for all channels */
+    char msg[PUBNUB_BUF_MAXLEN - 40];
+    memset(msg, '1', sizeof msg);
+    msg[sizeof msg - 1] = '\0';
+    channels[1] = "a-very-long-channel-name-that-does-not-fit";
+    attest(pubnub_publish_multi(pbp, channels, 3, msg), equals(PNR_TX_BUFF_TOO_SMALL));
+}
+
+
+Ensure(single_context_pubnub, publish_multi_retries_the_rest) {
+    char const *channels[] = { "jarak", "ruma", "sid" };
+
+    pubnub_init(pbp, "publkey", "subkey");
+    pubnub_set_retry(pbp, 2, 1, 1, 0);
+    pubnub_set_seq_stamp(pbp, true);
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish_multi(pbp, channels, 3, "1"), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect(psock_init, when(buffersize, is_less_than(PUBNUB_BUF_MAXLEN+1)));
+    expect_request_with_url("/publish/publkey/subkey/0/jarak/0/1");
+    expect_request_with_url("/publish/publkey/subkey/0/ruma/0/1");
+    expect_request_with_url("/publish/publkey/subkey/0/sid/0/1");
+    incoming("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777403\"]");
+    uip_abort();
+    expect(ctimer_set, when(t, equals(1)));
+    incoming("");
+
+    /* Only the channels not published to yet, not stamped */
+    expect_cached_dns_for_pubnub_origin();
+    m_ctimer->f(m_ctimer->ptr);
+    uip_flags = UIP_CONNECTED;
+    expect(psock_init, when(buffersize, is_less_than(PUBNUB_BUF_MAXLEN+1)));
+    expect_request_with_url("/publish/publkey/subkey/0/ruma/0/1");
+    expect_request_with_url("/publish/publkey/subkey/0/sid/0/1");
+    incoming("HTTP/1.1 200\r\nTransfer-Encoding: chunked\r\n\r\n1e\r\n[1,\"Sent\",\"14178940800777404\"]\r\n0\r\n\r\n");
+    expect_event(pubnub_publish_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777405\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+    attest(pubnub_last_publish_multi(pbp), equals(7));
+
+    /* A single channel is retried on that channel */
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish_multi(pbp, channels + 2, 1, "2"), equals(PNR_STARTED));
+    uip_abort();
+    expect(ctimer_set, when(t, equals(1)));
+    incoming("");
+    expect_cached_dns_for_pubnub_origin();
+    m_ctimer->f(m_ctimer->ptr);
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/sid/0/2");
+    expect_event(pubnub_publish_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777406\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+    attest(pubnub_last_publish_multi(pbp), equals(1));
+}
+
+Ensure(single_context_pubnub, publish_rate_limited) {
+    struct pubnub_rate_stats stats;
+    struct pubnub_pubreq req;
+
+    pubnub_init(pbp, "publkey", "subkey");
+    pubnub_set_rate_limit(pbp, 10, 2);
+
+#define publish_(msg_) do { \
+    expect_cached_dns_for_pubnub_origin(); \
+    attest(pubnub_publish(pbp, "jarak", msg_), equals(PNR_STARTED)); \
+    uip_flags = UIP_CONNECTED; \
+    expect_outgoing_with_url("/publish/publkey/subkey/0/jarak/0/" msg_); \
+    expect_event(pubnub_publish_event); \
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777403\"]"); \
+    attest(pubnub_last_result(pbp), equals(PNR_OK)); \
+    } while (0)
+
+    /* Burst goes through, then we're out of tokens */
+    publish_("1");
+    publish_("2");
+    attest(pubnub_publish(pbp, "jarak", "3"), equals(PNR_RATE_LIMITED));
+    pubnub_get_rate_stats(pbp, &stats);
+    attest(stats.tokens, equals(0));
+    attest(stats.rejected, equals(1));
+
+    /* A token is added after a period */
+    m_clock += 10;
+    publish_("3");
+    m_clock += 5;
+    attest(pubnub_publish(pbp, "jarak", "4"), equals(PNR_RATE_LIMITED));
+
+    /* Queued publish waits for the next token */
+    expect(ctimer_set, when(t, equals(5)));
+    attest(pubnub_publish_queued(pbp, &req, "jarak", "4", 0, 0), equals(PNR_STARTED));
+    pubnub_get_rate_stats(pbp, &stats);
+    attest(stats.tokens, equals(0));
+    attest(stats.rejected, equals(2));
+    attest(stats.delayed, equals(1));
+
+    m_clock += 5;
+    expect_cached_dns_for_pubnub_origin();
+    m_ctimer->f(m_ctimer->ptr);
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/jarak/0/4");
+    expect_req_event(&req);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777404\"]");
+    attest(req.result, equals(PNR_OK));
+
+    /* Bucket doesn't fill over the burst */
+    m_clock += 1000;
+    pubnub_get_rate_stats(pbp, &stats);
+    attest(stats.tokens, equals(2));
+
+#undef publish_
+}
+
+
+Ensure(single_context_pubnub, publish_queued_priority_and_deadline) {
+    struct pubnub_pubreq low, late, high;
+
+    pubnub_init(pbp, "publkey", "subkey");
+
+    /* Starts right away on an idle context */
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish_queued(pbp, &low, "jarak", "1", 0, 0), equals(PNR_STARTED));
+    attest(pubnub_publish(pbp, "jarak", "\"zec\""), equals(PNR_IN_PROGRESS));
+
+    /* These wait, the higher priority one goes first */
+    attest(pubnub_publish_queued(pbp, &late, "jarak", "2", 0, 10), equals(PNR_STARTED));
+    attest(pubnub_publish_queued(pbp, &high, "jarak", "3", 5, 0), equals(PNR_STARTED));
+    attest(late.result, equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/jarak/0/1");
+    expect_req_event(&low);
+    expect(process_poll, when(p, equals(&pubnub_process)));
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777403\"]");
+    attest(low.result, equals(PNR_OK));
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_process.thread(&pubnub_process.pt, PROCESS_EVENT_POLL, NULL), equals(PT_YIELDED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/jarak/0/3");
+    expect_req_event(&high);
+    expect(process_poll, when(p, equals(&pubnub_process)));
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777404\"]");
+    attest(high.result, equals(PNR_OK));
+
+    /* Deadline of the last one passed while waiting, so it's dropped */
+    m_clock += 11;
+    expect_req_event(&late);
+    attest(pubnub_process.thread(&pubnub_process.pt, PROCESS_EVENT_POLL, NULL), equals(PT_YIELDED));
+    attest(late.result, equals(PNR_EXPIRED));
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+}
+
+
+Ensure(single_context_pubnub, publish_queued_coalesced) {
+    struct pubnub_pubreq req[5];
+
+    pubnub_init(pbp, "publkey", "subkey");
+    pubnub_set_coalesce(pbp, 5, 8);
+
+    /* First message waits for others to come, on a timer of the
+       Pubnub process, not the one queueing it */
+    process_current = NULL;
+    expect(ctimer_set, when(t, equals(5)));
+    attest(pubnub_publish_queued(pbp, &req[0], "a", "1", 0, 0), equals(PNR_STARTED));
+    attest(m_ctimer_process, equals(&pubnub_process));
+    attest(process_current, equals(NULL));
+    process_current = &pubnub_process;
+    attest(pubnub_publish_queued(pbp, &req[1], "b", "22", 0, 0), equals(PNR_STARTED));
+    attest(pubnub_publish_queued(pbp, &req[2], "a", "\"3\"", 0, 0), equals(PNR_STARTED));
+
+    expect_cached_dns_for_pubnub_origin();
+    m_ctimer->f(m_ctimer->ptr);
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/a/0/[1,%223%22]");
+    expect_req_event(&req[0]);
+    expect_req_event(&req[2]);
+    expect(process_poll, when(p, equals(&pubnub_process)));
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777403\"]");
+    attest(req[0].result, equals(PNR_OK));
+    attest(req[2].result, equals(PNR_OK));
+    attest(req[1].result, equals(PNR_STARTED));
+
+    /* Even a single message is packed */
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_process.thread(&pubnub_process.pt, PROCESS_EVENT_POLL, NULL), equals(PT_YIELDED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/b/0/[22]");
+    expect_req_event(&req[1]);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777404\"]");
+    attest(req[1].result, equals(PNR_OK));
+
+    /* Don't wait if there's enough to send */
+    expect(ctimer_set, when(t, equals(5)));
+    attest(pubnub_publish_queued(pbp, &req[3], "a", "4444", 0, 0), equals(PNR_STARTED));
+    expect(ctimer_stop);
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish_queued(pbp, &req[4], "a", "5555", 0, 0), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/a/0/[4444,5555]");
+    expect_req_event(&req[3]);
+    expect_req_event(&req[4]);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777405\"]");
+    attest(req[3].result, equals(PNR_OK));
+    attest(req[4].result, equals(PNR_OK));
+}
+
+
+#if PUBNUB_INBOX_SIZE == 0
+Ensure(single_context_pubnub, subscribe_unpacked) {
+    pubnub_init(pbp, "publkey", "timok");
+    pubnub_set_unpack(pbp, true);
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "a,b,c"), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/timok/a,b,c/0/0?&pnsdk=PubNub-Contiki-%2F1.1");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 50\r\n\r\n[[[1,{\"t\":2}],\"x\",[]],\"14179836755957292\",\"a,b,c\"]");
+
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+    attest(pubnub_get(pbp), streqs("1"));
+    attest(pubnub_get_channel(pbp), streqs("a"));
+#if PUBNUB_REPLY_BUFFERS == 1
+    attest(pubnub_subscribe(pbp, "a,b,c"), equals(PNR_RX_BUFF_NOT_EMPTY));
+#endif
+    attest(pubnub_get(pbp), streqs("{\"t\":2}"));
+    attest(pubnub_get_channel(pbp), streqs("a"));
+    attest(pubnub_get(pbp), streqs("\"x\""));
+    attest(pubnub_get_channel(pbp), streqs("b"));
+    attest(pubnub_get(pbp), equals(NULL));
+}
+#endif
+
+
+#if PUBNUB_DEDUP_SIZE > 0
+Ensure(single_context_pubnub, subscribe_dedup) {
+    pubnub_init(pbp, "publkey", "timok");
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "a,b"), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/timok/a,b/0/0?&pnsdk=PubNub-Contiki-%2F1.1");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 41\r\n\r\n[[1,1,2,1],\"14179836755957292\",\"a,b,a,a\"]");
+
+    /* Same message on another channel is not a duplicate */
+    attest_got("1", "a");
+    attest_got("1", "b");
+    attest_got("2", "a");
+    attest_got_none();
+    attest(pubnub_dedup_count(pbp), equals(1));
+
+    /* Received again, as after a retry */
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "a,b"), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/timok/a,b/0/14179836755957292?&pnsdk=PubNub-Contiki-%2F1.1");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 33\r\n\r\n[[2,3],\"14179836755957293\",\"a,a\"]");
+    attest_got("3", "a");
+    attest_got_none();
+    attest(pubnub_dedup_count(pbp), equals(2));
+}
+#endif
+
+
+Ensure(single_context_pubnub, publish_seq_stamped) {
+    pubnub_init(pbp, "publkey", "subkey");
+    pubnub_set_uuid(pbp, "me");
+    pubnub_set_seq_stamp(pbp, true);
+    pubnub_set_retry(pbp, 2, 1, 1, 0);
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish(pbp, "jarak", "5"), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/jarak/0/%7B%22q%22:0,%22u%22:%22me%22,%22m%22:5%7D");
+    expect_event(pubnub_publish_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777403\"]");
+
+    /* A retry sends the same sequence number */
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish(pbp, "jarak", "6"), equals(PNR_STARTED));
+    uip_flags = UIP_TIMEDOUT;
+    expect(ctimer_set, when(t, equals(1)));
+    incoming("");
+    expect_cached_dns_for_pubnub_origin();
+    m_ctimer->f(m_ctimer->ptr);
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/jarak/0/%7B%22q%22:1,%22u%22:%22me%22,%22m%22:6%7D");
+    expect_event(pubnub_publish_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777404\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+}
+
+
+Ensure(single_context_pubnub, publish_built_in_place) {
+    struct pubnub_publish_options opts = pubnub_publish_defopts();
+    int i;
+
+    pubnub_init(pbp, "publkey", "subkey");
+    pubnub_set_retry(pbp, 2, 1, 1, 0);
+
+    attest(pubnub_publish_end(pbp, &opts), equals(PNR_IN_PROGRESS));
+    attest(pubnub_publish_begin(pbp, "jarak"), equals(PNR_OK));
+    attest(pubnub_publish(pbp, "jarak", "1"), equals(PNR_IN_PROGRESS));
+    attest(pubnub_publish_begin(pbp, "jarak"), equals(PNR_IN_PROGRESS));
+    pubnub_msg_begin_object(pbp);
+    pubnub_msg_key(pbp, "t");
+    pubnub_msg_fixed(pbp, -2105, 2);
+    pubnub_msg_key(pbp, "id");
+    pubnub_msg_string(pbp, "k\"1\n\xe9");
+    pubnub_msg_key(pbp, "v");
+    pubnub_msg_begin_array(pbp);
+    pubnub_msg_int(pbp, 1);
+    pubnub_msg_int(pbp, -2);
+    pubnub_msg_raw(pbp, "true");
+    pubnub_msg_begin_array(pbp);
+    pubnub_msg_end(pbp);
+    pubnub_msg_end(pbp);
+    pubnub_msg_key(pbp, "e");
+    pubnub_msg_begin_object(pbp);
+    pubnub_msg_end(pbp);
+    pubnub_msg_end(pbp);
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish_end(pbp, &opts), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/jarak/0/%7B%22t%22:-21.05,%22id%22:%22k%5C%221%5Cu000a%E9%22,%22v%22:[1,-2,true,[]],%22e%22:%7B%7D%7D");
+    expect_event(pubnub_publish_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777402\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+
+    /* Not retried, the message is gone */
+    attest(pubnub_publish_begin(pbp, "jarak"), equals(PNR_OK));
+    pubnub_msg_int(pbp, 0);
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish_end(pbp, &opts), equals(PNR_STARTED));
+    uip_flags = UIP_TIMEDOUT;
+    expect_event(pubnub_publish_event);
+    incoming("");
+    attest(pubnub_last_result(pbp), equals(PNR_TIMEOUT));
+
+    /* Stamped */
+    pubnub_set_uuid(pbp, "me");
+    pubnub_set_seq_stamp(pbp, true);
+    attest(pubnub_publish_begin(pbp, "jarak"), equals(PNR_OK));
+    pubnub_msg_begin_array(pbp);
+    pubnub_msg_fixed(pbp, 5, 1);
+    pubnub_msg_end(pbp);
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish_end(pbp, &opts), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/jarak/0/%7B%22q%22:2,%22u%22:%22me%22,%22m%22:[0.5]%7D");
+    expect_event(pubnub_publish_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777403\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+    pubnub_set_seq_stamp(pbp, false);
+
+    /* Bad JSON */
+    attest(pubnub_publish_begin(pbp, "jarak"), equals(PNR_OK));
+    pubnub_msg_begin_object(pbp);
+    pubnub_msg_int(pbp, 1);
+    attest(pubnub_publish_end(pbp, &opts), equals(PNR_FORMAT_ERROR));
+    attest(pubnub_publish_begin(pbp, "jarak"), equals(PNR_OK));
+    pubnub_msg_begin_array(pbp);
+    attest(pubnub_publish_end(pbp, &opts), equals(PNR_FORMAT_ERROR));
+    attest(pubnub_publish_begin(pbp, "jarak"), equals(PNR_OK));
+    pubnub_msg_int(pbp, 1);
+    pubnub_msg_int(pbp, 2);
+    attest(pubnub_publish_end(pbp, &opts), equals(PNR_FORMAT_ERROR));
+    attest(pubnub_publish_begin(pbp, "jarak"), equals(PNR_OK));
+    attest(pubnub_publish_end(pbp, &opts), equals(PNR_FORMAT_ERROR));
+
+    /* Too long */
+    attest(pubnub_publish_begin(pbp, "jarak"), equals(PNR_OK));
+    pubnub_msg_begin_array(pbp);
+    for (i = 0; i < PUBNUB_BUF_MAXLEN / 8; ++i) {
+        pubnub_msg_string(pbp, "\"\"");
+    }
+    pubnub_msg_end(pbp);
+    attest(pubnub_publish_end(pbp, &opts), equals(PNR_TX_BUFF_TOO_SMALL));
+
+    /* Cancelled */
+    attest(pubnub_publish_begin(pbp, "jarak"), equals(PNR_OK));
+    pubnub_cancel(pbp);
+    attest(pubnub_publish_end(pbp, &opts), equals(PNR_IN_PROGRESS));
+    attest(pubnub_publish_begin(pbp, "jarak"), equals(PNR_OK));
+    pubnub_cancel(pbp);
+}
+
+Ensure(single_context_pubnub, publish_binary) {
+    struct pubnub_publish_options opts = pubnub_publish_defopts();
+    unsigned char frame[30];
+    unsigned char big[PUBNUB_BUF_MAXLEN] = { 0 };
+    unsigned i;
+
+    pubnub_init(pbp, "publkey", "subkey");
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish_binary(pbp, "adc", m_binary, sizeof m_binary, PNBE_BASE85), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/adc/0/%22HelloWorld%7D%23lS%22");
+    expect_event(pubnub_publish_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777403\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+
+    for (i = 0; i < sizeof frame; ++i) {
+        frame[i] = i;
+    }
+    attest(pubnub_publish_begin(pbp, "adc"), equals(PNR_OK));
+    pubnub_msg_begin_object(pbp);
+    pubnub_msg_key(pbp, "s");
+    pubnub_msg_binary(pbp, frame, sizeof frame, PNBE_BASE64);
+    pubnub_msg_key(pbp, "e");
+    pubnub_msg_binary(pbp, frame, 0, PNBE_BASE64);
+    pubnub_msg_end(pbp);
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish_end(pbp, &opts), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/adc/0/%7B%22s%22:%22AAECAwQFBgcICQoLDA0ODxAREhMUFRYXGBkaGxwd%22,%22e%22:%22%22%7D");
+    expect_event(pubnub_publish_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777404\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+
+    /* The encoded data is written in pieces, the last one shorter
+       than the one before, which is left after it, so only its
+       length says where it ends */
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish_binary(pbp, "adc", big, 36, PNBE_BASE85), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/adc/0/%22000000000000000000000000000000000000000000000%22");
+    expect_event(pubnub_publish_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777405\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+
+    attest(pubnub_publish_binary(pbp, "adc", big, sizeof big, PNBE_BASE64), equals(PNR_TX_BUFF_TOO_SMALL));
+}
+
+/* Needs room for two publishers */
+#if PUBNUB_SEQ_SOURCES > 1
+static unsigned m_seq_events;
+static enum pubnub_seq_event m_seq_last;
+
+static void seq_cb(pubnub_t *p, char const *publisher, enum pubnub_seq_event ev, unsigned long expected, unsigned long got, void *user_data)
+{
+    attest(p, equals(pbp));
+    attest(publisher, streqs("a"));
+    attest(user_data, equals(&m_seq_events));
+    ++m_seq_events;
+    m_seq_last = ev;
+}
+
+
+Ensure(single_context_pubnub, subscribe_seq_tracking) {
+    struct pubnub_seq_stats stats;
+#if PUBNUB_INBOX_SIZE > 0
+    static char const *const order[] = { "1", "2", "4", "7", "9", "3", "5", "6" };
+    struct pubnub_inbox_msg msg;
+    unsigned i;
+#endif
+    pubnub_init(pbp, "publkey", "timok");
+    pubnub_set_seq_tracking(pbp, true, seq_cb, &m_seq_events);
+    m_seq_events = 0;
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "k"), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/timok/k/0/0?&pnsdk=PubNub-Contiki-%2F1.1");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 179\r\n\r\n[[{\"q\":0,\"u\":\"a\",\"m\":1},{\"q\":1,\"u\":\"a\",\"m\":2},{\"q\":3,\"u\":\"a\",\"m\":4},7,{\"q\":3,\"u\":\"b\",\"m\":9},{\"q\":2,\"u\":\"a\",\"m\":3},{\"q\":3,\"u\":\"a\",\"m\":5},{\"q\":0,\"u\":\"a\",\"m\":6}],\"14179836755957292\"]");
+
+#if PUBNUB_INBOX_SIZE > 0
+    /* All are tracked as they are put in the inbox */
+    for (i = 0; i < sizeof order / sizeof order[0]; ++i) {
+        attest(pubnub_inbox_peek(pbp, &msg), is_true);
+        attest(msg.message, streqs(order[i]));
+        pubnub_inbox_pop(pbp);
+    }
+#else
+    attest(pubnub_get(pbp), streqs("1"));
+    attest(pubnub_get(pbp), streqs("2"));
+    attest(m_seq_events, equals(0));
+    attest(pubnub_get(pbp), streqs("4"));
+    attest(m_seq_events, equals(1));
+    attest(m_seq_last, equals(PNSE_GAP));
+    /* Not stamped, and a new publisher */
+    attest(pubnub_get(pbp), streqs("7"));
+    attest(pubnub_get(pbp), streqs("9"));
+    attest(m_seq_events, equals(1));
+    attest(pubnub_get(pbp), streqs("3"));
+    attest(m_seq_last, equals(PNSE_REORDER));
+    attest(pubnub_get(pbp), streqs("5"));
+    attest(m_seq_last, equals(PNSE_DUPLICATE));
+    /* Publisher restarted */
+    attest(pubnub_get(pbp), streqs("6"));
+    attest(pubnub_get(pbp), equals(NULL));
+#endif
+    attest(m_seq_events, equals(3));
+
+    pubnub_get_seq_stats(pbp, &stats);
+    attest(stats.received, equals(7));
+    attest(stats.lost, equals(1));
+    attest(stats.duplicates, equals(1));
+    attest(stats.reordered, equals(1));
+}
+#endif
+
+
+Ensure(single_context_pubnub, retry_with_backoff) {
+    pubnub_init(pbp, "publkey", "drina");
+    pubnub_set_retry(pbp, 3, 4, 6, 50);
+    m_random = 1;
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "morava"), equals(PNR_STARTED));
+
+    /* Failures are not reported while retries are left */
+    uip_flags = UIP_TIMEDOUT;
+    expect(ctimer_set, when(t, equals(3)));
+    incoming("");
+
+    expect_cached_dns_for_pubnub_origin();
+    m_ctimer->f(m_ctimer->ptr);
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/drina/morava/0/0?&pnsdk=PubNub-Contiki-%2F1.1");
+    incoming("");
+    uip_abort();
+    expect(ctimer_set, when(t, equals(5)));
+    incoming("");
+
+    expect_cached_dns_for_pubnub_origin();
+    m_ctimer->f(m_ctimer->ptr);
+    uip_flags = UIP_TIMEDOUT;
+    expect_event(pubnub_subscribe_event);
+    incoming("");
+
+    attest(pubnub_last_result(pbp), equals(PNR_TIMEOUT));
+    attest(pubnub_last_attempts(pbp), equals(3));
+
+    /* Success on retry, with the same time token */
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "morava"), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/drina/morava/0/0?&pnsdk=PubNub-Contiki-%2F1.1");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 24\r\n\r\n[[],\"14179836755957292\"]");
+    attest(pubnub_last_attempts(pbp), equals(1));
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "morava"), equals(PNR_STARTED));
+    uip_close();
+    expect(ctimer_set, when(t, equals(3)));
+    incoming("");
+
+    expect_cached_dns_for_pubnub_origin();
+    m_ctimer->f(m_ctimer->ptr);
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/drina/morava/0/14179836755957292?&pnsdk=PubNub-Contiki-%2F1.1");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 24\r\n\r\n[[],\"14179836755957293\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+    attest(pubnub_last_attempts(pbp), equals(2));
+
+    /* Cancel while waiting to retry */
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_publish(pbp, "morava", "1"), equals(PNR_STARTED));
+    uip_abort();
+    expect(ctimer_set, when(t, equals(3)));
+    incoming("");
+    expect(ctimer_stop);
+    expect_event(pubnub_publish_event);
+    pubnub_cancel(pbp);
+    attest(pubnub_last_result(pbp), equals(PNR_CANCELLED));
+    attest(pubnub_last_attempts(pbp), equals(2));
+}
+
+
+Ensure(single_context_pubnub, retry_independent_of_holdoff) {
+    struct pubnub_pubreq req[3];
+    struct ctimer *holdoff;
+    struct ctimer *retry;
+    pubnub_init(pbp, "publkey", "drina");
+    pubnub_set_coalesce(pbp, 5, 8);
+    pubnub_set_retry(pbp, 2, 3, 3, 0);
+
+    /* Hold-off for coalescing expires while the subscribe waits to retry */
+    expect(ctimer_set, when(t, equals(5)));
+    attest(pubnub_publish_queued(pbp, &req[0], "a", "1", 0, 0), equals(PNR_STARTED));
+    holdoff = m_ctimer;
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "morava"), equals(PNR_STARTED));
+    uip_flags = UIP_TIMEDOUT;
+    expect(ctimer_set, when(t, equals(3)));
+    incoming("");
+    retry = m_ctimer;
+    attest(retry, differs(holdoff));
+    holdoff->f(holdoff->ptr);
+
+    expect_cached_dns_for_pubnub_origin();
+    retry->f(retry->ptr);
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/drina/morava/0/0?&pnsdk=PubNub-Contiki-%2F1.1");
+    expect_event(pubnub_subscribe_event);
+    expect(process_poll, when(p, equals(&pubnub_process)));
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 24\r\n\r\n[[],\"14179836755957292\"]");
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_process.thread(&pubnub_process.pt, PROCESS_EVENT_POLL, NULL), equals(PT_YIELDED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/drina/0/a/0/[1]");
+    expect_req_event(&req[0]);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777403\"]");
+    attest(req[0].result, equals(PNR_OK));
+
+    /* Enough to publish arrives while the subscribe waits to retry */
+    expect(ctimer_set, when(t, equals(5)));
+    attest(pubnub_publish_queued(pbp, &req[1], "a", "1", 0, 0), equals(PNR_STARTED));
+    holdoff = m_ctimer;
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "morava"), equals(PNR_STARTED));
+    uip_flags = UIP_TIMEDOUT;
+    expect(ctimer_set, when(t, equals(3)));
+    incoming("");
+    retry = m_ctimer;
+    expect(ctimer_stop, when(c, equals(holdoff)));
+    attest(pubnub_publish_queued(pbp, &req[2], "a", "2222222", 0, 0), equals(PNR_STARTED));
+
+    expect_cached_dns_for_pubnub_origin();
+    retry->f(retry->ptr);
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/drina/morava/0/14179836755957292?&pnsdk=PubNub-Contiki-%2F1.1");
+    expect_event(pubnub_subscribe_event);
+    expect(process_poll, when(p, equals(&pubnub_process)));
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 24\r\n\r\n[[],\"14179836755957293\"]");
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_process.thread(&pubnub_process.pt, PROCESS_EVENT_POLL, NULL), equals(PT_YIELDED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/drina/0/a/0/[1,2222222]");
+    expect_req_event(&req[1]);
+    expect_req_event(&req[2]);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777404\"]");
+    attest(req[1].result, equals(PNR_OK));
+    attest(req[2].result, equals(PNR_OK));
+}
+
+static char m_rcv[4][32];
+static unsigned m_rcv_n;
+
+static void rcv_cb(pubnub_t *p, char const *channel, char const *message, void *user_data)
+{
+    attest(p, equals(pbp));
+    attest(user_data, equals(&m_rcv_n));
+    if (m_rcv_n < 4) {
+        snprintf(m_rcv[m_rcv_n++], sizeof m_rcv[0], "%s:%s", channel, message);
+    }
+    if (0 == strcmp(message, "\"stop\"")) {
+        pubnub_cancel(p);
+    }
+}
+
+
+Ensure(single_context_pubnub, subscribe_continuous) {
+    pubnub_init(pbp, "publkey", "timok");
+    m_rcv_n = 0;
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe_continuous(pbp, "morava", rcv_cb, &m_rcv_n), equals(PNR_STARTED));
+    attest(pubnub_publish(pbp, "morava", "1"), equals(PNR_IN_PROGRESS));
+
+    /* Messages go to the callback and subscribe starts again, no event */
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/timok/morava/0/0?&pnsdk=PubNub-Contiki-%2F1.1");
+    incoming("");
+    expect_cached_dns_for_pubnub_origin();
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 33\r\n\r\n[[\"Hi\",\"Fi\"],\"14179836755957292\"]");
+    attest(m_rcv_n, equals(2));
+    attest(m_rcv[0], streqs("morava:\"Hi\""));
+    attest(m_rcv[1], streqs("morava:\"Fi\""));
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+
+    /* Cancelling from the callback ends it, leaving the rest unread */
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/timok/morava/0/14179836755957292?&pnsdk=PubNub-Contiki-%2F1.1");
+    incoming("");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 48\r\n\r\n[[\"stop\",\"Wi\"],\"14179836755957293\",\"lim,morava\"]");
+    attest(m_rcv_n, equals(3));
+    attest(m_rcv[2], streqs("lim:\"stop\""));
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+    attest_got("\"Wi\"", "morava");
+    attest_got_none();
+
+    /* Cancel ends it, too */
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe_continuous(pbp, "morava", rcv_cb, &m_rcv_n), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/timok/morava/0/14179836755957293?&pnsdk=PubNub-Contiki-%2F1.1");
+    incoming("");
+    pubnub_cancel(pbp);
+    incoming("");
+    expect_event(pubnub_subscribe_event);
+    close_incoming();
+    attest(pubnub_last_result(pbp), equals(PNR_CANCELLED));
+}
+
+
+#if PUBNUB_CHANNEL_SET_MAXLEN >= 16
+Ensure(single_context_pubnub, subscribe_channel_set) {
+    char name[PUBNUB_CHANNEL_SET_MAXLEN + 1];
+
+    pubnub_init(pbp, "publkey", "timok");
+
+    attest(pubnub_subscribe(pbp, NULL), equals(PNR_INVALID_CHANNEL));
+    attest(pubnub_add_channel(pbp, "a"), equals(PNR_OK));
+    attest(pubnub_add_channel(pbp, "bb"), equals(PNR_OK));
+    attest(pubnub_add_channel(pbp, "a"), equals(PNR_OK));
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, NULL), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/timok/a,bb/0/0?&pnsdk=PubNub-Contiki-%2F1.1");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 24\r\n\r\n[[],\"14179836755957292\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+
+    /* Leave of the removed channel goes first, time token is kept */
+    attest(pubnub_remove_channel(pbp, "x"), is_false);
+    attest(pubnub_remove_channel(pbp, "a"), is_true);
+    attest(pubnub_add_channel(pbp, "c"), equals(PNR_OK));
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, NULL), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/v2/presence/sub-key/timok/channel/a/leave?");
+    expect_request_with_url("/subscribe/timok/bb,c/0/14179836755957292?&pnsdk=PubNub-Contiki-%2F1.1");
+    incoming("HTTP/1.1 403\r\nContent-Length: 2\r\n\r\n{}");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 29\r\n\r\n[[1],\"14179836755957293\",\"c\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+    attest_got("1", "c");
+
+    /* Removed and added back before the subscribe: no leave */
+    attest(pubnub_remove_channel(pbp, "bb"), is_true);
+    attest(pubnub_add_channel(pbp, "bb"), equals(PNR_OK));
+    attest(pubnub_remove_channel(pbp, "c"), is_true);
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, NULL), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/v2/presence/sub-key/timok/channel/c/leave?");
+    expect_request_with_url("/subscribe/timok/bb/0/14179836755957293?&pnsdk=PubNub-Contiki-%2F1.1");
+    incoming("");
+
+    /* Full set */
+    memset(name, 'n', PUBNUB_CHANNEL_SET_MAXLEN);
+    name[PUBNUB_CHANNEL_SET_MAXLEN] = '\0';
+    attest(pubnub_add_channel(pbp, name), equals(PNR_TX_BUFF_TOO_SMALL));
+}
+#endif
+
+
+#if PUBNUB_DEMUX_SIZE > 1
+static void demux_cb(pubnub_t *p, char const *channel, char const *message, void *user_data)
+{
+    if (m_rcv_n < 4) {
+        snprintf(m_rcv[m_rcv_n++], sizeof m_rcv[0], "%s>%s:%s", (char const*)user_data, channel, message);
+    }
+}
+
+
+Ensure(single_context_pubnub, subscribe_demux) {
+    static char chan[PUBNUB_DEMUX_SIZE][4];
+    unsigned i;
+
+    pubnub_init(pbp, "publkey", "timok");
+    pubnub_set_unpack(pbp, true);
+    m_rcv_n = 0;
+    attest(pubnub_set_handler(pbp, "a", demux_cb, "A"), is_true);
+    attest(pubnub_set_handler(pbp, "b", demux_cb, "B"), is_true);
 
-    /* Leave while leaving */
     expect_cached_dns_for_pubnub_origin();
-    attest(pubnub_leave(pbp, "lamanche"), equals(PNR_STARTED));
+    attest(pubnub_subscribe(pbp, "a,b,c"), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/timok/a,b,c/0/0?&pnsdk=PubNub-Contiki-%2F1.1");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 41\r\n\r\n[[[1,2],3,4],\"14179836755957292\",\"b,c,a\"]");
+
+    /* Message from "c" has no handler, and there's no default, so
+       it and the rest are left to be read */
+    attest(m_rcv_n, equals(2));
+    attest(m_rcv[0], streqs("B>b:1"));
+    attest(m_rcv[1], streqs("B>b:2"));
+    attest_got("3", "c");
+    attest_got("4", "a");
+    attest_got_none();
+
+    /* Removing a handler, setting the default */
+    attest(pubnub_set_handler(pbp, "b", NULL, NULL), is_true);
+    attest(pubnub_set_handler(pbp, NULL, demux_cb, "*"), is_true);
+    m_rcv_n = 0;
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "a,b"), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/timok/a,b/0/14179836755957292?&pnsdk=PubNub-Contiki-%2F1.1");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 33\r\n\r\n[[5,6],\"14179836755957293\",\"b,a\"]");
+    attest(m_rcv_n, equals(2));
+    attest(m_rcv[0], streqs("*>b:5"));
+    attest(m_rcv[1], streqs("A>a:6"));
+
+    /* Table full, and all of it reachable after a removal */
+    for (i = 1; i < PUBNUB_DEMUX_SIZE; ++i) {
+        snprintf(chan[i], sizeof chan[i], "%u", i);
+        attest(pubnub_set_handler(pbp, chan[i], demux_cb, chan[i]), is_true);
+    }
+    attest(pubnub_set_handler(pbp, "x", demux_cb, "X"), is_false);
+    attest(pubnub_set_handler(pbp, "a", NULL, NULL), is_true);
+    attest(pubnub_set_handler(pbp, "x", demux_cb, "X"), is_true);
+    for (i = 1; i < PUBNUB_DEMUX_SIZE; ++i) {
+        attest(pubnub_set_handler(pbp, chan[i], demux_cb, chan[i]), is_true);
+    }
+    attest(pubnub_set_handler(pbp, "y", demux_cb, "Y"), is_false);
+}
+#endif
 
-    attest(pubnub_publish(pbp, "lamanche", "123"), equals(PNR_IN_PROGRESS));
 
-    expect_event(pubnub_leave_event);
-    pubnub_cancel(pbp);
-    close_incoming();
-    close_incoming();
-    attest(pubnub_last_result(pbp), equals(PNR_CANCELLED));
+#if PUBNUB_INBOX_SIZE > 0
+/* Subscribes to "morava" and gets the reply with the single message @p n */
+static void subscribe_inbox_one(unsigned n, char const *url)
+{
+    char reply[100];
+    char body[40];
+
+    snprintf(body, sizeof body, "[[%u],\"14179836755957292\"]", n);
+    snprintf(reply, sizeof reply, "HTTP/1.1 200\r\nContent-Length: %u\r\n\r\n%s", (unsigned)strlen(body), body);
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "morava"), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url(url);
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close(reply);
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
 }
 
 
-Ensure(single_context_pubnub, publish_cached_dns_too_long_message) {
-    pubnub_init(pbp, "publkey", "subkey");
+Ensure(single_context_pubnub, subscribe_inbox) {
+    struct pubnub_inbox_msg msg;
+    struct pubnub_inbox_stats stats;
+    unsigned i;
 
-    char msg[PUBNUB_BUF_MAXLEN + 1];
-    memset(msg, 'A', sizeof msg);
-    msg[sizeof msg - 1] = '\0';
-    attest(pubnub_publish(pbp, "w", msg), equals(PNR_TX_BUFF_TOO_SMALL));
+    pubnub_init(pbp, "publkey", "timok");
+    attest(pubnub_inbox_peek(pbp, &msg), is_false);
 
-    /* URL encoded char */
-    memset(msg, '"', sizeof msg);
-    msg[sizeof msg - 1] = '\0';
-    attest(pubnub_publish(pbp, "w", msg), equals(PNR_TX_BUFF_TOO_SMALL));
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "a,b"), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/timok/a,b/0/0?&pnsdk=PubNub-Contiki-%2F1.1");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 35\r\n\r\n[[1,\"2\"],\"14179836755957292\",\"a,b\"]");
+
+    /* Messages are only in the inbox */
+    attest(pubnub_get(pbp), equals(NULL));
+    attest(pubnub_inbox_peek(pbp, &msg), is_true);
+    attest(msg.channel, streqs("a"));
+    attest(msg.message, streqs("1"));
+    attest(msg.timetoken, streqs("14179836755957292"));
+    attest(pubnub_inbox_pop(pbp), is_true);
+    attest(pubnub_inbox_peek(pbp, &msg), is_true);
+    attest(msg.channel, streqs("b"));
+    attest(msg.message, streqs("\"2\""));
+    attest(pubnub_inbox_pop(pbp), is_true);
+    attest(pubnub_inbox_peek(pbp, &msg), is_false);
+    attest(pubnub_inbox_pop(pbp), is_false);
+    pubnub_get_inbox_stats(pbp, &stats);
+    attest(stats.count, equals(0));
+    attest(stats.received, equals(2));
+    attest(stats.dropped, equals(0));
+
+    /* When full, oldest are dropped */
+    for (i = 0; (0 == stats.dropped) && (i <= PUBNUB_INBOX_SIZE / 20); ++i) {
+        subscribe_inbox_one(i, "/subscribe/timok/morava/0/14179836755957292?&pnsdk=PubNub-Contiki-%2F1.1");
+        pubnub_get_inbox_stats(pbp, &stats);
+    }
+    attest(stats.dropped, differs(0));
+    attest(stats.count, equals(i - stats.dropped));
+    attest(pubnub_inbox_peek(pbp, &msg), is_true);
+    attest(msg.channel, streqs(""));
+    attest(atoi(msg.message), equals(stats.dropped));
+
+    /* ...or the newest */
+    pubnub_set_inbox_policy(pbp, PNIP_DROP_NEWEST);
+    subscribe_inbox_one(i + 1, "/subscribe/timok/morava/0/14179836755957292?&pnsdk=PubNub-Contiki-%2F1.1");
+    pubnub_get_inbox_stats(pbp, &stats);
+    attest(stats.dropped, equals(1));
+    attest(stats.received, equals(0));
+    attest(pubnub_inbox_peek(pbp, &msg), is_true);
+    attest(atoi(msg.message), differs(0));
+    while (pubnub_inbox_pop(pbp)) {
+        attest(pubnub_inbox_peek(pbp, &msg) ? atoi(msg.message) : 0, is_less_than(i));
+    }
 }
+#endif
 
 
+#if PUBNUB_INBOX_SIZE == 0
 Ensure(single_context_pubnub, subscribe_cached_dns) {
     pubnub_init(pbp, "publkey", "timok");
 
@@ -559,8 +1854,10 @@ Ensure(single_context_pubnub, subscribe_cached_dns) {
     attest(pubnub_get_channel(pbp), streqs("lim"));
     attest(pubnub_get_channel(pbp), equals(NULL));
 }
+#endif
 
 
+#if PUBNUB_INBOX_SIZE == 0
 Ensure(single_context_pubnub, subscribe_cached_dns_chunked) {
     pubnub_init(pbp, "publkey", "timok");
 
@@ -599,6 +1896,7 @@ Ensure(single_context_pubnub, subscribe_cached_dns_chunked) {
     attest(pubnub_get(pbp), equals(NULL));
     attest(pubnub_get_channel(pbp), equals(NULL));
 }
+#endif
 
 
 Ensure(single_context_pubnub, subscribed_cached_dns_uuid_auth) {
@@ -662,6 +1960,458 @@ Ensure(single_context_pubnub, subscribed_cached_dns_uuid_auth) {
 }
 
 
+#if PUBNUB_INBOX_SIZE == 0
+Ensure(single_context_pubnub, subscribe_channel_group) {
+    pubnub_init(pbp, "pubkey", "timok");
+
+    /* Nothing to subscribe to */
+#if PUBNUB_CHANNEL_SET_MAXLEN == 0
+    attest(pubnub_subscribe(pbp, NULL), equals(PNR_INVALID_CHANNEL));
+#endif
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_add_channels_to_group(pbp, "a,b", "grp"), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/v1/channel-registration/sub-key/timok/channel-group/grp?add=a,b");
+    expect_event(pubnub_channel_group_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 2\r\n\r\n{}");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+
+    /* Only the channel group */
+    pubnub_set_channel_group(pbp, "grp");
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, NULL), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/timok/,/0/0?&channel-group=grp&pnsdk=PubNub-Contiki-%2F1.1");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 32\r\n\r\n[[\"m1\",\"m2\"],\"15\",\"g1,g2\",\"a,b\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+    attest(pubnub_get(pbp), streqs("\"m1\""));
+    attest(pubnub_get_channel(pbp), streqs("a"));
+    attest(pubnub_get_subscription(pbp), streqs("g1"));
+    attest(pubnub_get(pbp), streqs("\"m2\""));
+    attest(pubnub_get_channel(pbp), streqs("b"));
+    attest(pubnub_get_subscription(pbp), streqs("g2"));
+    attest(pubnub_get(pbp), equals(NULL));
+
+    /* Channel and channel group */
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "c"), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/timok/c/0/15?&channel-group=grp&pnsdk=PubNub-Contiki-%2F1.1");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 12\r\n\r\n[[\"x\"],\"16\"]");
+    attest(pubnub_get(pbp), streqs("\"x\""));
+    attest(pubnub_get_channel(pbp), equals(NULL));
+    attest(pubnub_get_subscription(pbp), equals(NULL));
+
+    pubnub_set_channel_group(pbp, NULL);
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_remove_channels_from_group(pbp, "a", "grp"), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/v1/channel-registration/sub-key/timok/channel-group/grp?remove=a");
+    expect_event(pubnub_channel_group_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 2\r\n\r\n{}");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+}
+#endif
+
+
+#if PUBNUB_INBOX_SIZE == 0
+Ensure(single_context_pubnub, subscribe_wildcard) {
+    pubnub_init(pbp, "pubkey", "timok");
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "devices.*,alarm"), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/timok/devices.*,alarm/0/0?&pnsdk=PubNub-Contiki-%2F1.1");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 82\r\n\r\n[[\"on\",\"off\",1],\"17\",\"devices.*,devices.*,alarm\",\"devices.lamp,devices.fan,alarm\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+
+    attest(pubnub_get(pbp), streqs("\"on\""));
+    attest(pubnub_get_channel(pbp), streqs("devices.lamp"));
+    attest(pubnub_get_subscription(pbp), streqs("devices.*"));
+    attest(pubnub_get(pbp), streqs("\"off\""));
+    attest(pubnub_get_channel(pbp), streqs("devices.fan"));
+    attest(pubnub_get_subscription(pbp), streqs("devices.*"));
+    attest(pubnub_get(pbp), streqs("1"));
+    attest(pubnub_get_channel(pbp), streqs("alarm"));
+    attest(pubnub_get_subscription(pbp), streqs("alarm"));
+    attest(pubnub_get(pbp), equals(NULL));
+    attest(pubnub_get_channel(pbp), equals(NULL));
+
+    /* The time token is kept */
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "devices.*,alarm"), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/timok/devices.*,alarm/0/17?&pnsdk=PubNub-Contiki-%2F1.1");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 8\r\n\r\n[[],\"0\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+}
+#endif
+
+
+Ensure(single_context_pubnub, subscribe_filter_expr) {
+    pubnub_init(pbp, "pubkey", "timok");
+    pubnub_set_filter_expr(pbp, "region == 'eu' && temp > 20");
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "senzori"), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/timok/senzori/0/0?&pnsdk=PubNub-Contiki-%2F1.1&filter-expr=region%20==%20%27eu%27%20%26%26%20temp%20%3E%2020");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 8\r\n\r\n[[],\"0\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+
+    pubnub_set_filter_expr(pbp, NULL);
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "senzori"), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/timok/senzori/0/0?&pnsdk=PubNub-Contiki-%2F1.1");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 8\r\n\r\n[[],\"0\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+}
+
+
+Ensure(single_context_pubnub, time_seeds_subscribe) {
+    clock_time_t at;
+    pubnub_init(pbp, "pubkey", "timok");
+    attest(pubnub_get_time(pbp, NULL), equals(NULL));
+
+    m_clock = 100;
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_time(pbp), equals(PNR_STARTED));
+    attest(pubnub_set_timetoken(pbp, "1"), equals(PNR_IN_PROGRESS));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/time/0");
+    incoming("");
+    m_clock = 110;
+    expect_event(pubnub_time_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 19\r\n\r\n[14178940800777403]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+    attest(pubnub_get_time(pbp, &at), streqs("14178940800777403"));
+    attest(at, equals(105));
+
+    attest(pubnub_set_timetoken(pbp, "x1"), equals(PNR_FORMAT_ERROR));
+    attest(pubnub_set_timetoken(pbp, pubnub_get_time(pbp, NULL)), equals(PNR_OK));
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "k"), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/timok/k/0/14178940800777403?&pnsdk=PubNub-Contiki-%2F1.1");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 8\r\n\r\n[[],\"0\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+
+    /* Bad response */
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_time(pbp), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/time/0");
+    expect_event(pubnub_time_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 2\r\n\r\n[]");
+    attest(pubnub_last_result(pbp), equals(PNR_FORMAT_ERROR));
+    attest(pubnub_get_time(pbp, NULL), equals(NULL));
+    m_clock = 0;
+}
+
+
+Ensure(single_context_pubnub, history_paged) {
+    struct pubnub_history_options opts = pubnub_history_defopts();
+    char const *start;
+    char const *end;
+    pubnub_init(pbp, "pubkey", "timok");
+
+    opts.count = 3;
+    opts.start = "14178940800777400";
+    opts.reverse = true;
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_history(pbp, "arhiva", &opts), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/v2/history/sub-key/timok/channel/arhiva?count=3&start=14178940800777400&reverse=true");
+    expect_event(pubnub_history_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 51\r\n\r\n[[1,\"dva\",[3]],14178940800777403,14178940800777405]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+
+    pubnub_history_range(pbp, &start, &end);
+    attest(start, streqs("14178940800777403"));
+    attest(end, streqs("14178940800777405"));
+#if PUBNUB_REPLY_BUFFERS == 1
+    attest(pubnub_history(pbp, "arhiva", &opts), equals(PNR_RX_BUFF_NOT_EMPTY));
+#endif
+    attest(pubnub_get(pbp), streqs("1"));
+    attest(pubnub_get(pbp), streqs("\"dva\""));
+    attest(pubnub_get(pbp), streqs("[3]"));
+    attest(pubnub_get(pbp), equals(NULL));
+    attest(pubnub_get_channel(pbp), equals(NULL));
+
+    /* Next page */
+    opts.start = end;
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_history(pbp, "arhiva", &opts), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/v2/history/sub-key/timok/channel/arhiva?count=3&start=14178940800777405&reverse=true");
+    expect_event(pubnub_history_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 8\r\n\r\n[[],0,0]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+    attest(pubnub_get(pbp), equals(NULL));
+    attest(pubnub_last_time_token(pbp), streqs("0"));
+
+    /* Bad response */
+    opts.start = "14178940800777405";
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_history(pbp, "arhiva", &opts), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/v2/history/sub-key/timok/channel/arhiva?count=3&start=14178940800777405&reverse=true");
+    expect_event(pubnub_history_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 10\r\n\r\n[[1],x,10]");
+    attest(pubnub_last_result(pbp), equals(PNR_FORMAT_ERROR));
+    pubnub_history_range(pbp, &start, NULL);
+    attest(start, streqs("0"));
+}
+
+
+static void subscribe_with_outcome(char const *reply)
+{
+    static char url[64];
+    snprintf(url, sizeof url, "/subscribe/timok/k/0/%s?&pnsdk=PubNub-Contiki-%%2F1.1", pubnub_last_time_token(pbp));
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "k"), equals(PNR_STARTED));
+
+    expect_event(pubnub_subscribe_event);
+    if (NULL == reply) {
+        uip_flags = UIP_TIMEDOUT;
+        incoming("");
+    }
+    else {
+        uip_flags = UIP_CONNECTED;
+        expect_outgoing_with_url(url);
+        incoming_and_close(reply);
+    }
+}
+
+
+Ensure(single_context_pubnub, subscribe_catchup_policy) {
+    struct pubnub_catchup_stats stats;
+    pubnub_init(pbp, "pubkey", "timok");
+    pubnub_set_catchup(pbp, 2, 0);
+
+    subscribe_with_outcome("HTTP/1.1 200\r\nContent-Length: 8\r\n\r\n[[],\"5\"]");
+    attest(pubnub_last_time_token(pbp), streqs("5"));
+
+    /* Two errors in a row are caught up on, but not three */
+    subscribe_with_outcome(NULL);
+    attest(pubnub_last_result(pbp), equals(PNR_TIMEOUT));
+    attest(pubnub_last_time_token(pbp), streqs("5"));
+    subscribe_with_outcome(NULL);
+    attest(pubnub_last_time_token(pbp), streqs("5"));
+    subscribe_with_outcome(NULL);
+    attest(pubnub_last_time_token(pbp), streqs("0"));
+    pubnub_get_catchup_stats(pbp, &stats);
+    attest(stats.catchups, equals(2));
+    attest(stats.resets, equals(1));
+
+    /* Success starts the count over */
+    subscribe_with_outcome("HTTP/1.1 200\r\nContent-Length: 8\r\n\r\n[[],\"6\"]");
+    subscribe_with_outcome(NULL);
+    subscribe_with_outcome("HTTP/1.1 200\r\nContent-Length: 8\r\n\r\n[[],\"7\"]");
+    subscribe_with_outcome(NULL);
+    subscribe_with_outcome(NULL);
+    attest(pubnub_last_time_token(pbp), streqs("7"));
+
+    /* Invalid response always resets */
+    subscribe_with_outcome("HTTP/1.1 200\r\nContent-Length: 8\r\n\r\n[[],\"8\"]");
+    subscribe_with_outcome("HTTP/1.1 200\r\nContent-Length: 2\r\n\r\n[]");
+    attest(pubnub_last_result(pbp), equals(PNR_FORMAT_ERROR));
+    attest(pubnub_last_time_token(pbp), streqs("0"));
+
+    /* Too old an outage is not caught up on */
+    pubnub_set_catchup(pbp, 5, 10);
+    subscribe_with_outcome("HTTP/1.1 200\r\nContent-Length: 8\r\n\r\n[[],\"9\"]");
+    m_clock = 100;
+    subscribe_with_outcome(NULL);
+    m_clock = 109;
+    subscribe_with_outcome(NULL);
+    attest(pubnub_last_time_token(pbp), streqs("9"));
+    m_clock = 110;
+    subscribe_with_outcome(NULL);
+    attest(pubnub_last_time_token(pbp), streqs("0"));
+    pubnub_get_catchup_stats(pbp, &stats);
+    attest(stats.catchups, equals(2));
+    attest(stats.resets, equals(1));
+    m_clock = 0;
+}
+
+
+#if PUBNUB_PERSIST
+Ensure(single_context_pubnub, subscribe_state_persisted) {
+    m_cfs_format();
+    m_clock = 1000;
+    pubnub_init(pbp, "pubkey", "timok");
+    attest(pubnub_last_time_token(pbp), streqs("0"));
+
+    subscribe_with_outcome("HTTP/1.1 200\r\nContent-Length: 8\r\n\r\n[[],\"5\"]");
+    attest(m_cfs_writes, equals(1));
+
+    /* Saves are rate limited */
+    subscribe_with_outcome("HTTP/1.1 200\r\nContent-Length: 8\r\n\r\n[[],\"6\"]");
+    attest(m_cfs_writes, equals(1));
+    m_clock += PUBNUB_PERSIST_PERIOD;
+    subscribe_with_outcome("HTTP/1.1 200\r\nContent-Length: 8\r\n\r\n[[],\"7\"]");
+    attest(m_cfs_writes, equals(2));
+
+    /* "Reboot" */
+    pubnub_init(pbp, "pubkey", "timok");
+    attest(pubnub_last_time_token(pbp), streqs("7"));
+
+    /* Not restored for another subscribe key */
+    pubnub_init(pbp, "pubkey", "drugi");
+    attest(pubnub_last_time_token(pbp), streqs("0"));
+
+    /* Leave is saved right away */
+    pubnub_init(pbp, "pubkey", "timok");
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_leave(pbp, "k"), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/v2/presence/sub-key/timok/channel/k/leave?");
+    expect_event(pubnub_leave_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 2\r\n\r\n[]");
+    attest(m_cfs_writes, equals(3));
+    pubnub_init(pbp, "pubkey", "timok");
+    attest(pubnub_last_time_token(pbp), streqs("0"));
+    m_clock = 0;
+
+#if PUBNUB_CHANNEL_SET_MAXLEN > 0
+    /* A channel set that doesn't fit is not restored */
+    {
+        struct m_cfs_file *f = m_cfs_find("pubnub0");
+        attest(f, differs(NULL));
+        attest(6 + 2 + PUBNUB_CHANNEL_SET_MAXLEN + 1 <= sizeof f->data);
+        memcpy(f->data, "timok\0" "8\0", 8);
+        memset(f->data + 8, 'a', PUBNUB_CHANNEL_SET_MAXLEN);
+        f->data[8 + PUBNUB_CHANNEL_SET_MAXLEN] = '\0';
+        f->len = 8 + PUBNUB_CHANNEL_SET_MAXLEN + 1;
+        pubnub_init(pbp, "pubkey", "timok");
+        attest(pubnub_last_time_token(pbp), streqs("8"));
+        attest(pubnub_subscribe(pbp, NULL), equals(PNR_INVALID_CHANNEL));
+    }
+#endif
+}
+#endif
+
+
+#if PUBNUB_SPOOL_SEGMENT > 0
+Ensure(single_context_pubnub, publish_spooled) {
+    struct pubnub_spool_stats stats;
+    static char big[PUBNUB_SPOOL_SEGMENT];
+    unsigned per_segment = (PUBNUB_SPOOL_SEGMENT - 2) / 7;
+    unsigned i;
+
+    m_cfs_format();
+    pubnub_init(pbp, "publkey", "subkey");
+    memset(big, 'x', sizeof big - 1);
+    attest(pubnub_spool(pbp, "ch", big), equals(PNR_TX_BUFF_TOO_SMALL));
+
+    /* Spooled while the network is down, publishing it fails */
+    expect(process_poll, when(p, equals(&pubnub_process)));
+    attest(pubnub_spool(pbp, "ch", "1"), equals(PNR_OK));
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_process.thread(&pubnub_process.pt, PROCESS_EVENT_POLL, NULL), equals(PT_YIELDED));
+    uip_flags = UIP_TIMEDOUT;
+    incoming("");
+    attest(pubnub_process.thread(&pubnub_process.pt, PROCESS_EVENT_POLL, NULL), equals(PT_YIELDED));
+
+    /* The next one tries again, in order, without events */
+    expect(process_poll, when(p, equals(&pubnub_process)));
+    attest(pubnub_spool(pbp, "ch", "22"), equals(PNR_OK));
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_process.thread(&pubnub_process.pt, PROCESS_EVENT_POLL, NULL), equals(PT_YIELDED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/ch/0/1");
+    expect(process_poll, when(p, equals(&pubnub_process)));
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777403\"]");
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_process.thread(&pubnub_process.pt, PROCESS_EVENT_POLL, NULL), equals(PT_YIELDED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/ch/0/22");
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777404\"]");
+
+    /* Drained segments are erased */
+    attest(m_cfs_find("pubnub0q1"), equals(NULL));
+
+    /* Rejected by the server, so dropped */
+    expect(process_poll, when(p, equals(&pubnub_process)));
+    attest(pubnub_spool(pbp, "ch", "x"), equals(PNR_OK));
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_process.thread(&pubnub_process.pt, PROCESS_EVENT_POLL, NULL), equals(PT_YIELDED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/ch/0/x");
+    incoming_and_close("HTTP/1.1 400\r\nContent-Length: 2\r\n\r\n[]");
+
+    pubnub_get_spool_stats(pbp, &stats);
+    attest(stats.queued, equals(16));
+    attest(stats.drained, equals(11));
+    attest(stats.dropped, equals(5));
+    attest(stats.pending, equals(0));
+
+    /* Picked up after a reboot, packed if coalescing */
+    expect(process_poll, when(p, equals(&pubnub_process)));
+    attest(pubnub_spool(pbp, "a", "1"), equals(PNR_OK));
+    expect(process_poll, when(p, equals(&pubnub_process)));
+    attest(pubnub_spool(pbp, "a", "2"), equals(PNR_OK));
+    expect(process_poll, when(p, equals(&pubnub_process)));
+    attest(pubnub_spool(pbp, "b", "3"), equals(PNR_OK));
+
+    pubnub_init(pbp, "publkey", "subkey");
+    pubnub_set_coalesce(pbp, 5, 8);
+    pubnub_get_spool_stats(pbp, &stats);
+    attest(stats.pending, equals(12));
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_process.thread(&pubnub_process.pt, PROCESS_EVENT_POLL, NULL), equals(PT_YIELDED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/a/0/[1,2]");
+    expect(process_poll, when(p, equals(&pubnub_process)));
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777405\"]");
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_process.thread(&pubnub_process.pt, PROCESS_EVENT_POLL, NULL), equals(PT_YIELDED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/publish/publkey/subkey/0/b/0/[3]");
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 30\r\n\r\n[1,\"Sent\",\"14178940800777406\"]");
+    pubnub_get_spool_stats(pbp, &stats);
+    attest(stats.drained, equals(12));
+    attest(stats.pending, equals(0));
+
+    /* When full, the oldest segment is dropped */
+    for (i = 0; i <= per_segment * PUBNUB_SPOOL_SEGMENTS; ++i) {
+        expect(process_poll, when(p, equals(&pubnub_process)));
+        attest(pubnub_spool(pbp, "ch", "333"), equals(PNR_OK));
+    }
+    pubnub_get_spool_stats(pbp, &stats);
+    attest(stats.dropped, equals(7 * per_segment));
+    attest(stats.pending, equals(7 * (per_segment * (PUBNUB_SPOOL_SEGMENTS - 1) + 1)));
+}
+#endif
+
+
 Ensure(single_context_pubnub, subscribe_while_busy_fails) {
     pubnub_init(pbp, "pubkey", "subkey");
 
@@ -679,6 +2429,7 @@ Ensure(single_context_pubnub, subscribe_while_busy_fails) {
 }
 
 
+#if PUBNUB_INBOX_SIZE == 0
 Ensure(single_context_pubnub, subscribe_corner_cases) {
     pubnub_init(pbp, "publkey", "timok");
 
@@ -754,6 +2505,7 @@ Ensure(single_context_pubnub, subscribe_corner_cases) {
 #undef PACKETS
 #undef MAX_USEFUL
 }
+#endif
 
 
 Ensure(single_context_pubnub, subscribe_bad_responses) {
@@ -1062,6 +2814,7 @@ Ensure(single_context_pubnub, cancel_on_idle) {
 }
 
 
+#if PUBNUB_INBOX_SIZE == 0
 Ensure(single_context_pubnub, cant_subscribe_until_messages_read) {
     pubnub_init(pbp, "sitnica", "tura");
 
@@ -1078,21 +2831,116 @@ Ensure(single_context_pubnub, cant_subscribe_until_messages_read) {
     attest(pubnub_last_http_code(pbp), equals(200));
     attest(pubnub_get_channel(pbp), equals(NULL));
 
+#if PUBNUB_REPLY_BUFFERS > 1
+    /* Next reply goes to the other buffer */
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "dvapodva"), equals(PNR_STARTED));
+
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/tura/dvapodva/0/14179836755957292?&pnsdk=PubNub-Contiki-%2F1.1");
+    expect_event(pubnub_subscribe_event);
+    incoming_and_close("HTTP/1.1 200\r\nContent-Length: 39\r\n\r\n[[\"Wi\"],\"14179836755957293\",\"dvapodva\"]");
+    attest(pubnub_last_result(pbp), equals(PNR_OK));
+
+    /* ...and both are full, so nothing else can get a reply either */
+    attest(pubnub_subscribe(pbp, "x"), equals(PNR_RX_BUFF_NOT_EMPTY));
+    attest(pubnub_publish(pbp, "x", "1"), equals(PNR_RX_BUFF_NOT_EMPTY));
+    attest(pubnub_time(pbp), equals(PNR_RX_BUFF_NOT_EMPTY));
+    attest(pubnub_leave(pbp, "x"), equals(PNR_RX_BUFF_NOT_EMPTY));
+    attest(pubnub_add_channels_to_group(pbp, "x", "g"), equals(PNR_RX_BUFF_NOT_EMPTY));
+    attest(pubnub_publish_begin(pbp, "x"), equals(PNR_RX_BUFF_NOT_EMPTY));
+    attest(pubnub_get(pbp), streqs("\"Hi\""));
+    attest(pubnub_get(pbp), streqs("\"Fi\""));
+    attest(pubnub_get(pbp), streqs("\"Wi\""));
+    attest(pubnub_get_channel(pbp), streqs("dvapodva"));
+    attest(pubnub_get(pbp), equals(NULL));
+
+    expect_cached_dns_for_pubnub_origin();
+    attest(pubnub_subscribe(pbp, "x"), equals(PNR_STARTED));
+    uip_flags = UIP_CONNECTED;
+    expect_outgoing_with_url("/subscribe/tura/x/0/14179836755957293?&pnsdk=PubNub-Contiki-%2F1.1");
+    incoming("");
+#else
     attest(pubnub_subscribe(pbp, "x"), equals(PNR_RX_BUFF_NOT_EMPTY));
+#endif
 }
+#endif
 
 
 Ensure(single_context_pubnub, illegal_context_fires_assert) {
     expect_assert_in(pubnub_init(NULL, "k", "u"), "pubnub.c");
     expect_assert_in(pubnub_publish(NULL, "x", "0"), "pubnub.c");
+    expect_assert_in(pubnub_publish_queued(NULL, NULL, "x", "0", 0, 0), "pubnub.c");
+    expect_assert_in(pubnub_publish_multi(NULL, NULL, 1, "0"), "pubnub.c");
+    expect_assert_in(pubnub_last_publish_multi(NULL), "pubnub.c");
+    expect_assert_in(pubnub_last_publish_timetoken(NULL), "pubnub.c");
+    expect_assert_in(pubnub_last_publish_result(NULL), "pubnub.c");
+    expect_assert_in(pubnub_set_coalesce(NULL, 0, 0), "pubnub.c");
+    expect_assert_in(pubnub_set_unpack(NULL, true), "pubnub.c");
+    expect_assert_in(pubnub_set_seq_stamp(NULL, true), "pubnub.c");
+#if PUBNUB_SEQ_SOURCES > 0
+    expect_assert_in(pubnub_set_seq_tracking(NULL, true, NULL, NULL), "pubnub.c");
+    expect_assert_in(pubnub_get_seq_stats(NULL, NULL), "pubnub.c");
+#endif
+#if PUBNUB_DEDUP_SIZE > 0
+    expect_assert_in(pubnub_dedup_count(NULL), "pubnub.c");
+#endif
+    expect_assert_in(pubnub_set_rate_limit(NULL, 1, 1), "pubnub.c");
+    expect_assert_in(pubnub_set_retry(NULL, 1, 1, 1, 0), "pubnub.c");
+    expect_assert_in(pubnub_last_attempts(NULL), "pubnub.c");
+    expect_assert_in(pubnub_set_catchup(NULL, 1, 0), "pubnub.c");
+    expect_assert_in(pubnub_get_catchup_stats(NULL, NULL), "pubnub.c");
     expect_assert_in(pubnub_subscribe(NULL, "x"), "pubnub.c");
+    expect_assert_in(pubnub_subscribe_continuous(NULL, "x", rcv_cb, NULL), "pubnub.c");
+#if PUBNUB_CHANNEL_SET_MAXLEN > 0
+    expect_assert_in(pubnub_add_channel(NULL, "x"), "pubnub.c");
+    expect_assert_in(pubnub_remove_channel(NULL, "x"), "pubnub.c");
+#endif
+#if PUBNUB_DEMUX_SIZE > 0
+    expect_assert_in(pubnub_set_handler(NULL, "x", NULL, NULL), "pubnub.c");
+#endif
+#if PUBNUB_SPOOL_SEGMENT > 0
+    expect_assert_in(pubnub_spool(NULL, "x", "0"), "pubnub.c");
+    expect_assert_in(pubnub_get_spool_stats(NULL, NULL), "pubnub.c");
+#endif
+#if PUBNUB_INBOX_SIZE > 0
+    expect_assert_in(pubnub_inbox_peek(NULL, NULL), "pubnub.c");
+    expect_assert_in(pubnub_inbox_pop(NULL), "pubnub.c");
+    expect_assert_in(pubnub_set_inbox_policy(NULL, PNIP_DROP_NEWEST), "pubnub.c");
+    expect_assert_in(pubnub_get_inbox_stats(NULL, NULL), "pubnub.c");
+#endif
     expect_assert_in(pubnub_leave(NULL, "x"), "pubnub.c");
+    expect_assert_in(pubnub_time(NULL), "pubnub.c");
+    expect_assert_in(pubnub_last_time_token(NULL), "pubnub.c");
+    expect_assert_in(pubnub_history(NULL, "x", NULL), "pubnub.c");
+    expect_assert_in(pubnub_history_range(NULL, NULL, NULL), "pubnub.c");
+    expect_assert_in(pubnub_get_time(NULL, NULL), "pubnub.c");
+    expect_assert_in(pubnub_set_timetoken(NULL, "1"), "pubnub.c");
     expect_assert_in(pubnub_cancel(NULL), "pubnub.c");
     expect_assert_in(pubnub_done(NULL), "pubnub.c");
     expect_assert_in(pubnub_set_uuid(NULL, ""), "pubnub.c");
     expect_assert_in(pubnub_set_auth(NULL, ""), "pubnub.c");
+    expect_assert_in(pubnub_set_channel_group(NULL, ""), "pubnub.c");
+    expect_assert_in(pubnub_set_filter_expr(NULL, ""), "pubnub.c");
+    expect_assert_in(pubnub_publish_meta(NULL, "x", "0", NULL), "pubnub.c");
+    expect_assert_in(pubnub_publish_ex(NULL, "x", "0", NULL), "pubnub.c");
+    expect_assert_in(pubnub_add_channels_to_group(NULL, "x", "g"), "pubnub.c");
+    expect_assert_in(pubnub_remove_channels_from_group(NULL, "x", "g"), "pubnub.c");
+    expect_assert_in(pubnub_get_subscription(NULL), "pubnub.c");
     expect_assert_in(pubnub_last_result(NULL), "pubnub.c");
     expect_assert_in(pubnub_last_http_code(NULL), "pubnub.c");
+    expect_assert_in(pubnub_publish_begin(NULL, "x"), "pubnub.c");
+    expect_assert_in(pubnub_msg_begin_object(NULL), "pubnub.c");
+    expect_assert_in(pubnub_msg_begin_array(NULL), "pubnub.c");
+    expect_assert_in(pubnub_msg_end(NULL), "pubnub.c");
+    expect_assert_in(pubnub_msg_key(NULL, "k"), "pubnub.c");
+    expect_assert_in(pubnub_msg_int(NULL, 0), "pubnub.c");
+    expect_assert_in(pubnub_msg_fixed(NULL, 0, 1), "pubnub.c");
+    expect_assert_in(pubnub_msg_string(NULL, ""), "pubnub.c");
+    expect_assert_in(pubnub_msg_raw(NULL, "0"), "pubnub.c");
+    expect_assert_in(pubnub_msg_binary(NULL, "", 0, PNBE_BASE64), "pubnub.c");
+    expect_assert_in(pubnub_publish_binary(NULL, "x", "", 0, PNBE_BASE85), "pubnub.c");
+    expect_assert_in(pubnub_publish_end(NULL, NULL), "pubnub.c");
     expect_assert_in(pubnub_get(NULL), "pubnub.c");
     expect_assert_in(pubnub_get_channel(NULL), "pubnub.c");
 
@@ -55,6 +55,10 @@ static char const* pubnub_res_2_string(enum pubnub_res e)
     case PNR_IN_PROGRESS: return "Pubnub API transaction already in progress";
     case PNR_RX_BUFF_NOT_EMPTY: return "Rx buffer not empty";
     case PNR_TX_BUFF_TOO_SMALL:  return "Tx buffer too small for sending/publishing the message";
+    case PNR_EXPIRED: return "Queued publish expired before it was sent";
+    case PNR_RATE_LIMITED: return "Publish rejected by the rate limiter";
+    case PNR_INVALID_CHANNEL: return "Nothing to subscribe to (no channels nor channel group)";
+    case PNR_PUBLISH_FAILED: return "Publish failed on the server";
     default: return "!?!?!";
     }
 }
@@ -3,6 +3,7 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 
 void pbcc_init(struct pbcc_context *p, const char *publish_key, const char *subscribe_key)
@@ -11,15 +12,136 @@ void pbcc_init(struct pbcc_context *p, const char *publish_key, const char *subs
     p->subscribe_key = subscribe_key;
     p->timetoken[0] = '0';
     p->timetoken[1] = '\0';
-    p->uuid = p->auth = NULL;
+    p->uuid = p->auth = p->channel_group = p->filter_expr = NULL;
+    p->publish_timetoken[0] = '\0';
+    p->publish_desc = "";
+    p->server_time[0] = '\0';
+    p->history_start[0] = p->history_end[0] = '\0';
     p->msg_ofs = p->msg_end = 0;
+    p->unpack_ofs = p->unpack_end = 0;
+    p->chan_repeat = p->unpack = false;
+    p->ungot_msg = NULL;
+    p->chan_ungot = false;
+    p->msg_buf = p->reply_buf[0];
+    p->http_reply = p->reply_buf[PUBNUB_REPLY_BUFFERS-1];
+#if PUBNUB_REPLY_BUFFERS > 1
+    p->reply_pending = false;
+#endif
+#if PUBNUB_DEDUP_SIZE > 0
+    p->dedup_next = p->dedup_n = 0;
+    p->dedup_count = 0;
+#endif
+#if PUBNUB_SEQ_SOURCES > 0
+    p->seq_track = false;
+    p->seq_n = 0;
+    memset(&p->seq_stats, 0, sizeof p->seq_stats);
+    p->seq_cb = NULL;
+#endif
+#if PUBNUB_INBOX_SIZE > 0
+    p->inbox_head = p->inbox_tail = p->inbox_wrap = p->inbox_count = 0;
+    p->inbox_drop_oldest = true;
+    p->inbox_received = p->inbox_dropped = 0;
+#endif
 }
 
 
-char const *pbcc_get_msg(struct pbcc_context *pb)
+static bool split_array(char *buf);
+
+
+/** Switches to reading the messages of the reply just received, with
+    the @p lists found in it, and receiving the next one in the other
+    buffer (if there is one).
+*/
+static void reply_switch(struct pbcc_context *p, struct pbcc_reply_lists const *lists)
 {
+    char *rcvd = p->http_reply;
+    
+    p->http_reply = p->msg_buf;
+    p->msg_buf = rcvd;
+    p->msg_ofs = 2;
+    p->msg_end = lists->msg_end;
+    p->chan_ofs = lists->chan_ofs;
+    p->chan_end = lists->chan_end;
+    p->sub_ofs = lists->sub_ofs;
+    p->sub_end = lists->sub_end;
+    p->unpack_ofs = p->unpack_end = 0;
+    p->chan_prev_ofs = p->sub_prev_ofs = 0;
+    p->chan_repeat = false;
+}
+
+
+/** Makes the messages of the reply just received (and parsed), with
+    the @p lists found in it, available to be read. With more than
+    one reply buffer, they may have to wait for the messages of the
+    previous reply to be read.
+    @return true: available right away, false: waiting
+*/
+static bool reply_deliver(struct pbcc_context *p, struct pbcc_reply_lists const *lists)
+{
+#if PUBNUB_REPLY_BUFFERS > 1
+    if (pbcc_msgs_left(p)) {
+        /* Keep it until the messages of the last reply are read */
+        p->pend = *lists;
+        p->reply_pending = true;
+        return false;
+    }
+#endif
+    /* Set up the message list - offset and length. */
+    reply_switch(p, lists);
+    return true;
+}
+
+
+/** Checks that a transaction whose reply has messages can be
+    started, that is, that there is a buffer to receive them in.
+*/
+static enum pubnub_res reply_prep(struct pbcc_context *p)
+{
+#if PUBNUB_REPLY_BUFFERS > 1
+    if (p->reply_pending) {
+        return PNR_RX_BUFF_NOT_EMPTY;
+    }
+#else
+    if (pbcc_msgs_left(p)) {
+        return PNR_RX_BUFF_NOT_EMPTY;
+    }
+    p->msg_ofs = p->msg_end = 0;
+#endif
+    return PNR_STARTED;
+}
+
+
+/** Checks that a transaction whose reply has no messages can be
+    started, that is, that its reply won't be received over one that
+    waits for the messages of the previous reply to be read. With one
+    buffer, there is no such wait.
+*/
+static enum pubnub_res reply_check(struct pbcc_context const *p)
+{
+#if PUBNUB_REPLY_BUFFERS > 1
+    if (p->reply_pending) {
+        return PNR_RX_BUFF_NOT_EMPTY;
+    }
+#else
+    (void)p;
+#endif
+    return PNR_STARTED;
+}
+
+
+/** Returns the next message from the message list, not looking into
+    packed (coalesced) arrays.
+*/
+static char *next_msg(struct pbcc_context *pb)
+{
+#if PUBNUB_REPLY_BUFFERS > 1
+    if ((pb->msg_ofs >= pb->msg_end) && pb->reply_pending) {
+        reply_switch(pb, &pb->pend);
+        pb->reply_pending = false;
+    }
+#endif
     if (pb->msg_ofs < pb->msg_end) {
-        char const *rslt = pb->http_reply + pb->msg_ofs;
+        char *rslt = pb->msg_buf + pb->msg_ofs;
         pb->msg_ofs += strlen(rslt);
         if (pb->msg_ofs++ <= pb->msg_end) {
             return rslt;
@@ -30,11 +152,241 @@ char const *pbcc_get_msg(struct pbcc_context *pb)
 }
 
 
+/** Returns the next message, looking into packed arrays if
+    unpacking is on, but not checking for duplicates.
+*/
+static char *get_msg(struct pbcc_context *pb)
+{
+    char *rslt;
+
+    if (pb->unpack_ofs < pb->unpack_end) {
+        /* Next element of a packed array has the same channel */
+        pb->chan_repeat = true;
+    }
+    while (pb->unpack_ofs >= pb->unpack_end) {
+        size_t len;
+        rslt = next_msg(pb);
+        if ((NULL == rslt) || !pb->unpack || (rslt[0] != '[')) {
+            return rslt;
+        }
+        /* Split the packed array in place, yielding its elements */
+        len = strlen(rslt);
+        rslt[len-1] = '\0';
+        split_array(rslt + 1);
+        pb->unpack_ofs = rslt + 1 - pb->msg_buf;
+        pb->unpack_end = rslt + len-1 - pb->msg_buf;
+    }
+    rslt = pb->msg_buf + pb->unpack_ofs;
+    pb->unpack_ofs += strlen(rslt) + 1;
+    
+    return rslt;
+}
+
+
+#if (PUBNUB_DEDUP_SIZE > 0) || (PUBNUB_SEQ_SOURCES > 0)
+/** FNV-1a hash of string @p s, continuing from hash @p h, including
+    the terminating NUL */
+static uint32_t hash_str(uint32_t h, char const *s)
+{
+    do {
+        h = (h ^ (unsigned char)*s) * 16777619UL;
+    } while (*s++ != '\0');
+    return h;
+}
+#endif
+
+
+#if PUBNUB_DEDUP_SIZE > 0
+/** Returns the channel of the message last returned by get_msg(),
+    without moving on to the next one, as pbcc_get_channel() does.
+*/
+static char const *peek_channel(struct pbcc_context const *pb)
+{
+    if (pb->chan_repeat && (pb->chan_prev_ofs != 0)) {
+        return pb->msg_buf + pb->chan_prev_ofs;
+    }
+    if (pb->chan_ofs < pb->chan_end) {
+        return pb->msg_buf + pb->chan_ofs;
+    }
+    return "";
+}
+
+
+/** Returns whether the @p message from @p channel is among the last
+    received messages. If it is not, it is remembered, in place of the
+    oldest one.
+*/
+static bool dedup_seen(struct pbcc_context *pb, char const *channel, char const *message)
+{
+    uint32_t h = hash_str(hash_str(2166136261UL, channel), message);
+    unsigned i;
+
+    for (i = 0; i < pb->dedup_n; ++i) {
+        if (pb->dedup[i] == h) {
+            return true;
+        }
+    }
+    pb->dedup[pb->dedup_next] = h;
+    pb->dedup_next = (pb->dedup_next + 1) % PUBNUB_DEDUP_SIZE;
+    if (pb->dedup_n < PUBNUB_DEDUP_SIZE) {
+        ++pb->dedup_n;
+    }
+    return false;
+}
+#endif
+
+
+#if PUBNUB_SEQ_SOURCES > 0
+/** Tracks the sequence number @p seq of a message from the @p
+    publisher, counting and reporting anomalies.
+*/
+static void seq_track(struct pbcc_context *pb, char const *publisher, uint32_t seq)
+{
+    uint32_t h = hash_str(2166136261UL, publisher);
+    struct pbcc_seq_source src = { h, seq + 1 };
+    enum pubnub_seq_event ev;
+    unsigned i;
+
+    ++pb->seq_stats.received;
+    for (i = 0; (i < pb->seq_n) && (pb->seq_src[i].publisher != h); ++i) {
+        continue;
+    }
+    if (i == pb->seq_n) {
+        /* New publisher, forget the least recent one if full */
+        if (pb->seq_n < PUBNUB_SEQ_SOURCES) {
+            ++pb->seq_n;
+        }
+        i = pb->seq_n - 1;
+    }
+    else if ((seq != 0) && (seq != pb->seq_src[i].next)) {
+        uint32_t expected = pb->seq_src[i].next;
+        if (seq > expected) {
+            ev = PNSE_GAP;
+            pb->seq_stats.lost += seq - expected;
+        }
+        else if (seq + 1 == expected) {
+            ev = PNSE_DUPLICATE;
+            ++pb->seq_stats.duplicates;
+        }
+        else {
+            ev = PNSE_REORDER;
+            ++pb->seq_stats.reordered;
+        }
+        if (ev != PNSE_GAP) {
+            /* Still expecting the same */
+            src.next = expected;
+        }
+        if (pb->seq_cb != NULL) {
+            pb->seq_cb(pb->seq_pb, publisher, ev, expected, seq, pb->seq_data);
+        }
+    }
+    /* Move it to the front */
+    memmove(pb->seq_src + 1, pb->seq_src, i * sizeof pb->seq_src[0]);
+    pb->seq_src[0] = src;
+}
+
+
+/** If the message @p msg is stamped with a sequence number, like
+    `{"q":5,"u":"uuid","m":<message>}`, tracks the sequence number and
+    returns the message, unwrapped in place. Otherwise, returns @p
+    msg.
+*/
+static char *seq_unwrap(struct pbcc_context *pb, char *msg)
+{
+    static char const mark[] = "\",\"m\":";
+    char *end;
+    char *publisher;
+    char *publisher_end;
+    unsigned long seq;
+    size_t len;
+
+    if (strncmp(msg, "{\"q\":", 5) != 0) {
+        return msg;
+    }
+    seq = strtoul(msg + 5, &end, 10);
+    if ((end == msg + 5) || (strncmp(end, ",\"u\":\"", 6) != 0)) {
+        return msg;
+    }
+    publisher = end + 6;
+    publisher_end = strchr(publisher, '"');
+    len = strlen(msg);
+    if ((NULL == publisher_end) || (strncmp(publisher_end, mark, sizeof mark - 1) != 0) || (msg[len - 1] != '}')) {
+        return msg;
+    }
+    *publisher_end = '\0';
+    msg[len - 1] = '\0';
+    seq_track(pb, publisher, seq);
+    
+    return publisher_end + sizeof mark - 1;
+}
+#endif
+
+
+bool pbcc_msgs_left(struct pbcc_context const *pb)
+{
+    return (pb->msg_ofs < pb->msg_end) || (pb->unpack_ofs < pb->unpack_end) || (pb->ungot_msg != NULL);
+}
+
+
+void pbcc_unget_msg(struct pbcc_context *pb, char const *msg, char const *channel)
+{
+    pb->ungot_msg = msg;
+    pb->ungot_chan = channel;
+    pb->chan_ungot = false;
+}
+
+
+char const *pbcc_get_msg(struct pbcc_context *pb)
+{
+    char *rslt;
+
+    if (pb->ungot_msg != NULL) {
+        char const *msg = pb->ungot_msg;
+        pb->ungot_msg = NULL;
+        pb->chan_ungot = true;
+        return msg;
+    }
+    while ((rslt = get_msg(pb)) != NULL) {
+#if PUBNUB_DEDUP_SIZE > 0
+        if (dedup_seen(pb, peek_channel(pb), rslt)) {
+            ++pb->dedup_count;
+            /* Skip its channel, too */
+            pbcc_get_channel(pb);
+            continue;
+        }
+#endif
+        break;
+    }
+#if PUBNUB_SEQ_SOURCES > 0
+    if ((rslt != NULL) && pb->seq_track) {
+        rslt = seq_unwrap(pb, rslt);
+    }
+#endif
+    return rslt;
+}
+
+
 char const *pbcc_get_channel(struct pbcc_context *pb)
 {
+    if (pb->chan_ungot) {
+        pb->chan_ungot = false;
+        return pb->ungot_chan;
+    }
+    if (pb->chan_repeat) {
+        pb->chan_repeat = false;
+        if (pb->chan_prev_ofs != 0) {
+            return pb->msg_buf + pb->chan_prev_ofs;
+        }
+    }
     if (pb->chan_ofs < pb->chan_end) {
-        char const* rslt = pb->http_reply + pb->chan_ofs;
+        char const* rslt = pb->msg_buf + pb->chan_ofs;
+        pb->chan_prev_ofs = pb->chan_ofs;
         pb->chan_ofs += strlen(rslt);
+        if (pb->sub_ofs < pb->sub_end) {
+            /* Subscriptions go along with the channels */
+            pb->sub_prev_ofs = pb->sub_ofs;
+            pb->sub_ofs += strlen(pb->msg_buf + pb->sub_ofs) + 1;
+        }
         if (pb->chan_ofs++ <= pb->chan_end) {
             return rslt;
         }
@@ -44,6 +396,114 @@ char const *pbcc_get_channel(struct pbcc_context *pb)
 }
 
 
+char const *pbcc_get_subscription(struct pbcc_context *pb)
+{
+    return (0 == pb->sub_prev_ofs) ? NULL : pb->msg_buf + pb->sub_prev_ofs;
+}
+
+
+#if PUBNUB_INBOX_SIZE > 0
+bool pbcc_inbox_peek(struct pbcc_context *pb, struct pubnub_inbox_msg *msg)
+{
+    if (0 == pb->inbox_count) {
+        return false;
+    }
+    msg->channel = pb->inbox + pb->inbox_head;
+    msg->message = msg->channel + strlen(msg->channel) + 1;
+    msg->timetoken = msg->message + strlen(msg->message) + 1;
+    
+    return true;
+}
+
+
+bool pbcc_inbox_pop(struct pbcc_context *pb)
+{
+    struct pubnub_inbox_msg msg;
+    
+    if (!pbcc_inbox_peek(pb, &msg)) {
+        return false;
+    }
+    pb->inbox_head = msg.timetoken + strlen(msg.timetoken) + 1 - pb->inbox;
+    if (0 == --pb->inbox_count) {
+        pb->inbox_head = pb->inbox_tail = pb->inbox_wrap = 0;
+    }
+    else if ((pb->inbox_wrap != 0) && (pb->inbox_head >= pb->inbox_wrap)) {
+        pb->inbox_head = pb->inbox_wrap = 0;
+    }
+    
+    return true;
+}
+
+
+/** Allocates @p len bytes (in one piece) at the end of the inbox.
+    @return offset of the allocated space, -1: doesn't fit
+*/
+static int inbox_alloc(struct pbcc_context *pb, unsigned len)
+{
+    unsigned ofs = pb->inbox_tail;
+    
+    if (0 == pb->inbox_wrap) {
+        if (len <= PUBNUB_INBOX_SIZE - pb->inbox_tail) {
+            pb->inbox_tail += len;
+            return ofs;
+        }
+        if (len <= pb->inbox_head) {
+            /* Wrap around, leaving the end of the ring unused */
+            pb->inbox_wrap = pb->inbox_tail;
+            pb->inbox_tail = len;
+            return 0;
+        }
+    }
+    else if (len <= (unsigned)(pb->inbox_head - pb->inbox_tail)) {
+        pb->inbox_tail += len;
+        return ofs;
+    }
+    
+    return -1;
+}
+
+
+/** Puts the @p message from @p channel in the inbox, making room for
+    it or dropping it, as the policy says, if it doesn't fit.
+*/
+static void inbox_put(struct pbcc_context *pb, char const *channel, char const *message)
+{
+    unsigned chan_len = strlen(channel) + 1;
+    unsigned msg_len = strlen(message) + 1;
+    unsigned len = chan_len + msg_len + strlen(pb->timetoken) + 1;
+    int ofs;
+    
+    if (len > PUBNUB_INBOX_SIZE) {
+        ++pb->inbox_dropped;
+        return;
+    }
+    while ((ofs = inbox_alloc(pb, len)) < 0) {
+        ++pb->inbox_dropped;
+        if (!pb->inbox_drop_oldest) {
+            return;
+        }
+        pbcc_inbox_pop(pb);
+    }
+    memcpy(pb->inbox + ofs, channel, chan_len);
+    memcpy(pb->inbox + ofs + chan_len, message, msg_len);
+    strcpy(pb->inbox + ofs + chan_len + msg_len, pb->timetoken);
+    ++pb->inbox_count;
+    ++pb->inbox_received;
+}
+
+
+void pbcc_inbox_fill(struct pbcc_context *pb)
+{
+    char const *msg;
+    
+    while ((msg = pbcc_get_msg(pb)) != NULL) {
+        char const *channel = pbcc_get_channel(pb);
+        inbox_put(pb, (NULL == channel) ? "" : channel, msg);
+    }
+}
+#endif
+
+
 void pbcc_set_uuid(struct pbcc_context *pb, const char *uuid)
 {
     pb->uuid = uuid;
@@ -56,6 +516,18 @@ void pbcc_set_auth(struct pbcc_context *pb, const char *auth)
 }
 
 
+void pbcc_set_channel_group(struct pbcc_context *pb, const char *group)
+{
+    pb->channel_group = group;
+}
+
+
+void pbcc_set_filter_expr(struct pbcc_context *pb, const char *expr)
+{
+    pb->filter_expr = expr;
+}
+
+
 /* Find the beginning of a JSON string that comes after comma and ends
  * at @c &buf[len].
  * @return position (index) of the found start or -1 on error. */
@@ -105,10 +577,24 @@ static bool split_array(char *buf)
 }
 
 
+/** Splits the comma-separated list in @p buf, from @p begin to @p
+    end, to NUL-terminated strings, in place.
+*/
+static void split_list(char *buf, int begin, int end)
+{
+    for (; begin < end; ++begin) {
+        if (buf[begin] == ',') {
+            buf[begin] = 0;
+        }
+    }
+}
+
+
 int pbcc_parse_subscribe_response(struct pbcc_context *p)
 {
     char *reply = p->http_reply;
     int replylen = p->http_buf_len;
+    struct pbcc_reply_lists lists = { 0, 0, 0, 0, 0 };
     if (replylen < 2) {
         return -1;
     }
@@ -128,113 +614,567 @@ int pbcc_parse_subscribe_response(struct pbcc_context *p)
     
     /* Now, the last argument may either be a timetoken or a channel list. */
     if (reply[i-2] == '"') {
-        int k;
         /* It is a channel list, there is another string argument in front
          * of us. Process the channel list ... */
-        for (k = replylen - 2; k > i+1; --k) {
-            if (reply[k] == ',') {
-                reply[k] = 0;
-            }
-        }
+        split_list(reply, i+1, replylen - 2);
         
         /* ... and look for timetoken again. */
         reply[i-2] = 0;
-        p->chan_ofs = i+1;
+        lists.chan_ofs = i+1;
+        lists.chan_end = replylen - 1;
         i = find_string_start(reply, i-2);
         if (i < 0) {
-            p->chan_ofs = 0;
-            p->chan_end = 0;
             return -1;
         }
-        p->chan_end = replylen - 1;
+        if (reply[i-2] == '"') {
+            /* There's yet another string argument, so it was a
+             * subscription list (of wildcard patterns or channel
+             * groups), the channels come after it. */
+            split_list(reply, i+1, lists.chan_ofs - 3);
+            reply[i-2] = 0;
+            lists.sub_ofs = i+1;
+            lists.sub_end = lists.chan_ofs - 2;
+            i = find_string_start(reply, i-2);
+            if (i < 0) {
+                return -1;
+            }
+        }
     } 
-    else {
-        p->chan_ofs = 0;
-        p->chan_end = 0;
-    }
     
     /* Now, i points at
      * [[1,2,3],"5678"]
      * [[1,2,3],"5678","a,b,c"]
+     * [[1,2,3],"5678","g,g,b","a,b,c"]
      *          ^-- here */
     
     /* Setup timetoken. */
     if (replylen-2 - (i+1) >= sizeof p->timetoken) {
         return -1;
     }
-    strcpy(p->timetoken, reply + i+1);
     reply[i-2] = 0; // terminate the [] message array (before the ]!)
+    lists.msg_end = i-2;
     
-    /* Set up the message list - offset, length and NUL-characters splitting
-     * the messages. */
-    p->msg_ofs = 2;
-    p->msg_end = i-2;
+    /* Split the messages with NUL-characters. */
+    if (!split_array(reply + 2)) {
+        return -1;
+    }
+    strcpy(p->timetoken, reply + i+1);
     
-    return split_array(reply + p->msg_ofs) ? 0 : -1;
+    reply_deliver(p, &lists);
+    
+    return 0;
 }
 
 
-enum pubnub_res pbcc_publish_prep(struct pbcc_context *pb, const char *channel, const char *message)
+enum pubnub_res pbcc_parse_publish_response(struct pbcc_context *p)
 {
-    pb->http_content_len = 0;
+    char *reply = p->http_reply;
+    char *desc;
+    char *tt;
+    char *end;
     
-    pb->http_buf_len = snprintf(
-        pb->http_buf, sizeof pb->http_buf,
-        "/publish/%s/%s/0/%s/0/", 
-        pb->publish_key, pb->subscribe_key, channel
-        );
+    /* [1,"Sent","14178940800777403"] */
+    if ((reply[0] != '[') || (NULL == (desc = strchr(reply, '"')))) {
+        return PNR_FORMAT_ERROR;
+    }
+    end = strchr(++desc, '"');
+    if ((NULL == end) || (end[1] != ',') || (end[2] != '"')) {
+        return PNR_FORMAT_ERROR;
+    }
+    *end = '\0';
+    tt = end + 3;
+    end = strchr(tt, '"');
+    if ((NULL == end) || (end - tt >= (int)sizeof p->publish_timetoken)) {
+        return PNR_FORMAT_ERROR;
+    }
+    memcpy(p->publish_timetoken, tt, end - tt);
+    p->publish_timetoken[end - tt] = '\0';
+    p->publish_desc = desc;
     
-    const char *pmessage = message;
-    while (pmessage[0]) {
+    return (1 == atoi(reply + 1)) ? PNR_OK : PNR_PUBLISH_FAILED;
+}
+
+
+/** Appends the first @p n characters of @p s, URL-encoded, to the
+    HTTP buffer.
+    @return 0: OK, -1: doesn't fit (some of it may have been appended)
+*/
+static int append_url_encoded_len(struct pbcc_context *pb, char const *s, size_t n)
+{
+    char const *end = s + n;
+
+    while (s < end) {
         /* RFC 3986 Unreserved characters plus few
-         * safe reserved ones. */
-        size_t okspan = strspn(pmessage, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_.~" ",=:;@[]");
+         * safe reserved ones. Not strspn(), as @p s need not be
+         * NUL-terminated at @p end. */
+        size_t okspan = 0;
+        while ((s + okspan < end) && (s[okspan] != '\0')
+               && (strchr("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_.~" ",=:;@[]", s[okspan]) != NULL)) {
+            ++okspan;
+        }
         if (okspan > 0) {
             if (okspan > sizeof(pb->http_buf)-1 - pb->http_buf_len) {
-                pb->http_buf_len = 0;
-                return PNR_TX_BUFF_TOO_SMALL;
+                return -1;
             }
-            memcpy(pb->http_buf + pb->http_buf_len, pmessage, okspan);
+            memcpy(pb->http_buf + pb->http_buf_len, s, okspan);
             pb->http_buf_len += okspan;
             pb->http_buf[pb->http_buf_len] = 0;
-            pmessage += okspan;
+            s += okspan;
         }
-        if (pmessage[0]) {
+        if (s < end) {
             /* %-encode a non-ok character. */
+            unsigned char c = *s;
             char enc[4] = {'%'};
-            enc[1] = "0123456789ABCDEF"[pmessage[0] / 16];
-            enc[2] = "0123456789ABCDEF"[pmessage[0] % 16];
+            enc[1] = "0123456789ABCDEF"[c / 16];
+            enc[2] = "0123456789ABCDEF"[c % 16];
             if (3 > sizeof pb->http_buf - 1 - pb->http_buf_len) {
-                pb->http_buf_len = 0;
-                return PNR_TX_BUFF_TOO_SMALL;
+                return -1;
             }
             memcpy(pb->http_buf + pb->http_buf_len, enc, 4);
             pb->http_buf_len += 3;
-            ++pmessage;
+            ++s;
         }
     }
     
+    return 0;
+}
+
+
+/** Appends the URL-encoded @p s to the HTTP buffer.
+    @return 0: OK, -1: doesn't fit (some of it may have been appended)
+*/
+static int append_url_encoded(struct pbcc_context *pb, char const *s)
+{
+    return append_url_encoded_len(pb, s, strlen(s));
+}
+
+
+/** Appends the URL query parameter @p name with the URL-encoded @p
+    value to the HTTP buffer, starting the query if there isn't one.
+    @return 0: OK, -1: doesn't fit (some of it may have been appended)
+*/
+static int append_url_param(struct pbcc_context *pb, char const *name, char const *value)
+{
+    int len = snprintf(pb->http_buf + pb->http_buf_len, sizeof pb->http_buf - pb->http_buf_len,
+                       "%c%s=", (NULL == strchr(pb->http_buf, '?')) ? '?' : '&', name);
+    if (len >= (int)(sizeof pb->http_buf - pb->http_buf_len)) {
+        return -1;
+    }
+    pb->http_buf_len += len;
+    
+    return append_url_encoded(pb, value);
+}
+
+
+enum pubnub_res pbcc_publish_prep(struct pbcc_context *pb, const char *channel, const char *message)
+{
+    if (reply_check(pb) != PNR_STARTED) {
+        return PNR_RX_BUFF_NOT_EMPTY;
+    }
+    pb->http_content_len = 0;
+    pb->publish_timetoken[0] = '\0';
+    pb->publish_desc = "";
+    
+    pb->http_buf_len = snprintf(
+        pb->http_buf, sizeof pb->http_buf,
+        "/publish/%s/%s/0/%s/0/", 
+        pb->publish_key, pb->subscribe_key, channel
+        );
+    pb->publish_msg_ofs = pb->http_buf_len;
+    
+    if (append_url_encoded(pb, message) != 0) {
+        pb->http_buf_len = 0;
+        return PNR_TX_BUFF_TOO_SMALL;
+    }
+    
     return PNR_STARTED;
 }
 
 
+enum pubnub_res pbcc_publish_prep_seq(struct pbcc_context *pb, const char *channel, const char *message, unsigned long seq)
+{
+    char head[24];
+    enum pubnub_res rslt;
+    
+    snprintf(head, sizeof head, "{\"q\":%lu,\"u\":\"", seq);
+    rslt = pbcc_publish_prep(pb, channel, head);
+    if ((PNR_STARTED == rslt)
+        && ((append_url_encoded(pb, (NULL == pb->uuid) ? "" : pb->uuid) != 0)
+            || (append_url_encoded(pb, "\",\"m\":") != 0)
+            || (append_url_encoded(pb, message) != 0)
+            || (append_url_encoded(pb, "}") != 0))) {
+        pb->http_buf_len = 0;
+        return PNR_TX_BUFF_TOO_SMALL;
+    }
+    
+    return rslt;
+}
+
+
+enum pubnub_res pbcc_publish_options(struct pbcc_context *pb, struct pubnub_publish_options const *opts)
+{
+    char ttl[8];
+    
+    snprintf(ttl, sizeof ttl, "%u", opts->ttl);
+    if ((!opts->store && (append_url_param(pb, "store", "0") != 0))
+        || (!opts->replicate && (append_url_param(pb, "norep", "true") != 0))
+        || ((opts->ttl != 0) && (append_url_param(pb, "ttl", ttl) != 0))
+        || ((opts->meta != NULL) && (append_url_param(pb, "meta", opts->meta) != 0))) {
+        pb->http_buf_len = 0;
+        return PNR_TX_BUFF_TOO_SMALL;
+    }
+    
+    return PNR_STARTED;
+}
+
+
+enum pubnub_res pbcc_publish_prep_array(struct pbcc_context *pb, const char *channel)
+{
+    enum pubnub_res rslt = pbcc_publish_prep(pb, channel, "[]");
+    if ((PNR_STARTED == rslt) && (pb->http_buf_len >= sizeof pb->http_buf - 1)) {
+        /* No space for even the smallest message */
+        pb->http_buf_len = 0;
+        return PNR_TX_BUFF_TOO_SMALL;
+    }
+    return rslt;
+}
+
+
+enum pubnub_res pbcc_publish_append(struct pbcc_context *pb, const char *message)
+{
+    unsigned closing = pb->http_buf_len - 1;
+    bool first = (pb->http_buf[closing - 1] == '[');
+    
+    pb->http_buf_len = closing;
+    if ((!first && (append_url_encoded(pb, ",") != 0))
+        || (append_url_encoded(pb, message) != 0)
+        || (append_url_encoded(pb, "]") != 0)) {
+        pb->http_buf_len = closing;
+        memcpy(pb->http_buf + closing, "]", 2);
+        return PNR_TX_BUFF_TOO_SMALL;
+    }
+    
+    return PNR_STARTED;
+}
+
+
+enum pubnub_res pbcc_publish_set_channel(struct pbcc_context *pb, const char *channel)
+{
+    unsigned msg_len = pb->http_buf_len - pb->publish_msg_ofs;
+    int len = snprintf(NULL, 0, "/publish/%s/%s/0/%s/0/", pb->publish_key, pb->subscribe_key, channel);
+    char first;
+    
+    if (len + msg_len >= sizeof pb->http_buf) {
+        return PNR_TX_BUFF_TOO_SMALL;
+    }
+    memmove(pb->http_buf + len, pb->http_buf + pb->publish_msg_ofs, msg_len + 1);
+    
+    /* snprintf() will overwrite the first character of the message */
+    first = pb->http_buf[len];
+    snprintf(pb->http_buf, len + 1, "/publish/%s/%s/0/%s/0/", pb->publish_key, pb->subscribe_key, channel);
+    pb->http_buf[len] = first;
+    
+    pb->publish_msg_ofs = len;
+    pb->http_buf_len = len + msg_len;
+    
+    return PNR_STARTED;
+}
+
+
+void pbcc_msg_start(struct pbcc_context *pb)
+{
+    pb->msg_rslt = PNR_STARTED;
+    pb->msg_depth = 0;
+    pb->msg_arrays = 0;
+    pb->msg_comma = pb->msg_key = false;
+}
+
+
+/** Appends the first @p n characters of @p s to the message being
+    built, keeping the error if it doesn't fit.
+*/
+static bool msg_put_len(struct pbcc_context *pb, char const *s, size_t n)
+{
+    if (append_url_encoded_len(pb, s, n) != 0) {
+        pb->msg_rslt = PNR_TX_BUFF_TOO_SMALL;
+        return false;
+    }
+    return true;
+}
+
+
+static bool msg_put(struct pbcc_context *pb, char const *s)
+{
+    return msg_put_len(pb, s, strlen(s));
+}
+
+
+/** Appends @p s as a JSON string to the message being built */
+static bool msg_put_string(struct pbcc_context *pb, char const *s)
+{
+    if (!msg_put(pb, "\"")) {
+        return false;
+    }
+    while (*s != '\0') {
+        size_t run = 0;
+        while ((s[run] != '\0') && ((unsigned char)s[run] >= 0x20) && (s[run] != '"') && (s[run] != '\\')) {
+            ++run;
+        }
+        if (!msg_put_len(pb, s, run)) {
+            return false;
+        }
+        s += run;
+        if (*s != '\0') {
+            char esc[7] = { '\\', 'u', '0', '0' };
+            if (('"' == *s) || ('\\' == *s)) {
+                esc[1] = *s;
+                esc[2] = '\0';
+            }
+            else {
+                esc[4] = "0123456789abcdef"[*s / 16];
+                esc[5] = "0123456789abcdef"[*s % 16];
+                esc[6] = '\0';
+            }
+            if (!msg_put(pb, esc)) {
+                return false;
+            }
+            ++s;
+        }
+    }
+    return msg_put(pb, "\"");
+}
+
+
+static bool msg_in_array(struct pbcc_context const *pb)
+{
+    return (pb->msg_depth > 0) && (pb->msg_arrays & (1u << (pb->msg_depth - 1)));
+}
+
+
+/** Checks that a value may be written to the message being built
+    now and writes the comma before it, if needed.
+*/
+static bool msg_value(struct pbcc_context *pb)
+{
+    if (pb->msg_rslt != PNR_STARTED) {
+        return false;
+    }
+    if (pb->msg_key) {
+        pb->msg_key = false;
+    }
+    else if ((0 == pb->msg_depth) ? pb->msg_comma : !msg_in_array(pb)) {
+        /* Second value at the top, or value in an object without a key */
+        pb->msg_rslt = PNR_FORMAT_ERROR;
+        return false;
+    }
+    else if (pb->msg_comma && !msg_put(pb, ",")) {
+        return false;
+    }
+    pb->msg_comma = true;
+    return true;
+}
+
+
+void pbcc_msg_begin(struct pbcc_context *pb, bool array)
+{
+    if (pb->msg_depth >= sizeof pb->msg_arrays * 8) {
+        pb->msg_rslt = PNR_FORMAT_ERROR;
+    }
+    if (msg_value(pb) && msg_put(pb, array ? "[" : "{")) {
+        if (array) {
+            pb->msg_arrays |= 1u << pb->msg_depth;
+        }
+        else {
+            pb->msg_arrays &= ~(1u << pb->msg_depth);
+        }
+        ++pb->msg_depth;
+        pb->msg_comma = false;
+    }
+}
+
+
+void pbcc_msg_end(struct pbcc_context *pb)
+{
+    if (pb->msg_rslt != PNR_STARTED) {
+        return;
+    }
+    if ((0 == pb->msg_depth) || pb->msg_key) {
+        pb->msg_rslt = PNR_FORMAT_ERROR;
+        return;
+    }
+    if (msg_put(pb, msg_in_array(pb) ? "]" : "}")) {
+        --pb->msg_depth;
+        pb->msg_comma = true;
+    }
+}
+
+
+void pbcc_msg_key(struct pbcc_context *pb, char const *key)
+{
+    if (pb->msg_rslt != PNR_STARTED) {
+        return;
+    }
+    if ((0 == pb->msg_depth) || msg_in_array(pb) || pb->msg_key) {
+        pb->msg_rslt = PNR_FORMAT_ERROR;
+        return;
+    }
+    if ((!pb->msg_comma || msg_put(pb, ",")) && msg_put_string(pb, key) && msg_put(pb, ":")) {
+        pb->msg_key = true;
+    }
+}
+
+
+void pbcc_msg_fixed(struct pbcc_context *pb, long n, unsigned char decimals)
+{
+    char num[32];
+    char *p = num + sizeof num - 1;
+    /* Negate as unsigned, LONG_MIN has no positive counterpart */
+    unsigned long mag = (n < 0) ? -(unsigned long)n : (unsigned long)n;
+    unsigned i = 0;
+
+    /* Digits from the last, with at least one before the point */
+    *p = '\0';
+    do {
+        if ((i == decimals) && (i > 0)) {
+            *--p = '.';
+        }
+        *--p = '0' + mag % 10;
+        mag /= 10;
+        ++i;
+    } while ((mag > 0) || (i <= decimals));
+    if (n < 0) {
+        *--p = '-';
+    }
+    if (msg_value(pb)) {
+        msg_put(pb, p);
+    }
+}
+
+
+void pbcc_msg_string(struct pbcc_context *pb, char const *s)
+{
+    if (msg_value(pb)) {
+        msg_put_string(pb, s);
+    }
+}
+
+
+/** Encodes the @p n (1 to 3) bytes at @p in into (4) characters at
+    @p out, padded if needed.
+    @return The number of characters
+*/
+static unsigned put_base64(char *out, unsigned char const *in, unsigned n)
+{
+    static char const alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+    unsigned long group = (unsigned long)in[0] << 16;
+    unsigned i;
+
+    if (n > 1) {
+        group |= (unsigned long)in[1] << 8;
+    }
+    if (n > 2) {
+        group |= in[2];
+    }
+    for (i = 0; i < 4; ++i) {
+        out[i] = (i <= n) ? alphabet[(group >> (18 - 6 * i)) & 0x3F] : '=';
+    }
+    return 4;
+}
+
+
+/** Encodes the @p n (1 to 4) bytes at @p in into (@p n + 1) Z85
+    characters at @p out.
+    @return The number of characters
+*/
+static unsigned put_base85(char *out, unsigned char const *in, unsigned n)
+{
+    static char const alphabet[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ.-:+=^!/*?&<>()[]{}@%$#";
+    unsigned long group = 0;
+    char digits[5];
+    unsigned i;
+
+    for (i = 0; i < 4; ++i) {
+        group = (group << 8) | ((i < n) ? in[i] : 0);
+    }
+    for (i = 5; i-- > 0; ) {
+        digits[i] = alphabet[group % 85];
+        group /= 85;
+    }
+    memcpy(out, digits, n + 1);
+    return n + 1;
+}
+
+
+void pbcc_msg_binary(struct pbcc_context *pb, void const *data, size_t len, enum pubnub_binary_enc enc)
+{
+    unsigned char const *in = data;
+    unsigned max = (PNBE_BASE85 == enc) ? 4 : 3;
+    /* Encoded a few groups at a time, then written to the message */
+    char out[40];
+    unsigned n = 0;
+
+    if (!msg_value(pb) || !msg_put(pb, "\"")) {
+        return;
+    }
+    while (len > 0) {
+        unsigned take = (len < max) ? len : max;
+        n += (PNBE_BASE85 == enc) ? put_base85(out + n, in, take) : put_base64(out + n, in, take);
+        in += take;
+        len -= take;
+        if ((n + 5 > sizeof out) || (0 == len)) {
+            if (!msg_put_len(pb, out, n)) {
+                return;
+            }
+            n = 0;
+        }
+    }
+    msg_put(pb, "\"");
+}
+
+
+void pbcc_msg_raw(struct pbcc_context *pb, char const *json)
+{
+    if (msg_value(pb)) {
+        msg_put(pb, json);
+    }
+}
+
+
+enum pubnub_res pbcc_msg_done(struct pbcc_context *pb)
+{
+    if ((PNR_STARTED == pb->msg_rslt) && ((pb->msg_depth > 0) || !pb->msg_comma)) {
+        /* Something left open, or nothing written at all */
+        pb->msg_rslt = PNR_FORMAT_ERROR;
+    }
+    if (pb->msg_rslt != PNR_STARTED) {
+        pb->http_buf_len = 0;
+    }
+    return pb->msg_rslt;
+}
+
+
 enum pubnub_res pbcc_subscribe_prep(struct pbcc_context *p, const char *channel)
 {
-    if (p->msg_ofs < p->msg_end) {
+    if (reply_prep(p) != PNR_STARTED) {
         return PNR_RX_BUFF_NOT_EMPTY;
     }
 
     p->http_content_len = 0;
-    p->msg_ofs = 0;
     
     p->http_buf_len = snprintf(p->http_buf, sizeof(p->http_buf),
-            "/subscribe/%s/%s/0/%s?" "%s%s" "%s%s%s" "&pnsdk=PubNub-Contiki-%s%%2F%s",
+            "/subscribe/%s/%s/0/%s?" "%s%s" "%s%s%s" "%s%s" "&pnsdk=PubNub-Contiki-%s%%2F%s",
             p->subscribe_key, channel, p->timetoken,
             p->uuid ? "uuid=" : "", p->uuid ? p->uuid : "",
             p->uuid && p->auth ? "&" : "",
             p->auth ? "auth=" : "", p->auth ? p->auth : "",
+            p->channel_group ? "&channel-group=" : "", p->channel_group ? p->channel_group : "",
             "", "1.1"
             );
+    if ((p->http_buf_len >= sizeof p->http_buf)
+        || ((p->filter_expr != NULL) && (append_url_param(p, "filter-expr", p->filter_expr) != 0))) {
+        p->http_buf_len = 0;
+        return PNR_TX_BUFF_TOO_SMALL;
+    }
 
     return PNR_STARTED;
 }
@@ -242,11 +1182,24 @@ enum pubnub_res pbcc_subscribe_prep(struct pbcc_context *p, const char *channel)
 
 enum pubnub_res pbcc_leave_prep(struct pbcc_context *p, const char *channel)
 {
-    p->http_content_len = 0;
+    enum pubnub_res rslt = pbcc_partial_leave_prep(p, channel);
     
-    /* Make sure next subscribe() will be a join. */
-    p->timetoken[0] = '0';
-    p->timetoken[1] = '\0';
+    if (PNR_STARTED == rslt) {
+        /* Make sure next subscribe() will be a join. */
+        p->timetoken[0] = '0';
+        p->timetoken[1] = '\0';
+    }
+    
+    return rslt;
+}
+
+
+enum pubnub_res pbcc_partial_leave_prep(struct pbcc_context *p, const char *channel)
+{
+    if (reply_check(p) != PNR_STARTED) {
+        return PNR_RX_BUFF_NOT_EMPTY;
+    }
+    p->http_content_len = 0;
     
     p->http_buf_len = snprintf(p->http_buf, sizeof(p->http_buf),
             "/v2/presence/sub-key/%s/channel/%s/leave?" "%s%s" "%s%s%s",
@@ -258,3 +1211,144 @@ enum pubnub_res pbcc_leave_prep(struct pbcc_context *p, const char *channel)
 
     return PNR_STARTED;
 }
+
+
+enum pubnub_res pbcc_channel_registry_prep(struct pbcc_context *p, const char *group, const char *param, const char *channels)
+{
+    if (reply_check(p) != PNR_STARTED) {
+        return PNR_RX_BUFF_NOT_EMPTY;
+    }
+    p->http_content_len = 0;
+    
+    p->http_buf_len = snprintf(p->http_buf, sizeof(p->http_buf),
+            "/v1/channel-registration/sub-key/%s/channel-group/%s?%s=%s" "%s%s" "%s%s%s",
+            p->subscribe_key, group, param, channels,
+            p->uuid ? "&uuid=" : "", p->uuid ? p->uuid : "",
+            p->auth ? "&" : "",
+            p->auth ? "auth=" : "", p->auth ? p->auth : "");
+    if (p->http_buf_len >= sizeof p->http_buf) {
+        p->http_buf_len = 0;
+        return PNR_TX_BUFF_TOO_SMALL;
+    }
+
+    return PNR_STARTED;
+}
+
+
+enum pubnub_res pbcc_time_prep(struct pbcc_context *p)
+{
+    if (reply_check(p) != PNR_STARTED) {
+        return PNR_RX_BUFF_NOT_EMPTY;
+    }
+    p->http_content_len = 0;
+    p->server_time[0] = '\0';
+    
+    p->http_buf_len = snprintf(p->http_buf, sizeof p->http_buf, "/time/0");
+    
+    return PNR_STARTED;
+}
+
+
+int pbcc_parse_time_response(struct pbcc_context *p)
+{
+    char const *reply = p->http_reply;
+    size_t len = strspn(reply + 1, "0123456789");
+    
+    /* [14178940800777403] */
+    if ((reply[0] != '[') || (0 == len) || (reply[len + 1] != ']')
+        || (len >= sizeof p->server_time)) {
+        return -1;
+    }
+    memcpy(p->server_time, reply + 1, len);
+    p->server_time[len] = '\0';
+    
+    return 0;
+}
+
+
+enum pubnub_res pbcc_history_prep(struct pbcc_context *p, const char *channel, unsigned count, const char *start, const char *end, bool reverse)
+{
+    if (reply_prep(p) != PNR_STARTED) {
+        return PNR_RX_BUFF_NOT_EMPTY;
+    }
+    p->http_content_len = 0;
+    
+    p->http_buf_len = snprintf(p->http_buf, sizeof p->http_buf,
+            "/v2/history/sub-key/%s/channel/%s?count=%u" "%s%s" "%s%s" "%s" "%s%s" "%s%s%s",
+            p->subscribe_key, channel, count,
+            start ? "&start=" : "", start ? start : "",
+            end ? "&end=" : "", end ? end : "",
+            reverse ? "&reverse=true" : "",
+            p->uuid ? "&uuid=" : "", p->uuid ? p->uuid : "",
+            p->auth ? "&" : "",
+            p->auth ? "auth=" : "", p->auth ? p->auth : "");
+    if (p->http_buf_len >= sizeof p->http_buf) {
+        p->http_buf_len = 0;
+        return PNR_TX_BUFF_TOO_SMALL;
+    }
+
+    return PNR_STARTED;
+}
+
+
+/** Returns whether @p tt is a valid time token that fits in a
+    buffer of @p size bytes.
+*/
+static bool valid_timetoken(char const *tt, size_t size)
+{
+    size_t len = strlen(tt);
+    
+    return (len > 0) && (len < size) && (strspn(tt, "0123456789") == len);
+}
+
+
+int pbcc_set_timetoken(struct pbcc_context *p, char const *tt)
+{
+    if (!valid_timetoken(tt, sizeof p->timetoken)) {
+        return -1;
+    }
+    strcpy(p->timetoken, tt);
+    
+    return 0;
+}
+
+
+int pbcc_parse_history_response(struct pbcc_context *p)
+{
+    char *reply = p->http_reply;
+    int replylen = p->http_buf_len;
+    struct pbcc_reply_lists lists = { 0, 0, 0, 0, 0 };
+    char *start;
+    char *end;
+    
+    /* [[1,2,3],14178940800777403,14178940800999505] */
+    if ((replylen < 8) || (reply[0] != '[') || (reply[1] != '[') || (reply[replylen-1] != ']')) {
+        return -1;
+    }
+    reply[replylen-1] = '\0';
+    
+    /* Time tokens are numbers, so the last two commas are theirs */
+    end = strrchr(reply, ',');
+    if (NULL == end) {
+        return -1;
+    }
+    *end++ = '\0';
+    start = strrchr(reply, ',');
+    if ((NULL == start) || (start[-1] != ']')) {
+        return -1;
+    }
+    *start++ = '\0';
+    start[-2] = '\0';
+    lists.msg_end = start - 2 - reply;
+    
+    if (!valid_timetoken(start, sizeof p->history_start)
+        || !valid_timetoken(end, sizeof p->history_end)
+        || !split_array(reply + 2)) {
+        return -1;
+    }
+    reply_deliver(p, &lists);
+    strcpy(p->history_start, start);
+    strcpy(p->history_end, end);
+    
+    return 0;
+}
@@ -17,6 +17,19 @@
 */
 
 
+/** Offsets of the lists found in a subscribe reply */
+struct pbcc_reply_lists {
+    /** End of the message list */
+    unsigned short msg_end;
+    /** Start and end of the channel list, 0 if there is none */
+    unsigned short chan_ofs, chan_end;
+    /** Start and end of the subscription list (the wildcard
+        pattern or channel group each channel was matched by), 0 if
+        there is none */
+    unsigned short sub_ofs, sub_end;
+};
+
+
 /** The Pubnub "(C) core" context, contains context data 
     that is shared among all Pubnub C clients.
  */
@@ -29,8 +42,26 @@ struct pbcc_context {
     char const *uuid;
     /** The `auth` parameter to be sent on to server. If NULL, don't send any */
     char const *auth;
+    /** The channel group(s) to subscribe to. If NULL, don't subscribe
+     * to any */
+    char const *channel_group;
+    /** The filter expression the server applies to messages before
+     * sending them to us on subscribe. If NULL, don't send any */
+    char const *filter_expr;
     /** The last used time token. */
     char timetoken[64];
+    /** The time token of the last publish, as given by the server,
+        empty if none. */
+    char publish_timetoken[20];
+    /** The description of the outcome of the last publish, as given
+        by the server (points into the reply) */
+    char const *publish_desc;
+    /** The server time (time token) got by the last Time operation,
+        empty if none. */
+    char server_time[20];
+    /** The time tokens of the first and last message got by the last
+        successful History operation, empty if none. */
+    char history_start[20], history_end[20];
 
     /** The result of the last Pubnub transaction */
     enum pubnub_res last_result;
@@ -41,12 +72,36 @@ struct pbcc_context {
     int http_code;
     /** The length of the data in the HTTP buffer */
     unsigned http_buf_len;
+    /** The offset of the (encoded) message in the prepared publish */
+    unsigned short publish_msg_ofs;
+    /** State of the message being built in the prepared publish:
+        outcome so far (#PNR_STARTED if OK), nesting depth, a bit per
+        nesting level that is set for arrays (clear for objects) and
+        whether the next item is to be preceded by a comma, or a key
+        was written and the next item is its value */
+    enum pubnub_res msg_rslt;
+    unsigned char msg_depth;
+    unsigned short msg_arrays;
+    bool msg_comma, msg_key;
     /** The length of total data to be received in a HTTP reply */
     unsigned http_content_len;
     /** Indicates whether we are receiving chunked or regular HTTP response */
     bool http_chunked;
-    /** The contents of a HTTP reply/reponse */
-    char http_reply[PUBNUB_REPLY_MAXLEN+1];
+    /** The buffer(s) for HTTP replies/responses */
+    char reply_buf[PUBNUB_REPLY_BUFFERS][PUBNUB_REPLY_MAXLEN+1];
+    /** The contents of a HTTP reply/reponse, that is, the reply
+     * buffer the reply is received in */
+    char *http_reply;
+    /** The reply buffer that received messages are read from. With
+     * one buffer, the same as @c http_reply. */
+    char *msg_buf;
+#if PUBNUB_REPLY_BUFFERS > 1
+    /** Indicates that a parsed subscribe reply in @c http_reply waits
+     * for all the messages in @c msg_buf to be read */
+    bool reply_pending;
+    /** The lists of the pending reply */
+    struct pbcc_reply_lists pend;
+#endif
 
     /* These in-string offsets are used for yielding messages received
      * by subscribe - the beginning of last yielded message and total
@@ -54,6 +109,70 @@ struct pbcc_context {
      */
     unsigned short msg_ofs, msg_end, chan_ofs, chan_end;
 
+    /** If true, messages that are JSON arrays are "unpacked", that
+     * is, their elements are yielded as individual messages. */
+    bool unpack;
+    /** Indicates that the last yielded message was unpacked from the
+     * same array as the one before it, so the channel repeats */
+    bool chan_repeat;
+    /* The offset of next element of the array being unpacked and its
+     * end, and the offset of the last yielded channel. */
+    unsigned short unpack_ofs, unpack_end, chan_prev_ofs;
+    /* Offsets of the next subscription (wildcard pattern or channel
+     * group) and the end of the subscription list, and of the
+     * subscription of the last yielded channel. */
+    unsigned short sub_ofs, sub_end, sub_prev_ofs;
+    /** The message put back by pbcc_unget_msg(), to be yielded next
+     * (NULL if none), and its channel. The channel is yielded next
+     * when @c chan_ungot is set (after yielding the message). */
+    char const *ungot_msg, *ungot_chan;
+    bool chan_ungot;
+
+#if PUBNUB_DEDUP_SIZE > 0
+    /** Hashes of the last received messages, a ring */
+    uint32_t dedup[PUBNUB_DEDUP_SIZE];
+    /** Index of the oldest hash (to overwrite next) and the number
+     * of hashes in the ring */
+    unsigned char dedup_next, dedup_n;
+    /** Number of messages dropped as duplicates */
+    unsigned dedup_count;
+#endif
+
+#if PUBNUB_SEQ_SOURCES > 0
+    /** If true, messages stamped with sequence numbers are unwrapped
+     * and their sequence numbers tracked */
+    bool seq_track;
+    /** The publishers heard from, most recently first: hash of the
+     * UUID and the sequence number expected next */
+    struct pbcc_seq_source {
+        uint32_t publisher;
+        uint32_t next;
+    } seq_src[PUBNUB_SEQ_SOURCES];
+    /** Number of publishers in @c seq_src */
+    unsigned char seq_n;
+    /** Sequence tracking statistics */
+    struct pubnub_seq_stats seq_stats;
+    /** Callback to report anomalies to, the context to report them
+     * for and the user data to pass */
+    pubnub_seq_cb seq_cb;
+    pubnub_t *seq_pb;
+    void *seq_data;
+#endif
+
+#if PUBNUB_INBOX_SIZE > 0
+    /** The inbox, a ring of received messages. Each is stored as
+     * NUL-terminated channel, message and time token, in one piece. */
+    char inbox[PUBNUB_INBOX_SIZE];
+    /* The offset of the oldest message, the end of the newest, and,
+     * if the messages wrap around, the end of those at the top of the
+     * ring (0 if they don't), and the number of messages. */
+    unsigned short inbox_head, inbox_tail, inbox_wrap, inbox_count;
+    /** If true, oldest messages are dropped to make room for a new
+     * one, otherwise, the new one is dropped */
+    bool inbox_drop_oldest;
+    /** Number of messages put in and dropped from the inbox */
+    unsigned inbox_received, inbox_dropped;
+#endif
 };
 
 
@@ -61,37 +180,163 @@ struct pbcc_context {
 void pbcc_init(struct pbcc_context *pbcc, const char *publish_key, const char *subscribe_key);
 
 /** Returns the next message from the Pubnub C Core context. NULL if
-    there are no (more) messages
+    there are no (more) messages. If unpacking is on, elements of
+    messages that are arrays are returned instead of the arrays.
 */
 char const *pbcc_get_msg(struct pbcc_context *pb);
 
 /** Returns the next channel from the Pubnub C Core context. NULL if
-    there are no (more) messages.
+    there are no (more) messages. After an element unpacked from the
+    same array as the one before it, returns the same channel again.
 */
 char const *pbcc_get_channel(struct pbcc_context *pb);
 
+/** Puts back the message @p msg and its @p channel, last returned
+    by pbcc_get_msg() and pbcc_get_channel(), so that they are
+    returned again, before any other.
+*/
+void pbcc_unget_msg(struct pbcc_context *pb, char const *msg, char const *channel);
+
+/** Returns whether there are messages left to be read */
+bool pbcc_msgs_left(struct pbcc_context const *pb);
+
+#if PUBNUB_INBOX_SIZE > 0
+/** Gets the oldest message from the inbox to @p msg, leaving it in.
+    @return true: got it, false: inbox is empty
+*/
+bool pbcc_inbox_peek(struct pbcc_context *pb, struct pubnub_inbox_msg *msg);
+
+/** Removes the oldest message from the inbox.
+    @return true: removed, false: inbox is empty
+*/
+bool pbcc_inbox_pop(struct pbcc_context *pb);
+
+/** Moves the messages left to be read to the inbox */
+void pbcc_inbox_fill(struct pbcc_context *pb);
+#endif
+
+/** Returns the subscription (wildcard pattern or channel group) that
+    matched the channel last returned by pbcc_get_channel(). NULL if
+    the reply has no subscription list.
+*/
+char const *pbcc_get_subscription(struct pbcc_context *pb);
+
 /** Sets the UUID for the context */
 void pbcc_set_uuid(struct pbcc_context *pb, const char *uuid);
 
 /** Sets the `auth` for the context */
 void pbcc_set_auth(struct pbcc_context *pb, const char *auth);
 
+/** Sets the channel group(s) to subscribe to, for the context */
+void pbcc_set_channel_group(struct pbcc_context *pb, const char *group);
+
+/** Sets the filter expression for subscribes, for the context */
+void pbcc_set_filter_expr(struct pbcc_context *pb, const char *expr);
+
 /** Parses the string received as a response for a subscribe operation
     (transaction). This checks if the response is valid, and, if it
     is, prepares for giving the messages (and possibly channels) that
     are received in the response to the user (via pbcc_get_msg() and
     pbcc_get_channel()).
 
+    The messages are left to be read even if there is an inbox, so
+    that handlers get them first. Those left after that are put in
+    the inbox with pbcc_inbox_fill().
+
+    With more than one reply buffer, if the messages of the previous
+    response were not all read yet, the response is kept until they
+    are.
+
     @param p The Pubnub C core context to parse the response "in"
     @return 0: OK, -1: error (invalid response)
 */
 int pbcc_parse_subscribe_response(struct pbcc_context *p);
 
+/** Parses the string received as a response for a publish operation
+    (transaction), getting the description and the time token of the
+    publish from it.
+
+    @param p The Pubnub C core context to parse the response "in"
+    @return #PNR_OK: published, #PNR_PUBLISH_FAILED: server reported
+    an error, #PNR_FORMAT_ERROR: invalid response
+*/
+enum pubnub_res pbcc_parse_publish_response(struct pbcc_context *p);
+
 /** Prepares the Publish operation (transaction), mostly by
     formatting the URI of the HTTP request.
  */
 enum pubnub_res pbcc_publish_prep(struct pbcc_context *pb, const char *channel, const char *message);
 
+/** Prepares the Publish operation (transaction) of the @p message
+    stamped with the sequence number @p seq and the UUID of the
+    context, see pubnub_set_seq_stamp().
+ */
+enum pubnub_res pbcc_publish_prep_seq(struct pbcc_context *pb, const char *channel, const char *message, unsigned long seq);
+
+/** Replaces the channel of the Publish operation prepared by
+    pbcc_publish_prep(), keeping the (already encoded) message.
+    If it doesn't fit in the HTTP buffer, nothing is changed.
+ */
+enum pubnub_res pbcc_publish_set_channel(struct pbcc_context *pb, const char *channel);
+
+/** Adds the publish options @p opts (that are sent to the server)
+    to the Publish operation prepared by pbcc_publish_prep(). They
+    have to be added after the message, as they go to the query
+    string of the URI.
+ */
+enum pubnub_res pbcc_publish_options(struct pbcc_context *pb, struct pubnub_publish_options const *opts);
+
+/** Prepares the Publish operation (transaction) of several messages
+    packed (coalesced) in one JSON array. The array is empty, add
+    messages to it with pbcc_publish_append().
+ */
+enum pubnub_res pbcc_publish_prep_array(struct pbcc_context *pb, const char *channel);
+
+/** Appends the @p message to the array of the Publish operation
+    prepared by pbcc_publish_prep_array(). If it doesn't fit in the
+    HTTP buffer, the array is left as it was.
+ */
+enum pubnub_res pbcc_publish_append(struct pbcc_context *pb, const char *message);
+
+/** Starts building a message in the Publish operation prepared by
+    pbcc_publish_prep() with an empty message. Write the message with
+    the pbcc_msg_ functions, which keep the first error and ignore
+    the rest, then check it with pbcc_msg_done().
+ */
+void pbcc_msg_start(struct pbcc_context *pb);
+
+/** Writes the start of a JSON array (if @p array) or object */
+void pbcc_msg_begin(struct pbcc_context *pb, bool array);
+
+/** Writes the end of the innermost open JSON array or object */
+void pbcc_msg_end(struct pbcc_context *pb);
+
+/** Writes the JSON object @p key, for the value written next */
+void pbcc_msg_key(struct pbcc_context *pb, char const *key);
+
+/** Writes the fixed-point number @p n with @p decimals decimal
+    digits, that is, @p n divided by 10 to the power of @p decimals.
+    @pre decimals <= 9
+ */
+void pbcc_msg_fixed(struct pbcc_context *pb, long n, unsigned char decimals);
+
+/** Writes the string @p s as a JSON string, escaping as needed */
+void pbcc_msg_string(struct pbcc_context *pb, char const *s);
+
+/** Writes the @p len bytes of binary @p data as a JSON string with
+    the encoding @p enc */
+void pbcc_msg_binary(struct pbcc_context *pb, void const *data, size_t len, enum pubnub_binary_enc enc);
+
+/** Writes @p json, which has to be a (valid) JSON value, as is */
+void pbcc_msg_raw(struct pbcc_context *pb, char const *json);
+
+/** Returns the outcome of building the message: #PNR_STARTED if it
+    is complete, #PNR_TX_BUFF_TOO_SMALL if it didn't fit in the HTTP
+    buffer and #PNR_FORMAT_ERROR if it is not valid JSON (like, a
+    value in an object without a key, or an array left open).
+ */
+enum pubnub_res pbcc_msg_done(struct pbcc_context *pb);
+
 /** Prepares the Subscribe operation (transaction), mostly by
     formatting the URI of the HTTP request.
  */
@@ -102,5 +347,54 @@ enum pubnub_res pbcc_subscribe_prep(struct pbcc_context *p, const char *channel)
  */
 enum pubnub_res pbcc_leave_prep(struct pbcc_context *p, const char *channel);
 
+/** Prepares the Leave operation (transaction) of some of the
+    subscribed channels, that is, unlike pbcc_leave_prep(), keeps the
+    time token, so that the next subscribe doesn't lose messages on
+    the other channels.
+ */
+enum pubnub_res pbcc_partial_leave_prep(struct pbcc_context *p, const char *channel);
+
+
+/** Prepares the operation (transaction) of changing the channels of
+    the channel @p group, mostly by formatting the URI of the HTTP
+    request. The @p param is the operation ("add" or "remove") and
+    @p channels the (comma-separated) channels to do it with.
+ */
+enum pubnub_res pbcc_channel_registry_prep(struct pbcc_context *p, const char *group, const char *param, const char *channels);
+
+/** Prepares the Time operation (transaction), mostly by formatting
+    the URI of the HTTP request.
+ */
+enum pubnub_res pbcc_time_prep(struct pbcc_context *p);
+
+/** Parses the string received as a response for a Time operation
+    (transaction), getting the server time from it.
+
+    @param p The Pubnub C core context to parse the response "in"
+    @return 0: OK, -1: error (invalid response)
+*/
+int pbcc_parse_time_response(struct pbcc_context *p);
+
+/** Sets the time token to use in the next subscribe to @p tt.
+
+    @return 0: OK, -1: error (@p tt is not a valid time token)
+*/
+int pbcc_set_timetoken(struct pbcc_context *p, char const *tt);
+
+/** Prepares the History operation (transaction), mostly by
+    formatting the URI of the HTTP request. The @p start and @p end
+    time tokens can be NULL.
+ */
+enum pubnub_res pbcc_history_prep(struct pbcc_context *p, const char *channel, unsigned count, const char *start, const char *end, bool reverse);
+
+/** Parses the string received as a response for a History operation
+    (transaction), preparing for giving the messages in it to the
+    user (via pbcc_get_msg()), just like for a subscribe.
+
+    @param p The Pubnub C core context to parse the response "in"
+    @return 0: OK, -1: error (invalid response)
+*/
+int pbcc_parse_history_response(struct pbcc_context *p);
+
 
 #endif /* !defined INC_PUBNUB_CCORE */
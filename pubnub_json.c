@@ -0,0 +1,561 @@
+/* -*- c-file-style:"stroustrup"; indent-tabs-mode: nil -*- */
+#include "pubnub_json.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+
+static char const *skip_ws(char const *s, char const *end)
+{
+    while ((s < end) && ((' ' == *s) || ('\t' == *s) || ('\n' == *s) || ('\r' == *s))) {
+        ++s;
+    }
+    return s;
+}
+
+
+/** Returns the end (after the closing quote) of the string that
+    starts at @p s, NULL if it doesn't end before @p end.
+*/
+static char const *skip_string(char const *s, char const *end)
+{
+    for (++s; s < end; ++s) {
+        if ('\\' == *s) {
+            ++s;
+        }
+        else if ('"' == *s) {
+            return s + 1;
+        }
+    }
+    return NULL;
+}
+
+
+/** Returns the end of the value that starts at @p s, NULL if it
+    doesn't end before @p end.
+*/
+static char const *skip_value(char const *s, char const *end)
+{
+    unsigned depth = 0;
+    char const *start = s;
+
+    if (s >= end) {
+        return NULL;
+    }
+    if ('"' == *s) {
+        return skip_string(s, end);
+    }
+    if ((*s != '{') && (*s != '[')) {
+        /* Number, true, false or null */
+        while ((s < end) && (*s != '\0') && (strchr(",]} \t\r\n", *s) == NULL)) {
+            ++s;
+        }
+        return (s == start) ? NULL : s;
+    }
+    for (; s < end; ++s) {
+        switch (*s) {
+        case '"':
+            s = skip_string(s, end);
+            if (NULL == s) {
+                return NULL;
+            }
+            --s;
+            break;
+        case '{': case '[':
+            ++depth;
+            break;
+        case '}': case ']':
+            if (0 == --depth) {
+                return s + 1;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return NULL;
+}
+
+
+/** Moves @p s (with the rest of the JSON up to @p end) from a value
+    to the start of the next value of the same array or object.
+    @return #PNJ_OK: moved, #PNJ_NOT_FOUND: there are no more values
+    (the array or object ends with @p close)
+*/
+static enum pubnub_json_res next_value(char const **s, char const *end, char close)
+{
+    char const *p = skip_value(*s, end);
+
+    if (NULL == p) {
+        return PNJ_FORMAT_ERROR;
+    }
+    p = skip_ws(p, end);
+    if ((p < end) && (close == *p)) {
+        return PNJ_NOT_FOUND;
+    }
+    if ((p >= end) || (*p != ',')) {
+        return PNJ_FORMAT_ERROR;
+    }
+    *s = skip_ws(p + 1, end);
+    return PNJ_OK;
+}
+
+
+/** Moves @p s from the start of an array to its element @p index */
+static enum pubnub_json_res find_element(char const **s, char const *end, unsigned long index)
+{
+    enum pubnub_json_res rslt = PNJ_OK;
+
+    if ((*s >= end) || (**s != '[')) {
+        return PNJ_NOT_FOUND;
+    }
+    *s = skip_ws(*s + 1, end);
+    if ((*s < end) && (']' == **s)) {
+        return PNJ_NOT_FOUND;
+    }
+    for (; (index > 0) && (PNJ_OK == rslt); --index) {
+        rslt = next_value(s, end, ']');
+    }
+    return rslt;
+}
+
+
+/** Moves @p s from the start of an object to the value of its key @p
+    key, of @p klen characters.
+*/
+static enum pubnub_json_res find_member(char const **s, char const *end, char const *key, size_t klen)
+{
+    enum pubnub_json_res rslt = PNJ_OK;
+    char const *p = *s;
+
+    if ((p >= end) || (*p != '{')) {
+        return PNJ_NOT_FOUND;
+    }
+    p = skip_ws(p + 1, end);
+    if ((p < end) && ('}' == *p)) {
+        return PNJ_NOT_FOUND;
+    }
+    while (PNJ_OK == rslt) {
+        char const *name = p;
+        bool match;
+
+        if ((p >= end) || (*p != '"') || (NULL == (p = skip_string(p, end)))) {
+            return PNJ_FORMAT_ERROR;
+        }
+        match = ((size_t)(p - name - 2) == klen) && (0 == memcmp(name + 1, key, klen));
+        p = skip_ws(p, end);
+        if ((p >= end) || (*p != ':')) {
+            return PNJ_FORMAT_ERROR;
+        }
+        p = skip_ws(p + 1, end);
+        if (match) {
+            *s = p;
+            return PNJ_OK;
+        }
+        rslt = next_value(&p, end, '}');
+    }
+    return rslt;
+}
+
+
+enum pubnub_json_res pubnub_json_get(char const *json, size_t len, char const *path, char const **val, size_t *vlen)
+{
+    char const *end = json + len;
+    char const *s = skip_ws(json, end);
+    enum pubnub_json_res rslt = PNJ_OK;
+
+    while ((*path != '\0') && (PNJ_OK == rslt)) {
+        if ('[' == *path) {
+            char *index_end;
+            unsigned long index = strtoul(path + 1, &index_end, 10);
+            if ((index_end == path + 1) || (*index_end != ']')) {
+                return PNJ_FORMAT_ERROR;
+            }
+            path = index_end + 1;
+            rslt = find_element(&s, end, index);
+        }
+        else {
+            size_t klen;
+            if ('.' == *path) {
+                ++path;
+            }
+            klen = strcspn(path, ".[");
+            if (0 == klen) {
+                return PNJ_FORMAT_ERROR;
+            }
+            rslt = find_member(&s, end, path, klen);
+            path += klen;
+        }
+    }
+    if (PNJ_OK == rslt) {
+        char const *vend = skip_value(s, end);
+        if (NULL == vend) {
+            return PNJ_FORMAT_ERROR;
+        }
+        *val = s;
+        *vlen = vend - s;
+    }
+
+    return rslt;
+}
+
+
+/** Appends decimal digit @p d to @p acc, unless the result would
+    exceed @p limit.
+*/
+static bool add_digit(unsigned long *acc, unsigned d, unsigned long limit)
+{
+    if (*acc > (limit - d) / 10) {
+        return false;
+    }
+    *acc = *acc * 10 + d;
+    return true;
+}
+
+
+static bool is_digit(char c)
+{
+    return (c >= '0') && (c <= '9');
+}
+
+
+enum pubnub_json_res pubnub_json_to_fixed(char const *val, size_t vlen, unsigned char decimals, long *n)
+{
+    char const *end = val + vlen;
+    unsigned long limit = LONG_MAX;
+    unsigned long acc = 0;
+    bool negative = false;
+    bool round_up = false;
+    bool dropped = false;
+    char const *start;
+
+    if ((val < end) && ('-' == *val)) {
+        negative = true;
+        limit = (unsigned long)LONG_MAX + 1;
+        ++val;
+    }
+    for (start = val; (val < end) && is_digit(*val); ++val) {
+        if (!add_digit(&acc, *val - '0', limit)) {
+            return PNJ_TYPE_ERROR;
+        }
+    }
+    if (val == start) {
+        return PNJ_TYPE_ERROR;
+    }
+    if ((val < end) && ('.' == *val)) {
+        for (start = ++val; (val < end) && is_digit(*val); ++val) {
+            if (decimals > 0) {
+                if (!add_digit(&acc, *val - '0', limit)) {
+                    return PNJ_TYPE_ERROR;
+                }
+                --decimals;
+            }
+            else if (!dropped) {
+                /* Only the first digit dropped decides the rounding */
+                round_up = (*val >= '5');
+                dropped = true;
+            }
+        }
+        if (val == start) {
+            return PNJ_TYPE_ERROR;
+        }
+    }
+    if (val != end) {
+        /* Exponent, or not a number at all */
+        return PNJ_TYPE_ERROR;
+    }
+    for (; decimals > 0; --decimals) {
+        if (!add_digit(&acc, 0, limit)) {
+            return PNJ_TYPE_ERROR;
+        }
+    }
+    if (round_up) {
+        if (acc == limit) {
+            return PNJ_TYPE_ERROR;
+        }
+        ++acc;
+    }
+    if (!negative) {
+        *n = (long)acc;
+    }
+    else if (acc > LONG_MAX) {
+        *n = LONG_MIN;
+    }
+    else {
+        *n = -(long)acc;
+    }
+
+    return PNJ_OK;
+}
+
+
+enum pubnub_json_res pubnub_json_to_long(char const *val, size_t vlen, long *n)
+{
+    if (memchr(val, '.', vlen) != NULL) {
+        return PNJ_TYPE_ERROR;
+    }
+    return pubnub_json_to_fixed(val, vlen, 0, n);
+}
+
+
+/** Reads the 4 hex digits at @p s into @p cp.
+    @return true: OK, false: not 4 hex digits (before @p end)
+*/
+static bool hex4(char const *s, char const *end, unsigned long *cp)
+{
+    int i;
+
+    if (end - s < 4) {
+        return false;
+    }
+    *cp = 0;
+    for (i = 0; i < 4; ++i) {
+        char c = s[i];
+        unsigned d;
+        if (is_digit(c)) {
+            d = c - '0';
+        }
+        else if ((c >= 'a') && (c <= 'f')) {
+            d = c - 'a' + 10;
+        }
+        else if ((c >= 'A') && (c <= 'F')) {
+            d = c - 'A' + 10;
+        }
+        else {
+            return false;
+        }
+        *cp = *cp * 16 + d;
+    }
+    return true;
+}
+
+
+/** Writes the Unicode code point @p cp at @p d in UTF-8.
+    @return The end of the written UTF-8 sequence
+*/
+static char *put_utf8(char *d, unsigned long cp)
+{
+    if (cp < 0x80) {
+        *d++ = cp;
+    }
+    else if (cp < 0x800) {
+        *d++ = 0xC0 | (cp >> 6);
+        *d++ = 0x80 | (cp & 0x3F);
+    }
+    else if (cp < 0x10000) {
+        *d++ = 0xE0 | (cp >> 12);
+        *d++ = 0x80 | ((cp >> 6) & 0x3F);
+        *d++ = 0x80 | (cp & 0x3F);
+    }
+    else {
+        *d++ = 0xF0 | (cp >> 18);
+        *d++ = 0x80 | ((cp >> 12) & 0x3F);
+        *d++ = 0x80 | ((cp >> 6) & 0x3F);
+        *d++ = 0x80 | (cp & 0x3F);
+    }
+    return d;
+}
+
+
+enum pubnub_json_res pubnub_json_unescape(char *val, size_t vlen, size_t *len)
+{
+    char const *s = val + 1;
+    char const *end = val + vlen - 1;
+    char *d = val;
+
+    if ((vlen < 2) || (val[0] != '"') || (val[vlen - 1] != '"')) {
+        return PNJ_TYPE_ERROR;
+    }
+    /* Unescaped is never longer, so it can't overtake the escaped */
+    while (s < end) {
+        unsigned long cp;
+        unsigned long low;
+        char c = *s++;
+
+        if (c != '\\') {
+            *d++ = c;
+            continue;
+        }
+        if (s >= end) {
+            return PNJ_TYPE_ERROR;
+        }
+        switch (c = *s++) {
+        case '"': case '\\': case '/': *d++ = c; break;
+        case 'b': *d++ = '\b'; break;
+        case 'f': *d++ = '\f'; break;
+        case 'n': *d++ = '\n'; break;
+        case 'r': *d++ = '\r'; break;
+        case 't': *d++ = '\t'; break;
+        case 'u':
+            if (!hex4(s, end, &cp)) {
+                return PNJ_TYPE_ERROR;
+            }
+            s += 4;
+            if ((cp >= 0xD800) && (cp < 0xDC00) && (end - s >= 6) && ('\\' == s[0]) && ('u' == s[1])
+                && hex4(s + 2, end, &low) && (low >= 0xDC00) && (low < 0xE000)) {
+                /* Surrogate pair */
+                cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                s += 6;
+            }
+            d = put_utf8(d, cp);
+            break;
+        default:
+            return PNJ_TYPE_ERROR;
+        }
+    }
+    *d = '\0';
+    *len = d - val;
+
+    return PNJ_OK;
+}
+
+
+/** Returns the next character of the string being decoded, at @p s,
+    moving @p s past it. Some JSON encoders escape @c '/', so the
+    escape is skipped.
+*/
+static char next_char(char const **s, char const *end)
+{
+    if (('\\' == **s) && (*s + 1 < end) && ('/' == (*s)[1])) {
+        ++*s;
+    }
+    return *(*s)++;
+}
+
+
+/** Returns the value of the base64 digit @p c, -1 if it isn't one */
+static int base64_value(char c)
+{
+    if ((c >= 'A') && (c <= 'Z')) {
+        return c - 'A';
+    }
+    if ((c >= 'a') && (c <= 'z')) {
+        return c - 'a' + 26;
+    }
+    if (is_digit(c)) {
+        return c - '0' + 52;
+    }
+    if (('+' == c) || ('-' == c)) {
+        return 62;
+    }
+    if (('/' == c) || ('_' == c)) {
+        return 63;
+    }
+    return -1;
+}
+
+
+enum pubnub_json_res pubnub_json_base64_decode(char *val, size_t vlen, size_t *len)
+{
+    char const *s = val + 1;
+    char const *end = val + vlen - 1;
+    char *d = val;
+    unsigned long group = 0;
+    unsigned n = 0;
+
+    if ((vlen < 2) || (val[0] != '"') || (val[vlen - 1] != '"')) {
+        return PNJ_TYPE_ERROR;
+    }
+    /* Every 4 characters read give 3 bytes, so writing stays behind */
+    while ((s < end) && (*s != '=')) {
+        int v = base64_value(next_char(&s, end));
+        if (v < 0) {
+            return PNJ_TYPE_ERROR;
+        }
+        group = (group << 6) | v;
+        if (4 == ++n) {
+            *d++ = group >> 16;
+            *d++ = group >> 8;
+            *d++ = group;
+            group = 0;
+            n = 0;
+        }
+    }
+    for (; s < end; ++s) {
+        if (*s != '=') {
+            return PNJ_TYPE_ERROR;
+        }
+    }
+    switch (n) {
+    case 1:
+        return PNJ_TYPE_ERROR;
+    case 2:
+        *d++ = group >> 4;
+        break;
+    case 3:
+        *d++ = group >> 10;
+        *d++ = group >> 2;
+        break;
+    default:
+        break;
+    }
+    *len = d - val;
+
+    return PNJ_OK;
+}
+
+
+/** Writes the first @p n bytes of the base85 @p group at @p d.
+    @return The end of the written bytes
+*/
+static char *put_group(char *d, unsigned long group, unsigned n)
+{
+    unsigned i;
+    for (i = 0; i < n; ++i) {
+        *d++ = group >> (24 - 8 * i);
+    }
+    return d;
+}
+
+
+enum pubnub_json_res pubnub_json_base85_decode(char *val, size_t vlen, size_t *len)
+{
+    static char const alphabet[] = "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ.-:+=^!/*?&<>()[]{}@%$#";
+    char const *s = val + 1;
+    char const *end = val + vlen - 1;
+    char *d = val;
+    unsigned long group = 0;
+    unsigned n = 0;
+
+    if ((vlen < 2) || (val[0] != '"') || (val[vlen - 1] != '"')) {
+        return PNJ_TYPE_ERROR;
+    }
+    /* Every 5 characters read give 4 bytes, so writing stays behind */
+    while (s < end) {
+        char c = next_char(&s, end);
+        char const *digit = (c != '\0') ? strchr(alphabet, c) : NULL;
+        unsigned v;
+        if (NULL == digit) {
+            return PNJ_TYPE_ERROR;
+        }
+        v = digit - alphabet;
+        if (group > (0xFFFFFFFFul - v) / 85) {
+            return PNJ_TYPE_ERROR;
+        }
+        group = group * 85 + v;
+        if (5 == ++n) {
+            d = put_group(d, group, 4);
+            group = 0;
+            n = 0;
+        }
+    }
+    if (1 == n) {
+        return PNJ_TYPE_ERROR;
+    }
+    if (n > 0) {
+        /* Pad with the highest digit, which rounds up what was cut off */
+        unsigned i;
+        for (i = n; i < 5; ++i) {
+            if (group > (0xFFFFFFFFul - 84) / 85) {
+                return PNJ_TYPE_ERROR;
+            }
+            group = group * 85 + 84;
+        }
+        d = put_group(d, group, n - 1);
+    }
+    *len = d - val;
+
+    return PNJ_OK;
+}
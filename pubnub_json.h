@@ -0,0 +1,115 @@
+/* -*- c-file-style:"stroustrup"; indent-tabs-mode: nil -*- */
+#ifndef PUBNUB_JSON_H
+#define	PUBNUB_JSON_H
+
+#include <stddef.h>
+
+/** @file pubnub_json.h
+
+    Helpers to read fields of received (JSON) messages, without
+    copying or allocating anything: values are found by a single
+    forward scan of the message and given as pointers into it.
+
+    They don't check that the message is valid JSON, but only what
+    they have to scan to get to the value, so they are fast, but
+    don't report all errors.
+*/
+
+/** Result of a JSON helper */
+enum pubnub_json_res {
+    /** Success */
+    PNJ_OK,
+    /** There is no value at the given path */
+    PNJ_NOT_FOUND,
+    /** The JSON (or the path) is not well formed */
+    PNJ_FORMAT_ERROR,
+    /** The value is not of the requested type, or doesn't fit */
+    PNJ_TYPE_ERROR
+};
+
+/** Finds the value at the @p path in the @p json text of @p len
+    bytes, like a message returned by pubnub_get().
+
+    The @p path is a sequence of object keys and array indexes, like
+    JavaScript: `"a.b[2]"` is the third element of the array that is
+    the value of key @c "b" in the object that is the value of key @c
+    "a" of the (top-level) object. Keys are compared to the keys in
+    the JSON as they are written, escapes and all, and can't contain
+    @c '.' or @c '['. An empty @p path gives the whole @p json.
+
+    @param json The JSON text, doesn't have to be NUL-terminated
+    @param len Length of @p json
+    @param path The path of the value to get
+    @param val Set to the start of the value in @p json, as it is
+    written: strings with quotes and escapes, objects and arrays
+    whole. Use the other helpers to convert it.
+    @param vlen Set to the length of the value
+
+    @return #PNJ_OK: found, #PNJ_NOT_FOUND: no such value,
+    #PNJ_FORMAT_ERROR: badly formed @p json or @p path
+ */
+enum pubnub_json_res pubnub_json_get(char const *json, size_t len, char const *path, char const **val, size_t *vlen);
+
+/** Converts the JSON number @p val of @p vlen bytes (as given by
+    pubnub_json_get()) to integer @p n. The number has to be an
+    integer (no fraction or exponent).
+
+    @return #PNJ_OK: converted, #PNJ_TYPE_ERROR: not an integer, or
+    doesn't fit in a long
+ */
+enum pubnub_json_res pubnub_json_to_long(char const *val, size_t vlen, long *n);
+
+/** Converts the JSON number @p val of @p vlen bytes (as given by
+    pubnub_json_get()) to fixed-point integer @p n, with @p decimals
+    decimal digits, rounded. For example, with 2 decimals, `21.375`
+    gives 2138 and `-4` gives -400. Exponents are not supported.
+
+    @return #PNJ_OK: converted, #PNJ_TYPE_ERROR: not a number (or
+    has an exponent), or doesn't fit in a long
+ */
+enum pubnub_json_res pubnub_json_to_fixed(char const *val, size_t vlen, unsigned char decimals, long *n);
+
+/** Unescapes the JSON string @p val of @p vlen bytes (as given by
+    pubnub_json_get(), with the quotes) in place: the unescaped
+    string, without quotes and NUL-terminated, is written over it,
+    starting at @p val. Unicode escapes are converted to UTF-8.
+
+    @note This changes the message it is in, so the message can't be
+    scanned (with pubnub_json_get()) past this string any more.
+
+    @param val The string, with quotes
+    @param vlen Length of @p val
+    @param len Set to the length of the unescaped string
+
+    @return #PNJ_OK: unescaped, #PNJ_TYPE_ERROR: not a (valid)
+    string, which may be left partly unescaped
+ */
+enum pubnub_json_res pubnub_json_unescape(char *val, size_t vlen, size_t *len);
+
+/** Decodes the base64 JSON string @p val of @p vlen bytes (as given
+    by pubnub_json_get(), with the quotes) in place: the binary data
+    is written over it, starting at @p val. Both the standard and the
+    URL safe alphabet are accepted, padding is optional.
+
+    @note This changes the message it is in, like
+    pubnub_json_unescape().
+
+    @param val The string, with quotes
+    @param vlen Length of @p val
+    @param len Set to the length of the binary data
+
+    @return #PNJ_OK: decoded, #PNJ_TYPE_ERROR: not a (valid) base64
+    string
+ */
+enum pubnub_json_res pubnub_json_base64_decode(char *val, size_t vlen, size_t *len);
+
+/** Decodes the base85 (Z85 alphabet) JSON string @p val of @p vlen
+    bytes in place, otherwise the same as pubnub_json_base64_decode().
+    The length of the string doesn't have to be a multiple of 5, a
+    last group of 2 to 4 characters gives one byte less than there
+    are characters.
+ */
+enum pubnub_json_res pubnub_json_base85_decode(char *val, size_t vlen, size_t *len);
+
+
+#endif        /* PUBNUB_JSON_H */